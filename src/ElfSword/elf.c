@@ -28,55 +28,43 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <search.h>
+#include "elf_private.h"
+#include "hindex.h"
 
-/* Elf mapping type */
-struct elf_struct {
-
-    /* Allocated data */
-    union {
-        void *data;             /* Memory mapped file */
-        uint8_t *data8b;        /* 8 bit pointer */
-        Elf32_Ehdr *header;     /* Elf header */
-    } file;
-    size_t len;                 /* File size */
-    int fd;                     /* File descriptor */
-
-    /* Auxiliary data */
-    Elf32_Shdr *names;          /* Section for name resolving */
-    struct hsearch_data sectab; /* Hash optimzier for sections */
-    struct hsearch_data symtab; /* Hash optimzier for symbols */
-
-    int symtab_magic;           /* Magic counter for symbol table: */
-
-    /*
-       ON MAGIC COUNTER:
-
-       While building the stdlib hash tables, it's necessary to provide
-       the size of the hash. If the hash table is overflowing there's no
-       way to put another element in.
-
-       The hash table is constructed in three steps:
-
-       - The first time "elf_section_get" is called, a complete scan is
-         performed, and while searching the algorithm will count the
-         number of registred symbols. This number, multiplied by -1, is
-         registred into the symtab_magic field of this structure;
-
-       - On the second search, since the number of symbols is known, the
-         search function builds the hash table. Since the number of
-         symbols is still negative the algorithm will scan all symbols and
-         store the names into the structure;
+/* String at ndx in strtab, or NULL unless it lies in the table and in
+ * the file, terminator included */
+static
+const char *checked_string(Elf elf, const Elf32_Shdr *strtab,
+                           Elf32_Word ndx)
+{
+    const char *str;
+    uint64_t off;
+    size_t max;
 
-       - From the third search on the hash table is used.
+    off = (uint64_t)strtab->sh_offset + ndx;
+    if (ndx >= strtab->sh_size || off >= elf->len)
+        return NULL;
+    str = (const char *)elf->file.data8b + off;
+    max = strtab->sh_size - ndx;
+    if (max > elf->len - off)
+        max = elf->len - off;
+    return memchr(str, '\0', max) != NULL ? str : NULL;
+}
 
-     */
-};
+/* Symbols of the table lying inside the file */
+static
+uint32_t symbols_count(Elf elf, const Elf32_Shdr *symtab)
+{
+    if (elf->trusted)
+        return symtab->sh_size / sizeof(Elf32_Sym);
+    return elf_table_len(elf, symtab->sh_offset,
+                         symtab->sh_size / sizeof(Elf32_Sym),
+                         sizeof(Elf32_Sym), sizeof(Elf32_Sym));
+}
 
 const char *elf_symbol_name(Elf elf, Elf32_Shdr *shdr, Elf32_Sym *yhdr)
 {
     const Elf32_Word sh_type = shdr->sh_type;
-    const Elf32_Ehdr *header = elf->file.header;
 
     if (sh_type != SHT_SYMTAB && sh_type != SHT_DYNSYM)
         return NULL;
@@ -85,30 +73,40 @@ const char *elf_symbol_name(Elf elf, Elf32_Shdr *shdr, Elf32_Sym *yhdr)
 
     /* shdr->sh_link contains the index of the associated string table.
      * Moving on the correct table */
-    shdr = (Elf32_Shdr *) ((elf->file.data8b + header->e_shoff)
-                           + (header->e_sheentsize * shdr->sh_link));
-    return (const char *)elf->file.data + shdr->sh_offset + yhdr->st_name;
+    if (elf->trusted) {
+        shdr = elf_shdr(elf, shdr->sh_link);
+        return (const char *)elf->file.data + shdr->sh_offset +
+                             yhdr->st_name;
+    }
+    if (shdr->sh_link >= elf->shnum)
+        return NULL;
+    return checked_string(elf, elf_shdr(elf, shdr->sh_link), yhdr->st_name);
 }
 
 void elf_section_content (Elf elf, Elf32_Shdr *shdr,
                           void **cont, size_t *size)
 {
+    bool inside;
+
+    inside = elf->trusted || shdr->sh_type == SHT_NOBITS ||
+             elf_in_file(elf, shdr->sh_offset, shdr->sh_size);
     if (cont != NULL)
-        *cont = (void *)(elf->file.data8b + shdr->sh_offset);
+        *cont = inside ? (void *)(elf->file.data8b + shdr->sh_offset)
+                       : NULL;
     if (size != NULL)
-        *size = shdr->sh_size;
+        *size = inside ? shdr->sh_size : 0;
 }
 
 const char *elf_section_name(Elf elf, Elf32_Shdr *shdr)
 {
     const Elf32_Shdr *names = elf->names;
 
-    if (names != NULL) {
+    if (names == NULL)
+        return NULL;
+    if (elf->trusted)
         return (const char *)elf->file.data + names->sh_offset +
                              shdr->sh_name;
-    } else {
-        return NULL;
-    }
+    return checked_string(elf, names, shdr->sh_name);
 }
 
 bool elf_symbols_scan(Elf elf, Elf32_Shdr *shdr, SymScan callback,
@@ -121,7 +119,7 @@ bool elf_symbols_scan(Elf elf, Elf32_Shdr *shdr, SymScan callback,
     if (sh_type != SHT_SYMTAB && sh_type != SHT_DYNSYM)
         return false;
 
-    nentr = shdr->sh_size / sizeof(Elf32_Sym);
+    nentr = symbols_count(elf, shdr);
     cursor = (Elf32_Sym *)(elf->file.data8b + shdr->sh_offset);
     while (nentr --) {
         if (!callback(udata, elf, shdr, cursor))
@@ -140,7 +138,7 @@ bool elf_sections_scan(Elf elf, SecScan callback, void *udata)
 
     header = elf->file.header;
     cursor = (Elf32_Shdr *)(elf->file.data8b + header->e_shoff);
-    sec_count = header->e_shnum;
+    sec_count = elf->shnum;
     sec_size = header->e_sheentsize;
 
     while (sec_count --) {
@@ -170,10 +168,14 @@ bool elf_release_file(Elf elf)
     if (elf != NULL) {
         ret  = munmap(elf->file.data, elf->len);
         ret += close(elf->fd);
-        hdestroy_r(&elf->sectab);
-        if (elf->symtab_magic > 0)
-            hdestroy_r(&elf->symtab);
-        free(elf);
+        if (elf->cache != NULL) {
+            ret += munmap(elf->cache, elf->cachelen);
+        } else {
+            elf_free(elf->arena, elf->secidx);
+            elf_free(elf->arena, atomic_load(&elf->symidx));
+        }
+        elf_free(elf->arena, atomic_load(&elf->addrs));
+        elf_free(elf->arena, elf);
         return ret >= 0;
     } else {
         return false;
@@ -183,63 +185,116 @@ bool elf_release_file(Elf elf)
 static
 bool hash_builder(void *udata, Elf elf, Elf32_Shdr *shdr)
 {
-    struct hsearch_data *sectab;
-    ENTRY e, *ret;
+    uint32_t *ndx;
+    const char *name;
 
-    sectab = (struct hsearch_data *)udata;
-    e.key = (char *)elf_section_name(elf, shdr);
-    e.data = (void *)shdr;
-    assert(hsearch_r(e, ENTER, &ret, sectab) != 0);
+    ndx = (uint32_t *)udata;
+    name = elf_section_name(elf, shdr);
+    if (name != NULL)
+        hindex_insert(elf->secidx, hindex_hash(name), *ndx);
+    (*ndx) ++;
+
+    /* Keeping track of the embedded hash table. The GNU one is preferred
+     * since its bloom filter discards most misses in a single probe. The
+     * tables are walked unchecked, so only validated ones are used, and
+     * only in their native layout, which translation doesn't cover */
+    if (elf->trusted && elf->native &&
+        (shdr->sh_type == SHT_GNU_HASH ||
+         (shdr->sh_type == SHT_HASH && elf->ehash == NULL)))
+        elf->ehash = shdr;
 
     return true;
 }
 
-Elf elf_map_file(const char *filename)
+/* The symbol table to be indexed */
+static
+Elf32_Shdr *symbol_table(Elf elf)
+{
+    Elf32_Shdr *symtab;
+
+    symtab = elf_section_get(elf, ".symtab");
+    if (symtab == NULL) {
+        /* Stripped file, only dynamic symbols are left */
+        symtab = elf_section_get(elf, ".dynsym");
+    }
+    return symtab;
+}
+
+void elf_sections_index(Elf elf)
+{
+    uint32_t ndx, n;
+
+    /* Hash for name optimizations */
+    n = elf->shnum;
+    elf->secidx = elf_alloc(elf->arena, hindex_size(n));
+    hindex_init(elf->secidx, n);
+    elf->ehash = NULL;
+    ndx = 0;
+    elf_sections_scan(elf, hash_builder, (void *)&ndx);
+    elf->symsec = symbol_table(elf);
+}
+
+Elf elf_map_raw(ElfArena arena, const char *filename, struct stat *st)
 {
     int fd;
-    struct stat buf;
     size_t len;
     uint8_t *secarray;
     Elf elf;
     Elf32_Ehdr *header;
-    struct hsearch_data *sectab;
 
     /* Control structure allocation */
-    elf = malloc(sizeof(struct elf_struct));
-    assert(elf != NULL);
+    elf = elf_alloc(arena, sizeof(struct elf_struct));
+    elf->arena = arena;
 
     /* File mapping */
     fd = open(filename, O_RDONLY);
     if (fd == -1)
         goto fail0;
-    if (fstat(fd, &buf) == -1)
+    if (fstat(fd, st) == -1)
+        goto fail1;
+    elf->len = len = st->st_size;
+    if (len < sizeof(Elf32_Ehdr))
+        goto fail1;
+    elf->file.data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (elf->file.data == MAP_FAILED)
         goto fail1;
-    elf->len = len = buf.st_size;
-    elf->file.data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
     elf->fd = fd;
 
     /* Magic number checking */
     if (!check_magic(elf))
         goto fail2;
-   
-    /* Section names retriving */
+
+    /* Other classes and byte orders are turned into the native layout */
+    if (!elf_translate(elf))
+        goto fail2;
+
+    /* Header tables actually inside the file */
     header = elf->file.header;
+    elf->shnum = elf_table_len(elf, header->e_shoff, header->e_shnum,
+                               header->e_sheentsize, sizeof(Elf32_Shdr));
+    elf->phnum = elf_table_len(elf, header->e_phoff, header->e_phnum,
+                               header->e_phentsize, sizeof(Elf32_Phdr));
+
+    /* Section names retriving */
     len = header->e_sheentsize;
     secarray = (elf->file.data8b + header->e_shoff);
-    if (header->e_shstrndx == SHN_UNDEF)
+    if (header->e_shstrndx == SHN_UNDEF || header->e_shstrndx >= elf->shnum)
         elf->names = NULL;
     else
         elf->names = (Elf32_Shdr *) (secarray + header->e_shstrndx * len);
 
-    /* Hash for name optimizations */
-    sectab = &elf->sectab;
-    memset(sectab, 0, sizeof(struct hsearch_data));
-    assert(hcreate_r(len, sectab));
-    elf_sections_scan(elf, hash_builder, (void *)sectab);
-
-    /* Setting sections magic index */
-    elf->symtab_magic = 0;
-    
+    /* Validated by the caller: accessors keep their checks until then */
+    elf->trusted = false;
+
+    /* Indexes are built by the caller */
+    elf->secidx = NULL;
+    elf->ehash = NULL;
+    elf->symsec = NULL;
+    atomic_init(&elf->symidx, NULL);
+    atomic_init(&elf->addrs, NULL);
+    elf->cache = NULL;
+    elf->cachelen = 0;
+
     return elf;
 
   fail2:
@@ -247,26 +302,82 @@ Elf elf_map_file(const char *filename)
   fail1:
     close(fd);
   fail0:
-    free(elf);
+    elf_free(arena, elf);
     return NULL;
 }
 
+Elf elf_map_file_in(ElfArena arena, const char *filename)
+{
+    struct stat buf;
+    Elf elf;
+
+    if ((elf = elf_map_raw(arena, filename, &buf)) == NULL)
+        return NULL;
+    elf->trusted = elf_validate(elf);
+    elf_sections_index(elf);
+    if (arena != NULL)
+        elf_arena_count(arena);
+    return elf;
+}
+
+Elf elf_map_file(const char *filename)
+{
+    return elf_map_file_in(NULL, filename);
+}
+
+uint64_t elf_content_hash(Elf elf)
+{
+    const uint8_t *cursor;
+    uint64_t h, w;
+    size_t len;
+
+    /* Word-wise multiplicative hash: fast, not cryptographic */
+    h = 0xcbf29ce484222325ULL ^ elf->len;
+    cursor = elf->file.data8b;
+    for (len = elf->len; len >= sizeof(w); len -= sizeof(w)) {
+        memcpy(&w, cursor, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+        cursor += sizeof(w);
+    }
+    while (len --)
+        h = (h ^ *cursor++) * 0x100000001b3ULL;
+    return h;
+}
+
 const uint8_t * elf_get_content(Elf elf)
 {
     return elf->file.data8b;
 }
 
-Elf32_Shdr *elf_section_get(Elf elf, const char *secname)
+struct sec_match {
+    Elf elf;
+    const char *name;
+};
+
+static
+bool sec_matcher(void *udata, uint32_t ndx)
 {
-    ENTRY key = {
-        .key = (char *)secname,
-        .data = NULL
-    };
-    ENTRY *entry;
+    struct sec_match *m;
+    const char *name;
+
+    m = (struct sec_match *)udata;
+    if (ndx >= m->elf->shnum)
+        return false;
+    name = elf_section_name(m->elf, elf_shdr(m->elf, ndx));
+    return name != NULL && strcmp(m->name, name) == 0;
+}
 
-    return hsearch_r(key, FIND, &entry, &elf->sectab) == 0
-           ? NULL
-           : (Elf32_Shdr *) entry->data;
+Elf32_Shdr *elf_section_get(Elf elf, const char *secname)
+{
+    struct sec_match m;
+    uint32_t ndx;
+
+    m.elf = elf;
+    m.name = secname;
+    ndx = hindex_find(elf->secidx, hindex_hash(secname), sec_matcher,
+                      (void *)&m);
+    return ndx == HINDEX_NONE ? NULL : elf_shdr(elf, ndx);
 }
 
 bool elf_progheader_scan(Elf elf, PHeaderScan callback, void *udata)
@@ -276,7 +387,7 @@ bool elf_progheader_scan(Elf elf, PHeaderScan callback, void *udata)
     Elf32_Phdr *cursor;
 
     header = elf->file.header;
-    nents = header->e_phnum;
+    nents = elf->phnum;
     if (nents == 0)
         return false;
     size = header->e_phentsize;
@@ -289,74 +400,501 @@ bool elf_progheader_scan(Elf elf, PHeaderScan callback, void *udata)
     return true;
 }
 
-struct track {
-    Elf32_Sym *ret;
-    int oldmagic;
-    const char *name;
+struct index_build {
+    HIndex idx;                 /* Index being built */
+    uint32_t ndx;               /* Position of the scanned symbol */
 };
 
 static
-bool sym_scanner(void *udata, Elf elf, Elf32_Shdr *shdr,
-                 Elf32_Sym *yhdr)
+bool index_builder(void *udata, Elf elf, Elf32_Shdr *shdr,
+                   Elf32_Sym *yhdr)
 {
-    struct track *t;
+    struct index_build *b;
     const char *sym_name;
-    ENTRY e, *ret;
 
-    t = (struct track *)udata;
+    b = (struct index_build *)udata;
 
     /* sym_name may be null if the symbol has no name */
-    if ((sym_name = elf_symbol_name(elf, shdr, yhdr)) != NULL) {
-        if (strcmp(t->name, sym_name) == 0) {
-            /* We found the searched symbol */
-            t->ret = yhdr;
-        }
-        if (t->oldmagic == 0) {
-            /* We are still counting elements */
-            elf->symtab_magic ++;
-        } else {
-            /* We are filling the table with symbol names */
-            e.key = (char *)sym_name;
-            e.data = (void *)yhdr;
-            assert(hsearch_r(e, ENTER, &ret, &elf->symtab));
+    sym_name = elf_symbol_name(elf, shdr, yhdr);
+    if (sym_name != NULL && sym_name[0] != '\0')
+        hindex_insert(b->idx, hindex_hash(sym_name), b->ndx);
+    b->ndx ++;
+    return true;
+}
+
+/* The symbol index, built on first use. Threads racing on the first use
+ * build their own copy, and all but the first one to publish it throw
+ * it away. */
+static
+HIndex symbol_index(Elf elf)
+{
+    Elf32_Shdr *symtab;
+    struct index_build b;
+    uint32_t nsyms;
+    HIndex idx;
+
+    idx = atomic_load_explicit(&elf->symidx, memory_order_acquire);
+    if (idx != NULL || (symtab = elf->symsec) == NULL)
+        return idx;
+
+    /* The number of symbols is known from the section size, so the
+     * index is sized and filled in a single scan */
+    nsyms = symbols_count(elf, symtab);
+    b.idx = elf_alloc(elf->arena, hindex_size(nsyms));
+    hindex_init(b.idx, nsyms);
+    b.ndx = 0;
+    elf_symbols_scan(elf, symtab, index_builder, (void *)&b);
+
+    idx = NULL;
+    if (atomic_compare_exchange_strong_explicit(&elf->symidx, &idx, b.idx,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire))
+        return b.idx;
+    elf_free(elf->arena, b.idx);
+    return idx;
+}
+
+bool elf_index_build(Elf elf)
+{
+    return symbol_index(elf) != NULL;
+}
+
+struct sym_match {
+    Elf elf;
+    const char *name;
+};
+
+static
+bool sym_matcher(void *udata, uint32_t ndx)
+{
+    struct sym_match *m;
+    Elf32_Sym *yhdr;
+    const char *name;
+
+    m = (struct sym_match *)udata;
+    if (ndx >= symbols_count(m->elf, m->elf->symsec))
+        return false;
+    yhdr = (Elf32_Sym *)(m->elf->file.data8b + m->elf->symsec->sh_offset)
+           + ndx;
+    name = elf_symbol_name(m->elf, m->elf->symsec, yhdr);
+    return name != NULL && strcmp(m->name, name) == 0;
+}
+
+static
+Elf32_Sym *index_lookup(Elf elf, const char *name)
+{
+    struct sym_match m;
+    HIndex idx;
+    uint32_t ndx;
+
+    if ((idx = symbol_index(elf)) == NULL)
+        return NULL;
+
+    m.elf = elf;
+    m.name = name;
+    ndx = hindex_find(idx, hindex_hash(name), sym_matcher, (void *)&m);
+    if (ndx == HINDEX_NONE)
+        return NULL;
+    return (Elf32_Sym *)(elf->file.data8b + elf->symsec->sh_offset) + ndx;
+}
+
+/* Standard ELF hash function, used by SHT_HASH sections */
+static
+uint32_t sysv_hash(const char *name)
+{
+    uint32_t h = 0, g;
+    unsigned char c;
+
+    while ((c = (unsigned char)*name++) != '\0') {
+        h = (h << 4) + c;
+        if ((g = h & 0xf0000000) != 0)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+static
+Elf32_Sym *sysv_lookup(Elf elf, Elf32_Shdr *hsec, const char *name)
+{
+    const Elf32_Word *words, *bucket, *chain;
+    Elf32_Shdr *dynsym;
+    Elf32_Sym *syms;
+    Elf32_Word nbucket, nchain, i, n;
+    const char *sym_name;
+
+    words = (const Elf32_Word *)(elf->file.data8b + hsec->sh_offset);
+    nbucket = words[0];
+    nchain = words[1];
+    if (nbucket == 0)
+        return NULL;
+    bucket = words + 2;
+    chain = bucket + nbucket;
+
+    dynsym = elf_shdr(elf, hsec->sh_link);
+    syms = (Elf32_Sym *)(elf->file.data8b + dynsym->sh_offset);
+    /* A chain visits each symbol at most once: a longer walk is a cycle,
+     * which validation doesn't look for */
+    i = bucket[sysv_hash(name) % nbucket];
+    for (n = 0; i != 0 && i < nchain && n < nchain; i = chain[i], n ++) {
+        sym_name = elf_symbol_name(elf, dynsym, syms + i);
+        if (sym_name != NULL && strcmp(name, sym_name) == 0)
+            return syms + i;
+    }
+    return NULL;
+}
+
+static
+Elf32_Sym *gnu_lookup(Elf elf, Elf32_Shdr *hsec, const char *name)
+{
+    const Elf32_Word *words, *bloom, *buckets, *chain;
+    Elf32_Shdr *dynsym;
+    Elf32_Sym *syms;
+    Elf32_Word nbuckets, symoffset, bloom_size, bloom_shift;
+    Elf32_Word h, word, mask, i, h2;
+    const char *sym_name;
+
+    words = (const Elf32_Word *)(elf->file.data8b + hsec->sh_offset);
+    nbuckets = words[0];
+    symoffset = words[1];
+    bloom_size = words[2];
+    bloom_shift = words[3];
+    if (nbuckets == 0 || bloom_size == 0)
+        return NULL;
+    bloom = words + 4;
+    buckets = bloom + bloom_size;
+    chain = buckets + nbuckets;
+
+    h = hindex_hash(name);
+    word = bloom[(h / 32) % bloom_size];
+    mask = (1u << (h % 32)) | (1u << ((h >> bloom_shift) % 32));
+    if ((word & mask) != mask)
+        return NULL;
+
+    i = buckets[h % nbuckets];
+    if (i < symoffset)
+        return NULL;
+
+    dynsym = elf_shdr(elf, hsec->sh_link);
+    syms = (Elf32_Sym *)(elf->file.data8b + dynsym->sh_offset);
+    do {
+        h2 = chain[i - symoffset];
+        if ((h | 1) == (h2 | 1)) {
+            sym_name = elf_symbol_name(elf, dynsym, syms + i);
+            if (sym_name != NULL && strcmp(name, sym_name) == 0)
+                return syms + i;
         }
+        i ++;
+    } while ((h2 & 1) == 0);
+    return NULL;
+}
+
+static
+Elf32_Sym *embedded_lookup(Elf elf, const char *name)
+{
+    Elf32_Shdr *hsec = elf->ehash;
+
+    if (hsec == NULL)
+        return NULL;
+    return hsec->sh_type == SHT_GNU_HASH ? gnu_lookup(elf, hsec, name)
+                                         : sysv_lookup(elf, hsec, name);
+}
+
+Elf32_Sym *elf_symbol_lookup(Elf elf, const char *name, ElfLookup engine)
+{
+    Elf32_Sym *ret;
+
+    switch (engine) {
+        case ELF_LOOKUP_EMBEDDED:
+            return embedded_lookup(elf, name);
+        case ELF_LOOKUP_INDEX:
+            return index_lookup(elf, name);
+        case ELF_LOOKUP_AUTO:
+        default:
+            break;
     }
-    return true;
+
+    if (elf->ehash == NULL)
+        return index_lookup(elf, name);
+    if ((ret = embedded_lookup(elf, name)) != NULL)
+        return ret;
+
+    /* The embedded table only covers the dynamic symbols: the miss is
+     * final unless the file also carries a full .symtab */
+    if (elf_section_get(elf, ".symtab") == NULL)
+        return NULL;
+    return index_lookup(elf, name);
 }
 
 Elf32_Sym *elf_symbol_get(Elf elf, const char *name)
+{
+    return elf_symbol_lookup(elf, name, ELF_LOOKUP_AUTO);
+}
+
+Elf32_Shdr *elf_section_at(Elf elf, unsigned ndx)
+{
+    if (ndx == SHN_UNDEF || ndx >= elf->shnum)
+        return NULL;
+    return elf_shdr(elf, ndx);
+}
+
+struct resolve {
+    const char **names;         /* Requested names */
+    Elf32_Sym **out;            /* Output array */
+    HIndex idx;                 /* Index on requested names */
+    size_t missing;             /* Names still to be found */
+    const char *sym_name;       /* Name of the scanned symbol */
+};
+
+static
+bool name_matcher(void *udata, uint32_t ndx)
+{
+    struct resolve *r = (struct resolve *)udata;
+
+    return r->out[ndx] == NULL && strcmp(r->names[ndx], r->sym_name) == 0;
+}
+
+static
+bool resolve_scanner(void *udata, Elf elf, Elf32_Shdr *shdr,
+                     Elf32_Sym *yhdr)
+{
+    struct resolve *r;
+    uint32_t ndx;
+
+    r = (struct resolve *)udata;
+    r->sym_name = elf_symbol_name(elf, shdr, yhdr);
+    if (r->sym_name == NULL || r->sym_name[0] == '\0')
+        return true;
+
+    /* The first symbol with the name wins, as with the index, for every
+     * request of that name */
+    while ((ndx = hindex_find(r->idx, hindex_hash(r->sym_name),
+                              name_matcher, udata)) != HINDEX_NONE) {
+        r->out[ndx] = yhdr;
+        r->missing --;
+    }
+    /* Stopping as soon as everything has been found */
+    return r->missing > 0;
+}
+
+size_t elf_symbols_resolve(Elf elf, const char **names, size_t n,
+                           Elf32_Sym **out)
 {
     Elf32_Shdr *symtab;
-    struct hsearch_data *htab;
-    ENTRY key, *entry;
-    struct track t;
+    struct resolve r;
+    size_t i, found;
+
+    memset(out, 0, sizeof(Elf32_Sym *) * n);
+    if (n == 0)
+        return 0;
+
+    /* Same rule as elf_symbol_get, whatever the path: the embedded table
+     * first, then the first symbol table entry with the name */
+    found = 0;
+    if (elf->ehash != NULL) {
+        for (i = 0; i < n; i ++)
+            if ((out[i] = embedded_lookup(elf, names[i])) != NULL)
+                found ++;
+        if (found == n || elf_section_get(elf, ".symtab") == NULL)
+            return found;
+    }
 
-    symtab = elf_section_get(elf, ".symtab");
-    if (symtab == NULL)
+    if (atomic_load_explicit(&elf->symidx, memory_order_acquire) != NULL) {
+        for (i = 0; i < n; i ++)
+            if (out[i] == NULL &&
+                (out[i] = index_lookup(elf, names[i])) != NULL)
+                found ++;
+        return found;
+    }
+
+    if ((symtab = elf->symsec) == NULL)
+        return found;
+
+    /* No index yet: the names still missing are hashed instead, and the
+     * symbol table is scanned once against them */
+    r.names = names;
+    r.out = out;
+    r.idx = hindex_new(n - found);
+    r.missing = n - found;
+    for (i = 0; i < n; i ++)
+        if (out[i] == NULL)
+            hindex_insert(r.idx, hindex_hash(names[i]), i);
+    elf_symbols_scan(elf, symtab, resolve_scanner, (void *)&r);
+    free(r.idx);
+
+    return n - r.missing;
+}
+
+static
+bool addr_eligible(Elf32_Sym *yhdr)
+{
+    unsigned char type = ELF32_ST_TYPE(yhdr->st_info);
+
+    if (yhdr->st_name == 0 || yhdr->st_shndx == SHN_UNDEF)
+        return false;
+    return type == STT_FUNC || type == STT_OBJECT || type == STT_NOTYPE;
+}
+
+/* Sorting by address. On equal address, sized symbols come first and
+ * global ones are preferred over locals, so that the first entry is the
+ * one to be kept */
+static
+int addr_compare(const void *a, const void *b, void *udata)
+{
+    const struct addr_ent *ea = a, *eb = b;
+    Elf32_Sym *syms = udata;
+
+    if (ea->value != eb->value)
+        return ea->value < eb->value ? -1 : 1;
+    if ((ea->size == 0) != (eb->size == 0))
+        return ea->size == 0 ? 1 : -1;
+    if (ELF32_ST_BIND(syms[ea->ndx].st_info) !=
+        ELF32_ST_BIND(syms[eb->ndx].st_info))
+        return ELF32_ST_BIND(syms[ea->ndx].st_info) == STB_LOCAL ? 1 : -1;
+    return ea->ndx < eb->ndx ? -1 : ea->ndx > eb->ndx;
+}
+
+/* The address index, built on first use and published as the symbol
+ * index is */
+static
+struct addr_index *addr_index(Elf elf)
+{
+    Elf32_Shdr *symtab;
+    Elf32_Sym *syms;
+    struct addr_index *ai, *cur;
+    struct addr_ent *ents;
+    uint32_t nsyms, i, n, j;
+    Elf32_Addr end;
+
+    ai = atomic_load_explicit(&elf->addrs, memory_order_acquire);
+    if (ai != NULL || (symtab = elf->symsec) == NULL)
+        return ai;
+
+    syms = (Elf32_Sym *)(elf->file.data8b + symtab->sh_offset);
+    nsyms = symbols_count(elf, symtab);
+
+    /* Sized on the eligible symbols, since arena memory can't shrink */
+    for (i = 0, n = 0; i < nsyms; i ++)
+        if (addr_eligible(syms + i))
+            n ++;
+    ai = elf_alloc(elf->arena, sizeof(struct addr_index) +
+                               sizeof(struct addr_ent) * n);
+    ents = ai->ents;
+
+    for (i = 0, n = 0; i < nsyms; i ++) {
+        if (!addr_eligible(syms + i))
+            continue;
+        ents[n].value = syms[i].st_value;
+        ents[n].size = syms[i].st_size;
+        ents[n].ndx = i;
+        n ++;
+    }
+    qsort_r(ents, n, sizeof(struct addr_ent), addr_compare, syms);
+
+    /* Dropping duplicated addresses and sizeless labels falling inside a
+     * previous symbol: they would hide the enclosing one */
+    end = 0;
+    for (i = 0, j = 0; i < n; i ++) {
+        if (j > 0 && ents[i].value == ents[j - 1].value)
+            continue;
+        if (ents[i].size == 0 && ents[i].value < end)
+            continue;
+        if (ents[i].size != 0 && ents[i].value + ents[i].size > end)
+            end = ents[i].value + ents[i].size;
+        ents[j ++] = ents[i];
+    }
+
+    ai->n = j;
+
+    cur = NULL;
+    if (atomic_compare_exchange_strong_explicit(&elf->addrs, &cur, ai,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire))
+        return ai;
+    elf_free(elf->arena, ai);
+    return cur;
+}
+
+static inline
+bool addr_contains(const struct addr_ent *ent, Elf32_Addr addr)
+{
+    return ent->size == 0 ? addr == ent->value
+                          : addr - ent->value < ent->size;
+}
+
+static inline
+Elf32_Sym *addr_symbol(Elf elf, const struct addr_ent *ent)
+{
+    return (Elf32_Sym *)(elf->file.data8b + elf->symsec->sh_offset) +
+           ent->ndx;
+}
+
+Elf32_Sym *elf_symbol_at(Elf elf, Elf32_Addr addr)
+{
+    const struct addr_index *ai;
+    const struct addr_ent *ents;
+    uint32_t lo, hi, mid;
+
+    if ((ai = addr_index(elf)) == NULL)
         return NULL;
 
-    t.oldmagic = elf->symtab_magic;
-    if (t.oldmagic <= 0) {
-        if (t.oldmagic != 0) {
-            /* We know the number of elements; building hash table */
-            htab = &elf->symtab;
-            memset(htab, 0, sizeof(struct hsearch_data));
-            assert(hcreate_r(-t.oldmagic, htab));
+    /* Searching the last entry starting at or before addr */
+    ents = ai->ents;
+    lo = 0;
+    hi = ai->n;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ents[mid].value <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || !addr_contains(&ents[lo - 1], addr))
+        return NULL;
+    return addr_symbol(elf, &ents[lo - 1]);
+}
+
+size_t elf_symbols_at(Elf elf, const Elf32_Addr *addrs, size_t n,
+                      Elf32_Sym **out)
+{
+    const struct addr_index *ai;
+    const struct addr_ent *ents;
+    size_t i, found;
+    uint32_t j, nents;
+    bool sorted;
+
+    if ((ai = addr_index(elf)) == NULL) {
+        memset(out, 0, sizeof(Elf32_Sym *) * n);
+        return 0;
+    }
+
+    sorted = true;
+    for (i = 1; i < n && sorted; i ++)
+        sorted = addrs[i - 1] <= addrs[i];
+
+    found = 0;
+    if (!sorted) {
+        for (i = 0; i < n; i ++)
+            if ((out[i] = elf_symbol_at(elf, addrs[i])) != NULL)
+                found ++;
+        return found;
+    }
+
+    /* Sorted input: merging the two sequences, each entry is visited
+     * once at most */
+    ents = ai->ents;
+    nents = ai->n;
+    for (i = 0, j = 0; i < n; i ++) {
+        while (j < nents && ents[j].value <= addrs[i])
+            j ++;
+        if (j > 0 && addr_contains(&ents[j - 1], addrs[i])) {
+            out[i] = addr_symbol(elf, &ents[j - 1]);
+            found ++;
+        } else {
+            out[i] = NULL;
         }
-        t.name = name;
-        t.ret = NULL;
-        elf_symbols_scan(elf, symtab, sym_scanner, (void *)&t);
-        elf->symtab_magic *= -1;
-        return t.ret;
-    } else {
-        /* Elements are already stored into the hash table, so we can use
-         * it */
-        key.key = (char *)name;
-        key.data = NULL;
-        return hsearch_r(key, FIND, &entry, &elf->symtab) == 0
-               ? NULL
-               : (Elf32_Sym *) entry->data;
     }
+    return found;
 }
 
 static bool prog_header_scanner(void *udata, Elf elf, Elf32_Phdr *phdr)
@@ -366,7 +904,8 @@ static bool prog_header_scanner(void *udata, Elf elf, Elf32_Phdr *phdr)
 
     if (phdr->p_type == PT_DYNAMIC) {
         sec = elf_section_get(elf, ".dynamic");
-        check = (sec->sh_offset == phdr->p_offset) &&
+        check = (sec != NULL) &&
+                (sec->sh_offset == phdr->p_offset) &&
                 (sec->sh_size == phdr->p_filesz);
         *((bool *)udata) = check;
         /* Since we found the segment we return false: this will honor the
@@ -384,15 +923,16 @@ bool elf_check_format(Elf elf)
 {
     bool check;
 
+    /* Headers, offsets, sizes, links and strings, checked at mapping
+     * time */
+    if (!elf->trusted)
+        return false;
+
     /* Checking corrispondence between .dynamic section and PT_DYNAMIC
      * segment. This is achieved by scanning the segment array; if there's
      * no such segment the check is void. */
-    if (elf_progheader_scan(elf, prog_header_scanner, (void *)&check) &&
-        !check)
-        return false;
-
-    /* TODO add here further checks */
-
-    return true;
+    check = true;
+    elf_progheader_scan(elf, prog_header_scanner, (void *)&check);
+    return check;
 }
 
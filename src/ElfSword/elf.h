@@ -24,18 +24,111 @@
 #include <stdlib.h>
 #include "elf_specification.h"
 
-/** ELF structure information holding data type */
+/** ELF structure information holding data type
+ *
+ * An Elf object can be shared by threads: the indexes built on first
+ * use are published atomically, and lookups take no locks.
+ */
 typedef struct elf_struct * Elf;
 
 /** ELF file mapper
  *
  * Produces an Elf object by mapping the given file in memory
  *
+ * Files of any class and byte order are accepted: the headers and
+ * symbol tables of the ones not in the native 32-bit layout are
+ * translated once, at mapping time, in a private copy of the mapping.
+ * Section contents are left as they are. Files with values not fitting
+ * in 32 bits are rejected.
+ *
  * @param filename The name of the ELF file to be mapped;
  * @return an Elf object or NULL on failure (i.e. invalid file).
  */
 Elf elf_map_file(const char *filename);
 
+/** Arena for Elf objects
+ *
+ * A single reserved memory region from which Elf objects mapped with
+ * elf_map_file_in take their control structure and all their indexes.
+ * The whole region is handed back at once by elf_arena_reset, making
+ * room for the next batch of files without going through the general
+ * purpose allocator. Once the region is full, allocations spill to the
+ * general purpose allocator, and are released with their Elf object.
+ */
+typedef struct elf_arena * ElfArena;
+
+/** Default arena capacity, in bytes of address space */
+#define ELF_ARENA_DEFAULT (256UL << 20)
+
+/** Arena statistics */
+struct elf_arena_stats {
+    size_t used;                /* Bytes in use since the last reset */
+    size_t high_water;          /* Most bytes ever in use at once */
+    size_t capacity;            /* Region size */
+    unsigned files;             /* Files mapped since the last reset */
+    size_t spilled;             /* Bytes allocated outside the region,
+                                   since the last reset */
+};
+
+/** Arena constructor
+ *
+ * Reserves the region: memory is only committed as the arena fills up.
+ *
+ * @param capacity The region size, or 0 for ELF_ARENA_DEFAULT;
+ * @return The arena, or NULL if the region can't be reserved.
+ */
+ElfArena elf_arena_new(size_t capacity);
+
+/** Arena reset
+ *
+ * Releases the memory of every Elf object mapped in the arena, in
+ * constant time.
+ *
+ * @note The objects must have been released with elf_release_file, which
+ *       unmaps their file, and can't be used anymore.
+ *
+ * @param arena The arena.
+ */
+void elf_arena_reset(ElfArena arena);
+
+/** Arena destructor
+ *
+ * @param arena The arena, reset implicitly.
+ */
+void elf_arena_free(ElfArena arena);
+
+/** Arena statistics getter
+ *
+ * @param arena The arena;
+ * @param stats Will contain the statistics.
+ */
+void elf_arena_stats(ElfArena arena, struct elf_arena_stats *stats);
+
+/** ELF file mapper on arena
+ *
+ * Same as elf_map_file, but the Elf object and its indexes, including
+ * the ones built lazily, are allocated in the arena.
+ *
+ * @param arena The arena, or NULL for the general purpose allocator;
+ * @param filename The name of the ELF file to be mapped;
+ * @return an Elf object or NULL on failure (i.e. invalid file).
+ */
+Elf elf_map_file_in(ElfArena arena, const char *filename);
+
+/** ELF file mapper with index cache
+ *
+ * Same as elf_map_file, but the section and symbol indexes are loaded
+ * from a cache file kept next to the ELF file. If the cache is missing,
+ * stale or corrupted the indexes are built and the cache is written
+ * again; failing to write it is not an error.
+ *
+ * @param filename The name of the ELF file to be mapped;
+ * @param cachefile The name of the cache file, or NULL for the default
+ *                  one (filename with ".idx" appended);
+ * @return an Elf object or NULL on failure (i.e. invalid file).
+ */
+Elf elf_map_file_cached(const char *filename, const char *cachefile);
+
 /** ELF file releaser
  *
  * Frees the Elf object
@@ -52,6 +145,16 @@ bool elf_release_file(Elf elf);
  */
 const uint8_t * elf_get_content(Elf elf);
 
+/** ELF content hash
+ *
+ * Computes a 64 bit hash of the whole file content. The hash is meant
+ * to detect changes, not to be cryptographically strong.
+ *
+ * @param elf The ELF file;
+ * @return The hash value.
+ */
+uint64_t elf_content_hash(Elf elf);
+
 /** Section getter
  *
  * Retrieves a section by searching the given name on the sections hash
@@ -64,6 +167,15 @@ const uint8_t * elf_get_content(Elf elf);
  */
 Elf32_Shdr * elf_section_get(Elf elf, const char *secname);
 
+/** Section getter by index
+ *
+ * @param elf The Elf object;
+ * @param ndx The index of the section (e.g. a symbol's st_shndx);
+ * @return A pointer to the section header or NULL if the index doesn't
+ *         refer to a section.
+ */
+Elf32_Shdr * elf_section_at(Elf elf, unsigned ndx);
+
 /** Section name getter
  *
  * Retrieves the name of the given section from the ELF string table
@@ -71,7 +183,7 @@ Elf32_Shdr * elf_section_get(Elf elf, const char *secname);
  * @param elf The Elf object;
  * @param shdr The section header;
  * @return The section name or NULL if the ELF file doesn't have a string
- *         table.
+ *         table, or if the name doesn't lie within it.
  */
 const char * elf_section_name(Elf elf, Elf32_Shdr *shdr);
 
@@ -84,6 +196,9 @@ const char * elf_section_name(Elf elf, Elf32_Shdr *shdr);
  * @param shdr The section header;
  * @param cont The pointer to be moved on the section content;
  * @param size Will contain the size of the section content in bytes.
+ *
+ * @note On files failing the format check, a section not lying within
+ *       the file has NULL content and size 0.
  */
 void elf_section_content(Elf elf, Elf32_Shdr *shdr, void **cont,
                          size_t *size);
@@ -153,9 +268,47 @@ typedef bool (*SymScan)(void *udata, Elf elf, Elf32_Shdr *shdr,
 bool elf_symbols_scan(Elf elf, Elf32_Shdr *shdr, SymScan callback,
                       void *udata);
 
+/** Symbol index builder
+ *
+ * Builds the hash index of the .symtab section (or .dynsym, for stripped
+ * files) with a single scan of the symbol table. Calling this function
+ * is optional: elf_symbol_get builds the index on the first lookup if
+ * it's missing.
+ *
+ * @param elf The Elf object;
+ * @return false if the ELF file has neither a .symtab nor a .dynsym
+ *         section, true if the index is available.
+ */
+bool elf_index_build(Elf elf);
+
+/** Symbol lookup engines */
+typedef enum {
+    ELF_LOOKUP_AUTO = 0,        /* Embedded table first, then the index */
+    ELF_LOOKUP_EMBEDDED,        /* SHT_GNU_HASH or SHT_HASH section only */
+    ELF_LOOKUP_INDEX            /* Index built by elf_index_build only */
+} ElfLookup;
+
+/** Symbol lookup with explicit engine
+ *
+ * The embedded engine walks the SHT_GNU_HASH (or SHT_HASH) section of
+ * the file directly from the mapping, without building anything, but it
+ * only knows about dynamic symbols. The automatic engine uses it when
+ * available and falls back on the symbol index for the remaining
+ * symbols.
+ *
+ * @param elf The Elf object;
+ * @param symname The name of the symbol;
+ * @param engine The lookup engine to be used;
+ * @return A pointer to the symbol header or NULL if there's no such
+ *         symbol.
+ */
+Elf32_Sym *elf_symbol_lookup(Elf elf, const char *symname,
+                             ElfLookup engine);
+
 /** Symbol getter
  *
- * Retrieves a symbol by searching the given name
+ * Retrieves a symbol by searching the given name, the same as
+ * elf_symbol_lookup with ELF_LOOKUP_AUTO.
  *
  * @param elf The Elf object;
  * @param symname The name of the symbol;
@@ -165,6 +318,52 @@ bool elf_symbols_scan(Elf elf, Elf32_Shdr *shdr, SymScan callback,
 
 Elf32_Sym *elf_symbol_get(Elf elf, const char *symname);
 
+/** Batch symbol getter
+ *
+ * Resolves a set of names at once, each to the symbol elf_symbol_get
+ * would return. If the symbol index has already been built it's used
+ * for each name, otherwise all the names are resolved with a single
+ * scan of the symbol table, without building the index.
+ *
+ * @param elf The Elf object;
+ * @param names The names to be resolved;
+ * @param n The number of names;
+ * @param out Array of n elements which will contain the symbols (NULL
+ *            for missing names);
+ * @return The number of resolved names.
+ */
+size_t elf_symbols_resolve(Elf elf, const char **names, size_t n,
+                           Elf32_Sym **out);
+
+/** Symbol getter by address
+ *
+ * Retrieves the symbol whose range [st_value, st_value + st_size)
+ * contains the given address. Sizeless symbols only match their own
+ * address. The address index is built on the first call.
+ *
+ * @param elf The Elf object;
+ * @param addr The address to be resolved;
+ * @return A pointer to the symbol header or NULL if no symbol covers the
+ *         address.
+ */
+Elf32_Sym *elf_symbol_at(Elf elf, Elf32_Addr addr);
+
+/** Batch symbol getter by address
+ *
+ * Resolves an array of addresses as elf_symbol_at would. If the
+ * addresses are sorted in ascending order the whole batch is resolved
+ * by merging it with the address index.
+ *
+ * @param elf The Elf object;
+ * @param addrs The addresses to be resolved;
+ * @param n The number of addresses;
+ * @param out Array of n elements which will contain the symbols (NULL
+ *            for unresolved addresses);
+ * @return The number of resolved addresses.
+ */
+size_t elf_symbols_at(Elf elf, const Elf32_Addr *addrs, size_t n,
+                      Elf32_Sym **out);
+
 /** Iteration function for program header's entry scanning
  *
  * @param udata User data;
@@ -189,6 +388,12 @@ typedef bool (*PHeaderScan)(void *udata, Elf elf, Elf32_Phdr *phdr);
 bool elf_progheader_scan(Elf elf, PHeaderScan callback, void *udata);
 
 /** Checks wether the ELF file is well formed
+ *
+ * Every header, offset, size, section link and string reference must lie
+ * within the file, and the .dynamic section must match the PT_DYNAMIC
+ * segment. The first part is checked once at mapping time: accessors
+ * skip their own bounds checks on files passing it, and keep them on
+ * the others.
  *
  * @param elf The Elf object;
  * @return true if the object is well formed, false otherwise.
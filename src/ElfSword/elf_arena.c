@@ -0,0 +1,136 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "elf.h"
+
+#include <sys/mman.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "elf_private.h"
+
+/* Allocation granularity, enough for any of the stored types */
+#define ARENA_ALIGN 16
+
+struct elf_arena {
+    uint8_t *base;              /* Reserved region */
+    size_t capacity;            /* Region size */
+    atomic_size_t used;         /* Bytes handed out since the reset */
+    size_t high;                /* High-water mark of the past cycles */
+    atomic_uint files;          /* Files mapped since the reset */
+    atomic_size_t spilled;      /* Bytes malloc'ed since the reset */
+};
+
+/* Whether ptr was handed out by the region, rather than by malloc(3)
+ * once the region was full */
+static
+bool arena_owns(ElfArena a, const void *ptr)
+{
+    const uint8_t *p = ptr;
+
+    return p >= a->base && p < a->base + a->capacity;
+}
+
+ElfArena elf_arena_new(size_t capacity)
+{
+    ElfArena a;
+
+    if (capacity == 0)
+        capacity = ELF_ARENA_DEFAULT;
+
+    a = malloc(sizeof(struct elf_arena));
+    assert(a != NULL);
+
+    /* Only reserved: pages are backed as they get used, and stay so
+     * across resets */
+    a->base = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (a->base == MAP_FAILED) {
+        free(a);
+        return NULL;
+    }
+    a->capacity = capacity;
+    atomic_init(&a->used, 0);
+    atomic_init(&a->files, 0);
+    atomic_init(&a->spilled, 0);
+    a->high = 0;
+    return a;
+}
+
+void elf_arena_reset(ElfArena a)
+{
+    size_t used = atomic_load(&a->used);
+
+    if (used > a->high)
+        a->high = used;
+    atomic_store(&a->used, 0);
+    atomic_store(&a->files, 0);
+    atomic_store(&a->spilled, 0);
+}
+
+void elf_arena_free(ElfArena a)
+{
+    if (a != NULL) {
+        munmap(a->base, a->capacity);
+        free(a);
+    }
+}
+
+void elf_arena_stats(ElfArena a, struct elf_arena_stats *st)
+{
+    st->used = atomic_load(&a->used);
+    st->high_water = st->used > a->high ? st->used : a->high;
+    st->capacity = a->capacity;
+    st->files = atomic_load(&a->files);
+    st->spilled = atomic_load(&a->spilled);
+}
+
+void elf_arena_count(ElfArena a)
+{
+    atomic_fetch_add(&a->files, 1);
+}
+
+void *elf_alloc(ElfArena a, size_t size)
+{
+    size_t off, asize;
+    void *ret;
+
+    if (a != NULL) {
+        /* Lazy indexes may be built by several threads at once */
+        asize = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        off = atomic_load(&a->used);
+        while (asize <= a->capacity - off)
+            if (atomic_compare_exchange_weak(&a->used, &off, off + asize))
+                return a->base + off;
+
+        /* Full: spilling to the heap, released by elf_free */
+        atomic_fetch_add(&a->spilled, size);
+    }
+    ret = malloc(size);
+    assert(ret != NULL);
+    return ret;
+}
+
+void elf_free(ElfArena a, void *ptr)
+{
+    /* Arena memory goes back all at once, on reset */
+    if (a == NULL || !arena_owns(a, ptr))
+        free(ptr);
+}
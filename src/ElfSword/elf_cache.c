@@ -0,0 +1,334 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "elf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elf_private.h"
+#include "hindex.h"
+
+/* Index cache file layout.
+ *
+ * The cache is made of a header followed by the section index and the
+ * symbol index, as stored in memory by hindex. Indexes only hold entry
+ * positions, and the header only holds offsets, so the file can be
+ * mapped anywhere and used in place.
+ *
+ * The cache is bound to the ELF file by device, inode, size and
+ * modification time. When these don't match but the size does, the
+ * content hash is compared before giving up on the cache: this keeps
+ * copied or touched files from being indexed again. The file itself is
+ * validated on every map, since neither the key nor the header checksum
+ * prove that its content is the one which was validated.
+ */
+
+#define CACHE_MAGIC "ESWIDX\r\n"
+#define CACHE_VERSION 3
+#define CACHE_SUFFIX ".idx"
+
+struct cache_header {
+    char magic[8];              /* CACHE_MAGIC */
+    uint32_t version;           /* CACHE_VERSION */
+    uint32_t hsize;             /* Size of this header */
+
+    /* ELF file key */
+    uint64_t dev;               /* Device */
+    uint64_t ino;               /* Inode */
+    uint64_t size;              /* File size */
+    int64_t mtime_sec;          /* Modification time */
+    int64_t mtime_nsec;
+    uint64_t content;           /* elf_content_hash */
+
+    /* Index positions, relative to the beginning of the cache */
+    uint32_t sec_off;           /* Section index */
+    uint32_t sec_len;
+    uint32_t sym_off;           /* Symbol index (0 if missing) */
+    uint32_t sym_len;
+    uint32_t symsec;            /* Indexed symbol table section */
+    uint32_t ehash;             /* Embedded hash section (0 if missing) */
+
+    uint32_t check;             /* Checksum of the fields above */
+    uint32_t pad;
+};
+
+static
+uint32_t header_check(const struct cache_header *h)
+{
+    const uint8_t *cursor = (const uint8_t *)h;
+    size_t len = offsetof(struct cache_header, check);
+    uint32_t ret = 2166136261u;
+
+    while (len --)
+        ret = (ret ^ *cursor++) * 16777619u;
+    return ret;
+}
+
+static
+void header_key(struct cache_header *h, const struct stat *st)
+{
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static
+bool key_matches(const struct cache_header *h, const struct stat *st)
+{
+    return h->dev == (uint64_t)st->st_dev &&
+           h->ino == (uint64_t)st->st_ino &&
+           h->size == (uint64_t)st->st_size &&
+           h->mtime_sec == st->st_mtim.tv_sec &&
+           h->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+/* An index block is valid if it lies inside the cache and its size is
+ * the one implied by its own header */
+static
+bool block_valid(const uint8_t *cache, size_t cachelen, uint32_t off,
+                 uint32_t len)
+{
+    const struct hindex *idx;
+    uint64_t nslots;
+
+    if (off % sizeof(uint64_t) != 0 || len < sizeof(struct hindex) ||
+        (uint64_t)off + len > cachelen)
+        return false;
+    idx = (const struct hindex *)(cache + off);
+    nslots = (uint64_t)idx->mask + 1;
+    return (nslots & (nslots - 1)) == 0 && idx->count < nslots &&
+           len == sizeof(struct hindex) +
+                  nslots * sizeof(struct hindex_slot);
+}
+
+static
+bool cache_valid(Elf elf, const uint8_t *cache, size_t cachelen)
+{
+    const struct cache_header *h = (const struct cache_header *)cache;
+    uint32_t shnum = elf->shnum;
+    Elf32_Word type;
+
+    if (cachelen < sizeof(struct cache_header) ||
+        memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != CACHE_VERSION ||
+        h->hsize != sizeof(struct cache_header) ||
+        h->check != header_check(h))
+        return false;
+    if (!block_valid(cache, cachelen, h->sec_off, h->sec_len))
+        return false;
+    if (h->ehash >= shnum)
+        return false;
+    if (h->ehash != 0) {
+        type = elf_shdr(elf, h->ehash)->sh_type;
+        if (type != SHT_HASH && type != SHT_GNU_HASH)
+            return false;
+    }
+    if (h->sym_off == 0)
+        return true;
+    if (!block_valid(cache, cachelen, h->sym_off, h->sym_len) ||
+        h->symsec == SHN_UNDEF || h->symsec >= shnum)
+        return false;
+    type = elf_shdr(elf, h->symsec)->sh_type;
+    return type == SHT_SYMTAB || type == SHT_DYNSYM;
+}
+
+/* Maps the cache and attaches it to the Elf object if it's up to date.
+ * The cache is only read, so that read-only caches and caches owned by
+ * other users are used too. Returns false if the cache must be rebuilt;
+ * stale is set if it holds the right indexes under an outdated key. */
+static
+bool cache_attach(Elf elf, const char *cachefile, const struct stat *st,
+                  bool *stale)
+{
+    struct cache_header *h;
+    struct stat cst;
+    uint8_t *cache;
+    int fd;
+
+    *stale = false;
+    if ((fd = open(cachefile, O_RDONLY)) == -1)
+        return false;
+    if (fstat(fd, &cst) == -1 || cst.st_size == 0)
+        goto fail0;
+    cache = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (cache == MAP_FAILED)
+        goto fail0;
+    if (!cache_valid(elf, cache, cst.st_size))
+        goto fail1;
+
+    h = (struct cache_header *)cache;
+    if (!key_matches(h, st)) {
+        /* Same content under a different key: the key is refreshed by
+         * storing the cache again */
+        if (h->size != (uint64_t)st->st_size ||
+            h->content != elf_content_hash(elf))
+            goto fail1;
+        *stale = true;
+    }
+    close(fd);
+
+    elf->cache = cache;
+    elf->cachelen = cst.st_size;
+    elf->secidx = (HIndex)(cache + h->sec_off);
+    elf->ehash = h->ehash != 0 && elf->trusted && elf->native
+                 ? elf_shdr(elf, h->ehash) : NULL;
+    if (h->sym_off != 0) {
+        elf->symsec = elf_shdr(elf, h->symsec);
+        elf->symidx = (HIndex)(cache + h->sym_off);
+    }
+    return true;
+
+  fail1:
+    munmap(cache, cst.st_size);
+  fail0:
+    close(fd);
+    return false;
+}
+
+static
+uint32_t shdr_ndx(Elf elf, Elf32_Shdr *shdr)
+{
+    const Elf32_Ehdr *header = elf->file.header;
+
+    if (shdr == NULL)
+        return 0;
+    return ((uint8_t *)shdr - elf->file.data8b - header->e_shoff) /
+           header->e_sheentsize;
+}
+
+static
+size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+/* Writes the cache for an indexed Elf object. The file is built aside
+ * and renamed, so that concurrent readers never see it partial. It's
+ * created readable by everyone, as the umask allows, so that it can be
+ * shared. Failures are not fatal: the indexes are in memory anyway. */
+static
+void cache_store(Elf elf, const char *cachefile, const struct stat *st)
+{
+    static atomic_uint serial;
+    struct cache_header h;
+    char *tmpname;
+    size_t seclen, symlen, pad;
+    static const uint8_t zero[8];
+    FILE *out;
+    int fd;
+
+    seclen = hindex_bytes(elf->secidx);
+    symlen = elf->symidx != NULL ? hindex_bytes(elf->symidx) : 0;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    h.hsize = sizeof(h);
+    header_key(&h, st);
+    h.content = elf_content_hash(elf);
+    h.sec_off = align8(sizeof(h));
+    h.sec_len = seclen;
+    if (symlen != 0) {
+        h.sym_off = align8(h.sec_off + seclen);
+        h.sym_len = symlen;
+        h.symsec = shdr_ndx(elf, elf->symsec);
+    }
+    h.ehash = shdr_ndx(elf, elf->ehash);
+    h.check = header_check(&h);
+
+    /* Unique among processes and threads, and not mkstemp(3), whose mode
+     * ignores the umask */
+    if (asprintf(&tmpname, "%s.%ld.%u", cachefile, (long)getpid(),
+                 atomic_fetch_add(&serial, 1)) == -1)
+        return;
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        goto fail0;
+    if ((out = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        goto fail1;
+    }
+    pad = h.sec_off - sizeof(h);
+    if (fwrite(&h, sizeof(h), 1, out) != 1 ||
+        fwrite(zero, 1, pad, out) != pad ||
+        fwrite(elf->secidx, seclen, 1, out) != 1)
+        goto fail2;
+    pad = h.sym_off - h.sec_off - seclen;
+    if (symlen != 0 &&
+        (fwrite(zero, 1, pad, out) != pad ||
+         fwrite(elf->symidx, symlen, 1, out) != 1))
+        goto fail2;
+    if (fclose(out) != 0)
+        goto fail1;
+    if (rename(tmpname, cachefile) == -1)
+        goto fail1;
+    free(tmpname);
+    return;
+
+  fail2:
+    fclose(out);
+  fail1:
+    unlink(tmpname);
+  fail0:
+    free(tmpname);
+}
+
+Elf elf_map_file_cached(const char *filename, const char *cachefile)
+{
+    struct stat st;
+    char *defname;
+    bool stale;
+    Elf elf;
+
+    if ((elf = elf_map_raw(NULL, filename, &st)) == NULL)
+        return NULL;
+    elf->trusted = elf_validate(elf);
+
+    defname = NULL;
+    if (cachefile == NULL) {
+        if (asprintf(&defname, "%s" CACHE_SUFFIX, filename) == -1) {
+            elf_sections_index(elf);
+            return elf;
+        }
+        cachefile = defname;
+    }
+
+    if (!cache_attach(elf, cachefile, &st, &stale)) {
+        /* Missing, stale or corrupted: indexing and storing again */
+        elf_sections_index(elf);
+        elf_index_build(elf);
+        cache_store(elf, cachefile, &st);
+    } else if (stale) {
+        cache_store(elf, cachefile, &st);
+    }
+
+    free(defname);
+    return elf;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __ELF_PRIVATE_H__
+#define __ELF_PRIVATE_H__
+
+/* Definitions shared by the ElfSword modules. Not part of the API. */
+
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "elf.h"
+#include "hindex.h"
+
+/* Address index entry */
+struct addr_ent {
+    Elf32_Addr value;           /* Symbol value */
+    Elf32_Word size;            /* Symbol size */
+    uint32_t ndx;               /* Symbol position in its table */
+};
+
+/* Address index: symbols sorted by address */
+struct addr_index {
+    uint32_t n;                 /* Number of entries */
+    struct addr_ent ents[];
+};
+
+/* Elf mapping type. Everything but the lazily built indexes is set up
+ * at mapping time and never changed. The lazy indexes are built aside
+ * and published with a single atomic pointer store, so that Elf objects
+ * can be shared by threads and lookups take no locks. */
+struct elf_struct {
+
+    /* Allocated data */
+    union {
+        void *data;             /* Memory mapped file */
+        uint8_t *data8b;        /* 8 bit pointer */
+        Elf32_Ehdr *header;     /* Elf header */
+    } file;
+    size_t len;                 /* File size */
+    int fd;                     /* File descriptor */
+    ElfArena arena;             /* Arena of this object, NULL if none */
+    bool native;                /* Mapped in the native layout */
+    bool trusted;               /* Passed elf_validate */
+    uint32_t shnum;             /* Section headers inside the file */
+    uint32_t phnum;             /* Program headers inside the file */
+
+    /* Auxiliary data */
+    Elf32_Shdr *names;          /* Section for name resolving */
+    HIndex secidx;              /* Index for sections */
+    Elf32_Shdr *symsec;         /* Symbol table to be indexed, if any */
+    Elf32_Shdr *ehash;          /* Embedded symbol hash table, if any */
+    _Atomic(HIndex) symidx;     /* Index for symbols (lazily built) */
+    _Atomic(struct addr_index *) addrs; /* Address index (lazily built) */
+
+    /* Index cache: when mapped, secidx and symidx point inside it */
+    void *cache;                /* Mapped cache file */
+    size_t cachelen;            /* Cache file size */
+};
+
+/* Range [off, off + size) inside the file */
+static inline
+bool elf_in_file(Elf elf, uint64_t off, uint64_t size)
+{
+    return off <= elf->len && size <= elf->len - off;
+}
+
+/* Entries of a header table lying inside the file, none if the entries
+ * are smaller than minsize */
+static inline
+uint32_t elf_table_len(Elf elf, uint64_t off, uint32_t n, uint32_t entsize,
+                       size_t minsize)
+{
+    uint64_t avail;
+
+    if (n == 0 || entsize < minsize || off > elf->len)
+        return 0;
+    avail = (elf->len - off) / entsize;
+    return n < avail ? n : avail;
+}
+
+/* Section header by index, without bounds checking */
+static inline
+Elf32_Shdr *elf_shdr(Elf elf, Elf32_Word ndx)
+{
+    const Elf32_Ehdr *header = elf->file.header;
+
+    return (Elf32_Shdr *)(elf->file.data8b + header->e_shoff +
+                          header->e_sheentsize * ndx);
+}
+
+/* Maps the file and sets up the Elf object, in the arena if not NULL,
+ * without validating it nor building any index. The result of fstat(2)
+ * on the file is stored in st. */
+Elf elf_map_raw(ElfArena arena, const char *filename, struct stat *st);
+
+/* Dispatches on the class and byte order of the file, rewriting its
+ * headers and symbol tables in the native 32-bit layout if needed
+ * (@see elf_xlate.c). Sets native. False if the file can't be
+ * translated. Needs a writable private mapping. */
+bool elf_translate(Elf elf);
+
+/* Checks every header, offset, size, link and string reference of the
+ * file against its size (@see elf_validate.c). The accessors skip their
+ * own checks on files passing it. Needs shnum, phnum and names. */
+bool elf_validate(Elf elf);
+
+/* Allocation in the arena, or with malloc(3) if arena is NULL. Never
+ * fails. */
+void *elf_alloc(ElfArena arena, size_t size);
+
+/* Releases ptr if it comes from malloc(3), arena memory goes back on
+ * reset */
+void elf_free(ElfArena arena, void *ptr);
+
+/* Accounts for a file mapped in the arena */
+void elf_arena_count(ElfArena arena);
+
+/* Builds the section index, finds the embedded hash table and the
+ * symbol table */
+void elf_sections_index(Elf elf);
+
+#endif /* __ELF_PRIVATE_H__ */
@@ -175,6 +175,8 @@ enum {
                                           * without addends */
     SHT_SHLIB = 10,                      /* Reserved */
     SHT_DYNSYM = 11,                     /* Contains link editing symbols */
+    SHT_GNU_HASH = 0x6ffffff6,           /* GNU extension: symbol hash */
+                                         /* table with bloom filter */
     SHT_LOPROC = 0x70000000,             /* Lower bound (inclusive) for */
                                          /* processor specific types */
     SHT_HIPROC = 0x7FFFFFFF,             /* Upper bound (inclusive) for */
@@ -244,6 +246,27 @@ enum {
                                         /* processor specific type */
 };
 
+/* -------------------------------------------------------------------- */
+/* Symbol hash tables                                                   */
+/* -------------------------------------------------------------------- */
+
+/* SHT_HASH sections are arrays of Elf32_Word:
+ *
+ *   nbucket, nchain, bucket[nbucket], chain[nchain]
+ *
+ * bucket[elf_hash(name) % nbucket] is the first symbol index of the
+ * chain, chain[i] the symbol following the i-th one (0 ends it).
+ *
+ * SHT_GNU_HASH sections are arrays of Elf32_Word as well:
+ *
+ *   nbuckets, symoffset, bloom_size, bloom_shift,
+ *   bloom[bloom_size], buckets[nbuckets], chain[]
+ *
+ * Symbols below symoffset are not hashed. Symbols sharing a bucket are
+ * contiguous; chain[i - symoffset] holds the hash of the i-th symbol,
+ * with the lowest bit set on the last symbol of the bucket.
+ */
+
 /* -------------------------------------------------------------------- */
 /* Program header                                                       */
 /* -------------------------------------------------------------------- */
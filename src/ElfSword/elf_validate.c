@@ -0,0 +1,171 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "elf.h"
+
+#include <string.h>
+
+#include "elf_private.h"
+
+/* Single pass over the whole file structure, run at mapping time. Any
+ * location the accessors may follow is checked against the file size,
+ * so that they can skip their own checks on files passing it. */
+
+/* String table: inside the file (checked by the caller) and terminated,
+ * so that any string starting inside it ends inside it */
+static
+bool strtab_valid(Elf elf, const Elf32_Shdr *strtab)
+{
+    return strtab->sh_size == 0 ||
+           elf->file.data8b[strtab->sh_offset + strtab->sh_size - 1] == '\0';
+}
+
+/* Section linked by shdr, of the given type */
+static
+Elf32_Shdr *linked(Elf elf, const Elf32_Shdr *shdr, Elf32_Word type)
+{
+    Elf32_Shdr *link;
+
+    if (shdr->sh_link == SHN_UNDEF || shdr->sh_link >= elf->shnum)
+        return NULL;
+    link = elf_shdr(elf, shdr->sh_link);
+    return link->sh_type == type ? link : NULL;
+}
+
+static
+bool symtab_valid(Elf elf, const Elf32_Shdr *symtab)
+{
+    const Elf32_Sym *syms;
+    const Elf32_Shdr *strtab;
+    uint32_t i, n;
+
+    if ((strtab = linked(elf, symtab, SHT_STRTAB)) == NULL)
+        return false;
+    syms = (const Elf32_Sym *)(elf->file.data8b + symtab->sh_offset);
+    n = symtab->sh_size / sizeof(Elf32_Sym);
+    for (i = 0; i < n; i ++)
+        if (syms[i].st_name != 0 && syms[i].st_name >= strtab->sh_size)
+            return false;
+    return true;
+}
+
+/* Buckets and chains must index the linked symbol table */
+static
+bool sysv_valid(Elf elf, const Elf32_Shdr *hsec)
+{
+    const Elf32_Word *words;
+    const Elf32_Shdr *dynsym;
+    uint64_t nwords;
+
+    if ((dynsym = linked(elf, hsec, SHT_DYNSYM)) == NULL)
+        return false;
+    words = (const Elf32_Word *)(elf->file.data8b + hsec->sh_offset);
+    nwords = hsec->sh_size / sizeof(Elf32_Word);
+    return nwords >= 2 &&
+           2 + (uint64_t)words[0] + words[1] <= nwords &&
+           words[1] <= dynsym->sh_size / sizeof(Elf32_Sym);
+}
+
+static
+bool gnu_valid(Elf elf, const Elf32_Shdr *hsec)
+{
+    const Elf32_Word *words, *buckets, *chain;
+    const Elf32_Shdr *dynsym;
+    uint64_t nwords, head;
+    Elf32_Word nbuckets, symoffset, nsyms, i;
+
+    if ((dynsym = linked(elf, hsec, SHT_DYNSYM)) == NULL)
+        return false;
+    words = (const Elf32_Word *)(elf->file.data8b + hsec->sh_offset);
+    nwords = hsec->sh_size / sizeof(Elf32_Word);
+    if (nwords < 4)
+        return false;
+    nbuckets = words[0];
+    symoffset = words[1];
+    nsyms = dynsym->sh_size / sizeof(Elf32_Sym);
+    head = 4 + (uint64_t)words[2] + nbuckets;
+    if (symoffset > nsyms || head + (nsyms - symoffset) > nwords)
+        return false;
+
+    /* Chains start at a hashed symbol and end within the table */
+    buckets = words + 4 + words[2];
+    chain = words + head;
+    for (i = 0; i < nbuckets; i ++)
+        if (buckets[i] != 0 &&
+            (buckets[i] < symoffset || buckets[i] >= nsyms))
+            return false;
+    return nsyms == symoffset || (chain[nsyms - symoffset - 1] & 1) != 0;
+}
+
+static
+bool section_valid(Elf elf, const Elf32_Shdr *shdr)
+{
+    if (shdr->sh_type != SHT_NOBITS &&
+        !elf_in_file(elf, shdr->sh_offset, shdr->sh_size))
+        return false;
+    if (elf->names != NULL && shdr->sh_name >= elf->names->sh_size)
+        return false;
+
+    switch (shdr->sh_type) {
+        case SHT_STRTAB:
+            return strtab_valid(elf, shdr);
+        case SHT_SYMTAB:
+        case SHT_DYNSYM:
+            return symtab_valid(elf, shdr);
+        case SHT_HASH:
+        case SHT_GNU_HASH:
+            /* Translation leaves the hash tables in their original
+             * layout, where they are never used */
+            if (!elf->native)
+                return true;
+            if (shdr->sh_type == SHT_HASH)
+                return sysv_valid(elf, shdr);
+            return gnu_valid(elf, shdr);
+        default:
+            return true;
+    }
+}
+
+bool elf_validate(Elf elf)
+{
+    const Elf32_Ehdr *h = elf->file.header;
+    const Elf32_Phdr *phdr;
+    uint32_t i;
+
+    /* Header tables wholly inside the file */
+    if (elf->shnum != h->e_shnum || elf->phnum != h->e_phnum)
+        return false;
+    if (h->e_shstrndx != SHN_UNDEF &&
+        (elf->names == NULL || elf->names->sh_type != SHT_STRTAB))
+        return false;
+    for (i = 0; i < elf->phnum; i ++) {
+        phdr = (const Elf32_Phdr *)(elf->file.data8b + h->e_phoff +
+                                    h->e_phentsize * i);
+        if (!elf_in_file(elf, phdr->p_offset, phdr->p_filesz))
+            return false;
+    }
+
+    /* The names table first, since the others refer to it */
+    if (elf->names != NULL && !section_valid(elf, elf->names))
+        return false;
+    for (i = 0; i < elf->shnum; i ++)
+        if (!section_valid(elf, elf_shdr(elf, i)))
+            return false;
+    return true;
+}
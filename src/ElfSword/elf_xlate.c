@@ -0,0 +1,214 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "elf.h"
+
+#include <sys/mman.h>
+#include <string.h>
+
+#include "elf_private.h"
+
+/* Translation of files of another class or byte order into the native
+ * 32-bit layout, so that all the accessors keep working on Elf32
+ * structure overlays. The ELF header, the program and section headers
+ * and the symbol tables are rewritten in place, in the private mapping
+ * of the file; section contents are left alone.
+ *
+ * The translator is a single body specialized at compile time for each
+ * {ELFCLASS32, ELFCLASS64} x {ELFDATA2LSB, ELFDATA2MSB} combination: the
+ * class and the byte order are constants once inlined, so that each
+ * field read is a plain load, possibly byte swapped, with no branching.
+ * The combination is dispatched once per file. */
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_DATA ELFDATA2MSB
+#else
+#define HOST_DATA ELFDATA2LSB
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* Field offset in the 32 and 64-bit layouts */
+#define OFF(o32, o64) (is64 ? (o64) : (o32))
+
+static ALWAYS_INLINE
+uint16_t rd16(const uint8_t *p, bool msb)
+{
+    return msb ? (uint16_t)(p[0] << 8 | p[1])
+               : (uint16_t)(p[1] << 8 | p[0]);
+}
+
+static ALWAYS_INLINE
+uint32_t rd32(const uint8_t *p, bool msb)
+{
+    return msb ? (uint32_t)rd16(p, msb) << 16 | rd16(p + 2, msb)
+               : (uint32_t)rd16(p + 2, msb) << 16 | rd16(p, msb);
+}
+
+static ALWAYS_INLINE
+uint64_t rd64(const uint8_t *p, bool msb)
+{
+    return msb ? (uint64_t)rd32(p, msb) << 32 | rd32(p + 4, msb)
+               : (uint64_t)rd32(p + 4, msb) << 32 | rd32(p, msb);
+}
+
+/* Address, offset or size field, narrowed to 32 bits. Returns false if
+ * the value doesn't fit. */
+static ALWAYS_INLINE
+bool rdaddr(const uint8_t *p, bool is64, bool msb, uint32_t *out)
+{
+    uint64_t v = is64 ? rd64(p, msb) : rd32(p, msb);
+
+    *out = (uint32_t)v;
+    return v == *out;
+}
+
+static ALWAYS_INLINE
+bool translate_symbols(Elf elf, Elf32_Shdr *shdr, bool is64, bool msb)
+{
+    const size_t entsize = is64 ? 24 : sizeof(Elf32_Sym);
+    uint8_t *table;
+    Elf32_Sym sym;
+    uint32_t n, i;
+    const uint8_t *p;
+
+    /* Entries left in the foreign layout would be misread */
+    if (!elf_in_file(elf, shdr->sh_offset, shdr->sh_size))
+        return false;
+    table = elf->file.data8b + shdr->sh_offset;
+    n = shdr->sh_size / entsize;
+
+    /* Packed towards the start, an entry is read before being covered */
+    for (i = 0; i < n; i ++) {
+        p = table + entsize * i;
+        sym.st_name = rd32(p, msb);
+        if (!rdaddr(p + OFF(4, 8), is64, msb, &sym.st_value) ||
+            !rdaddr(p + OFF(8, 16), is64, msb, &sym.st_size))
+            return false;
+        sym.st_info = p[OFF(12, 4)];
+        sym.st_other = p[OFF(13, 5)];
+        sym.st_shndx = rd16(p + OFF(14, 6), msb);
+        memcpy(table + sizeof(Elf32_Sym) * i, &sym, sizeof(sym));
+    }
+    shdr->sh_size = n * sizeof(Elf32_Sym);
+    shdr->sh_entsize = sizeof(Elf32_Sym);
+    return true;
+}
+
+static ALWAYS_INLINE
+bool translate(Elf elf, bool is64, bool msb)
+{
+    uint8_t *base = elf->file.data8b;
+    Elf32_Ehdr eh;
+    Elf32_Phdr ph;
+    Elf32_Shdr sh;
+    uint32_t i, n;
+    uint8_t *p;
+
+    if (elf->len < (is64 ? 64 : sizeof(Elf32_Ehdr)))
+        return false;
+
+    memcpy(eh.e_ident, base, EI_NINDENT);
+    eh.e_type = rd16(base + 16, msb);
+    eh.e_machine = rd16(base + 18, msb);
+    eh.e_version = rd32(base + 20, msb);
+    if (!rdaddr(base + 24, is64, msb, &eh.e_entry) ||
+        !rdaddr(base + OFF(28, 32), is64, msb, &eh.e_phoff) ||
+        !rdaddr(base + OFF(32, 40), is64, msb, &eh.e_shoff))
+        return false;
+    eh.e_flags = rd32(base + OFF(36, 48), msb);
+    eh.e_ehsize = rd16(base + OFF(40, 52), msb);
+    eh.e_phentsize = rd16(base + OFF(42, 54), msb);
+    eh.e_phnum = rd16(base + OFF(44, 56), msb);
+    eh.e_sheentsize = rd16(base + OFF(46, 58), msb);
+    eh.e_shnum = rd16(base + OFF(48, 60), msb);
+    eh.e_shstrndx = rd16(base + OFF(50, 62), msb);
+    memcpy(base, &eh, sizeof(eh));
+
+    /* Header tables keep their stride, entries shrink in place */
+    n = elf_table_len(elf, eh.e_phoff, eh.e_phnum, eh.e_phentsize,
+                      is64 ? 56 : sizeof(Elf32_Phdr));
+    for (i = 0; i < n; i ++) {
+        p = base + eh.e_phoff + eh.e_phentsize * i;
+        ph.p_type = rd32(p, msb);
+        ph.p_flags = rd32(p + OFF(24, 4), msb);
+        if (!rdaddr(p + OFF(4, 8), is64, msb, &ph.p_offset) ||
+            !rdaddr(p + OFF(8, 16), is64, msb, &ph.p_vaddr) ||
+            !rdaddr(p + OFF(12, 24), is64, msb, &ph.p_paddr) ||
+            !rdaddr(p + OFF(16, 32), is64, msb, &ph.p_filesz) ||
+            !rdaddr(p + OFF(20, 40), is64, msb, &ph.p_memsz) ||
+            !rdaddr(p + OFF(28, 48), is64, msb, &ph.p_align))
+            return false;
+        memcpy(p, &ph, sizeof(ph));
+    }
+
+    n = elf_table_len(elf, eh.e_shoff, eh.e_shnum, eh.e_sheentsize,
+                      is64 ? 64 : sizeof(Elf32_Shdr));
+    for (i = 0; i < n; i ++) {
+        p = base + eh.e_shoff + eh.e_sheentsize * i;
+        sh.sh_name = rd32(p, msb);
+        sh.sh_type = rd32(p + 4, msb);
+        sh.sh_link = rd32(p + OFF(24, 40), msb);
+        sh.sh_info = rd32(p + OFF(28, 44), msb);
+        if (!rdaddr(p + 8, is64, msb, &sh.sh_flags) ||
+            !rdaddr(p + OFF(12, 16), is64, msb, &sh.sh_addr) ||
+            !rdaddr(p + OFF(16, 24), is64, msb, &sh.sh_offset) ||
+            !rdaddr(p + OFF(20, 32), is64, msb, &sh.sh_size) ||
+            !rdaddr(p + OFF(32, 48), is64, msb, &sh.sh_addralign) ||
+            !rdaddr(p + OFF(36, 56), is64, msb, &sh.sh_entsize))
+            return false;
+        if ((sh.sh_type == SHT_SYMTAB || sh.sh_type == SHT_DYNSYM) &&
+            !translate_symbols(elf, &sh, is64, msb))
+            return false;
+        memcpy(p, &sh, sizeof(sh));
+    }
+    return true;
+}
+
+static bool translate_32lsb(Elf elf) { return translate(elf, false, false); }
+static bool translate_32msb(Elf elf) { return translate(elf, false, true); }
+static bool translate_64lsb(Elf elf) { return translate(elf, true, false); }
+static bool translate_64msb(Elf elf) { return translate(elf, true, true); }
+
+bool elf_translate(Elf elf)
+{
+    static bool (*const translators[2][2])(Elf) = {
+        { translate_32lsb, translate_32msb },
+        { translate_64lsb, translate_64msb }
+    };
+    const uint8_t *ident = elf->file.data8b;
+    unsigned cls, data;
+    bool ret;
+
+    cls = ident[EI_CLASS];
+    data = ident[EI_DATA];
+    if ((cls != ELFCLASS32 && cls != ELFCLASS64) ||
+        (data != ELFDATA2LSB && data != ELFDATA2MSB))
+        return false;
+
+    elf->native = cls == ELFCLASS32 && data == HOST_DATA;
+    if (elf->native)
+        return true;
+
+    if (mprotect(elf->file.data, elf->len, PROT_READ | PROT_WRITE) == -1)
+        return false;
+    ret = translators[cls - ELFCLASS32][data - ELFDATA2LSB](elf);
+    mprotect(elf->file.data, elf->len, PROT_READ);
+    return ret;
+}
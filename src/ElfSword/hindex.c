@@ -0,0 +1,114 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "hindex.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* Number of slots for the given number of entries: the table is kept at
+ * most half full, so that linear probing sequences stay short */
+static
+uint32_t nslots(uint32_t nentries)
+{
+    uint32_t n = 8;
+
+    while (n < nentries * 2)
+        n <<= 1;
+    return n;
+}
+
+uint32_t hindex_hash(const char *name)
+{
+    uint32_t h = 5381;
+    unsigned char c;
+
+    /* Same function used by the GNU hash section */
+    while ((c = (unsigned char)*name++) != '\0')
+        h = h * 33 + c;
+    return h;
+}
+
+size_t hindex_size(uint32_t nentries)
+{
+    return sizeof(struct hindex) +
+           nslots(nentries) * sizeof(struct hindex_slot);
+}
+
+size_t hindex_bytes(HIndex idx)
+{
+    return sizeof(struct hindex) +
+           ((size_t)idx->mask + 1) * sizeof(struct hindex_slot);
+}
+
+void hindex_init(HIndex idx, uint32_t nentries)
+{
+    uint32_t n = nslots(nentries);
+
+    idx->mask = n - 1;
+    idx->count = 0;
+    memset(idx->slots, 0, n * sizeof(struct hindex_slot));
+}
+
+HIndex hindex_new(uint32_t nentries)
+{
+    HIndex idx;
+
+    idx = malloc(hindex_size(nentries));
+    assert(idx != NULL);
+    hindex_init(idx, nentries);
+    return idx;
+}
+
+bool hindex_insert(HIndex idx, uint32_t hash, uint32_t ndx)
+{
+    struct hindex_slot *slot;
+    uint32_t i;
+
+    if (idx->count == idx->mask)
+        return false;
+
+    i = hash & idx->mask;
+    while ((slot = &idx->slots[i])->ndx != 0)
+        i = (i + 1) & idx->mask;
+    slot->hash = hash;
+    slot->ndx = ndx + 1;
+    idx->count ++;
+    return true;
+}
+
+uint32_t hindex_find(HIndex idx, uint32_t hash, HIndexMatch match,
+                     void *udata)
+{
+    struct hindex_slot *slot;
+    uint32_t i, n;
+
+    /* Bounded by the number of slots, since an index read from a cache
+     * may have no empty slot left */
+    i = hash & idx->mask;
+    for (n = 0; n <= idx->mask; n ++) {
+        slot = &idx->slots[i];
+        if (slot->ndx == 0)
+            break;
+        if (slot->hash == hash && match(udata, slot->ndx - 1))
+            return slot->ndx - 1;
+        i = (i + 1) & idx->mask;
+    }
+    return HINDEX_NONE;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2009 Giovanni Simoni
+ *
+ * This file is part of ElfSword.
+ *
+ * ElfSword is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ElfSword is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ElfSword.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __HINDEX_H__
+#define __HINDEX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Open addressing hash index over the entries of an ELF table.
+ *
+ * The index doesn't store names nor pointers: each slot keeps the hash of
+ * the name and the position of the entry inside its table, so that the
+ * same index works for sections and symbols and doesn't depend on the
+ * address where the file is mapped.
+ */
+
+/** Value returned by hindex_find when no entry matches */
+#define HINDEX_NONE ((uint32_t)-1)
+
+/** Index slot */
+struct hindex_slot {
+    uint32_t hash;              /* Hash of the entry name */
+    uint32_t ndx;               /* Entry position plus one (0 = empty) */
+};
+
+/** Index header, followed by the slots array */
+struct hindex {
+    uint32_t mask;              /* Number of slots minus one */
+    uint32_t count;             /* Number of stored entries */
+    struct hindex_slot slots[];
+};
+
+typedef struct hindex * HIndex;
+
+/** Entry matching function
+ *
+ * Called by hindex_find for each entry having the searched hash.
+ *
+ * @param udata User data;
+ * @param ndx The position of the candidate entry in its table;
+ * @return true if the entry is the searched one.
+ */
+typedef bool (*HIndexMatch)(void *udata, uint32_t ndx);
+
+/** Name hashing function
+ *
+ * @param name A zero terminated string;
+ * @return The hash of the string.
+ */
+uint32_t hindex_hash(const char *name);
+
+/** Memory footprint of an index
+ *
+ * @param nentries The maximum number of entries to be stored;
+ * @return The size in bytes of the index.
+ */
+size_t hindex_size(uint32_t nentries);
+
+/** Memory footprint of an existing index
+ *
+ * @param idx The index;
+ * @return The size in bytes of the index, slots included.
+ */
+size_t hindex_bytes(HIndex idx);
+
+/** Index initializer
+ *
+ * Initializes an empty index on a memory area of at least
+ * hindex_size(nentries) bytes.
+ *
+ * @param idx The memory area;
+ * @param nentries The maximum number of entries to be stored.
+ */
+void hindex_init(HIndex idx, uint32_t nentries);
+
+/** Index allocator
+ *
+ * @param nentries The maximum number of entries to be stored;
+ * @return A new empty index, to be released with free(3).
+ */
+HIndex hindex_new(uint32_t nentries);
+
+/** Entry insertion
+ *
+ * @param idx The index;
+ * @param hash The hash of the entry name (@see hindex_hash);
+ * @param ndx The position of the entry in its table;
+ * @return false if the index is full.
+ */
+bool hindex_insert(HIndex idx, uint32_t hash, uint32_t ndx);
+
+/** Entry lookup
+ *
+ * @param idx The index;
+ * @param hash The hash of the searched name (@see hindex_hash);
+ * @param match Callback discriminating entries with the same hash;
+ * @param udata User data for the callback;
+ * @return The position of the first matching entry in its table, or
+ *         HINDEX_NONE.
+ */
+uint32_t hindex_find(HIndex idx, uint32_t hash, HIndexMatch match,
+                     void *udata);
+
+#endif /* __HINDEX_H__ */
@@ -0,0 +1,259 @@
+#include "delta.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC "BLDDELTA"
+#define MANIFEST_VERSION 1
+
+struct manifest_header {
+    char magic[8];                          /* MANIFEST_MAGIC */
+    uint32_t version;                       /* MANIFEST_VERSION */
+    uint32_t block;                         /* Block size */
+    uint32_t base;                          /* Image load address */
+    uint32_t nblocks;                       /* Hashes following */
+};
+
+/* FNV-1a over the block content, zero spans included */
+static uint64_t block_hash(const struct nxtspan *spans, size_t n, size_t len)
+{
+    const uint8_t *p;
+    uint64_t h = 14695981039346656037ULL ^ len;
+    size_t i, k;
+
+    for (i = 0; i < n; i++) {
+        p = spans[i].data;
+        for (k = 0; k < spans[i].len; k++)
+            h = (h ^ (p != NULL ? p[k] : 0)) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t block_len(const struct image *img, uint32_t i)
+{
+    size_t off = (size_t)i * DELTA_BLOCK;
+
+    return img->len - off < DELTA_BLOCK ? img->len - off : DELTA_BLOCK;
+}
+
+void manifest_build(struct manifest *m, const struct image *img)
+{
+    struct nxtspan *slice;
+    size_t n, len;
+    uint32_t i;
+
+    m->base = img->base;
+    m->block = DELTA_BLOCK;
+    m->nblocks = (img->len + DELTA_BLOCK - 1) / DELTA_BLOCK;
+    m->hashes = malloc((m->nblocks + 1) * sizeof(uint64_t));
+    assert(m->hashes != NULL);
+
+    slice = malloc((img->nspans + 1) * sizeof(struct nxtspan));
+    assert(slice != NULL);
+    for (i = 0; i < m->nblocks; i++) {
+        len = block_len(img, i);
+        n = image_slice(img, (size_t)i * DELTA_BLOCK, len, slice);
+        m->hashes[i] = block_hash(slice, n, len);
+    }
+    free(slice);
+}
+
+bool manifest_load(struct manifest *m, const char *path)
+{
+    struct manifest_header h;
+    FILE *in;
+
+    if ((in = fopen(path, "rb")) == NULL)
+        return false;
+    if (fread(&h, sizeof(h), 1, in) != 1 ||
+        memcmp(h.magic, MANIFEST_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != MANIFEST_VERSION)
+        goto fail0;
+
+    m->base = h.base;
+    m->block = h.block;
+    m->nblocks = h.nblocks;
+    m->hashes = malloc(((size_t)h.nblocks + 1) * sizeof(uint64_t));
+    assert(m->hashes != NULL);
+    if (fread(m->hashes, sizeof(uint64_t), h.nblocks, in) != h.nblocks)
+        goto fail1;
+    fclose(in);
+    return true;
+
+  fail1:
+    free(m->hashes);
+  fail0:
+    fclose(in);
+    return false;
+}
+
+bool manifest_store(const struct manifest *m, const char *path)
+{
+    struct manifest_header h;
+    char *tmpname;
+    FILE *out;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+    h.version = MANIFEST_VERSION;
+    h.block = m->block;
+    h.base = m->base;
+    h.nblocks = m->nblocks;
+
+    /* Written aside and renamed, so that a failed upload of the manifest
+     * never leaves a partial one */
+    if (asprintf(&tmpname, "%s.XXXXXX", path) == -1)
+        return false;
+    if ((fd = mkstemp(tmpname)) == -1)
+        goto fail0;
+    if ((out = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        goto fail1;
+    }
+    if (fwrite(&h, sizeof(h), 1, out) != 1 ||
+        fwrite(m->hashes, sizeof(uint64_t), m->nblocks, out) != m->nblocks) {
+        fclose(out);
+        goto fail1;
+    }
+    if (fclose(out) != 0 || rename(tmpname, path) == -1)
+        goto fail1;
+    free(tmpname);
+    return true;
+
+  fail1:
+    unlink(tmpname);
+  fail0:
+    free(tmpname);
+    return false;
+}
+
+void manifest_release(struct manifest *m)
+{
+    free(m->hashes);
+    m->hashes = NULL;
+    m->nblocks = 0;
+}
+
+static bool block_changed(const struct manifest *cur,
+                          const struct manifest *old, uint32_t i)
+{
+    return old == NULL || i >= old->nblocks ||
+           cur->hashes[i] != old->hashes[i];
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Manifests of images with a different layout can't be compared */
+static const struct manifest *comparable(const struct manifest *cur,
+                                         const struct manifest *old)
+{
+    if (old != NULL && (old->base != cur->base || old->block != cur->block))
+        return NULL;
+    return old;
+}
+
+size_t delta_changed(const struct manifest *cur, const struct manifest *old,
+                     uint32_t *blocks)
+{
+    uint32_t i;
+    size_t n;
+
+    old = comparable(cur, old);
+    for (i = 0, n = 0; i < cur->nblocks; i++)
+        if (block_changed(cur, old, i))
+            blocks[n++] = i;
+    return n;
+}
+
+void delta_header(const struct image *img, uint32_t first, uint32_t count,
+                  uint8_t *hdr, size_t *off, size_t *len)
+{
+    *off = (size_t)first * DELTA_BLOCK;
+    *len = (size_t)(count - 1) * DELTA_BLOCK +
+           block_len(img, first + count - 1);
+    put_le32(hdr, img->base + *off);
+    put_le32(hdr + 4, *len);
+}
+
+void delta_build(struct delta *d, const struct image *img,
+                 const struct manifest *cur, const struct manifest *old)
+{
+    uint32_t i, first;
+    size_t off, len, size, nrecs;
+    struct nxtspan *hdr;
+
+    memset(d, 0, sizeof(struct delta));
+    old = comparable(cur, old);
+
+    /* A run of changed blocks costs a header and a slice of the image */
+    for (i = 0, nrecs = 0; i < cur->nblocks; i++)
+        if (block_changed(cur, old, i) &&
+            (i == 0 || !block_changed(cur, old, i - 1)))
+            nrecs++;
+    size = nrecs * (img->nspans + 1);
+    d->spans = malloc((size + 1) * sizeof(struct nxtspan));
+    d->headers = malloc((nrecs + 1) * DELTA_HDRLEN);
+    assert(d->spans != NULL && d->headers != NULL);
+
+    for (i = 0; i < cur->nblocks; ) {
+        if (!block_changed(cur, old, i)) {
+            i++;
+            continue;
+        }
+        for (first = i; i < cur->nblocks && block_changed(cur, old, i); i++)
+            d->changed++;
+
+        delta_header(img, first, i - first, d->headers[d->nrecs], &off,
+                     &len);
+
+        hdr = &d->spans[d->nspans++];
+        hdr->data = d->headers[d->nrecs];
+        hdr->len = DELTA_HDRLEN;
+        d->nspans += image_slice(img, off, len, d->spans + d->nspans);
+        d->nrecs++;
+        d->bytes += len;
+    }
+}
+
+void delta_release(struct delta *d)
+{
+    free(d->spans);
+    free(d->headers);
+    memset(d, 0, sizeof(struct delta));
+}
+
+bool delta_apply(const uint8_t *frame, size_t len, uint8_t *mem,
+                 Elf32_Addr base, size_t memlen)
+{
+    uint32_t addr, n;
+
+    while (len > 0) {
+        if (len < DELTA_HDRLEN)
+            return false;
+        addr = get_le32(frame);
+        n = get_le32(frame + 4);
+        frame += DELTA_HDRLEN;
+        len -= DELTA_HDRLEN;
+        if (n > len || addr < base || addr - base > memlen ||
+            memlen - (addr - base) < n)
+            return false;
+        memcpy(mem + (addr - base), frame, n);
+        frame += n;
+        len -= n;
+    }
+    return true;
+}
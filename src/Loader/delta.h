@@ -0,0 +1,73 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "image.h"
+
+/* Delta flashing: the image is split in blocks, and only the blocks
+ * which changed since the last upload to the device are sent.
+ *
+ * A delta frame is a sequence of records, each made of a little endian
+ * 32 bit load address, a little endian 32 bit length and that many
+ * bytes of content. */
+
+/* Block size */
+#define DELTA_BLOCK 1024
+
+/* Record header size */
+#define DELTA_HDRLEN 8
+
+/* Block hashes of an image, as last uploaded to a device */
+struct manifest {
+    Elf32_Addr base;                        /* Image load address */
+    uint32_t block;                         /* Block size */
+    uint32_t nblocks;                       /* Number of blocks */
+    uint64_t *hashes;                       /* Block hashes */
+};
+
+/* Changed regions of an image, ready to be sent */
+struct delta {
+    struct nxtspan *spans;                  /* Delta frame scatter list */
+    size_t nspans;
+    uint8_t (*headers)[DELTA_HDRLEN];       /* Record headers */
+    size_t nrecs;                           /* Number of records */
+    size_t changed;                         /* Blocks to upload */
+    size_t bytes;                           /* Content bytes to upload */
+};
+
+/* Hashes the blocks of the image */
+void manifest_build(struct manifest *m, const struct image *img);
+
+/* Manifest persistence. Loading fails on missing or corrupted files. */
+bool manifest_load(struct manifest *m, const char *path);
+bool manifest_store(const struct manifest *m, const char *path);
+
+void manifest_release(struct manifest *m);
+
+/* Builds the delta frame of the image described by cur against the last
+ * uploaded one, or the whole image if old is NULL or not comparable.
+ * Runs of changed blocks are merged in a single record. */
+void delta_build(struct delta *d, const struct image *img,
+                 const struct manifest *cur, const struct manifest *old);
+
+void delta_release(struct delta *d);
+
+/* Lists the changed blocks in blocks, which must hold cur->nblocks
+ * entries, returning their number */
+size_t delta_changed(const struct manifest *cur, const struct manifest *old,
+                     uint32_t *blocks);
+
+/* Fills the record header of count blocks from first, and gives the
+ * position of their content in the image */
+void delta_header(const struct image *img, uint32_t first, uint32_t count,
+                  uint8_t *hdr, size_t *off, size_t *len);
+
+/* Reference delta frame decoder: applies the records to the memory area
+ * mem of memlen bytes, loaded at base. Returns false on malformed frames
+ * or records out of the area. */
+bool delta_apply(const uint8_t *frame, size_t len, uint8_t *mem,
+                 Elf32_Addr base, size_t memlen);
+
+#endif /* __DELTA_H__ */
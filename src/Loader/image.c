@@ -0,0 +1,147 @@
+#include "image.h"
+#include "../NxtAccess/nxtcrc.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+struct segments {
+    Elf32_Phdr **phdrs;                     /* PT_LOAD segments */
+    size_t n;                               /* Number of segments */
+    size_t size;                            /* Allocated slots */
+};
+
+static bool segment_collect(void *udata, Elf elf, Elf32_Phdr *phdr)
+{
+    struct segments *s = udata;
+
+    if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
+        return true;
+    if (s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 8;
+        s->phdrs = realloc(s->phdrs, s->size * sizeof(Elf32_Phdr *));
+        assert(s->phdrs != NULL);
+    }
+    s->phdrs[s->n++] = phdr;
+    return true;
+}
+
+static int segment_compare(const void *a, const void *b)
+{
+    const Elf32_Phdr *pa = *(Elf32_Phdr * const *)a;
+    const Elf32_Phdr *pb = *(Elf32_Phdr * const *)b;
+
+    return pa->p_paddr < pb->p_paddr ? -1 : pa->p_paddr > pb->p_paddr;
+}
+
+static void span_add(struct image *img, const void *data, size_t len)
+{
+    struct nxtspan *last;
+
+    if (len == 0)
+        return;
+
+    /* Contiguous zero spans are merged */
+    last = img->nspans > 0 ? &img->spans[img->nspans - 1] : NULL;
+    if (data == NULL && last != NULL && last->data == NULL) {
+        last->len += len;
+    } else {
+        img->spans[img->nspans].data = data;
+        img->spans[img->nspans].len = len;
+        img->nspans++;
+    }
+    img->len += len;
+}
+
+bool image_from_elf(struct image *img, Elf elf)
+{
+    const uint8_t *content;
+    struct segments s;
+    Elf32_Phdr *p;
+    Elf32_Addr end;
+    size_t i;
+
+    memset(img, 0, sizeof(struct image));
+    memset(&s, 0, sizeof(s));
+    elf_progheader_scan(elf, segment_collect, &s);
+    if (s.n == 0) {
+        free(s.phdrs);
+        return false;
+    }
+    qsort(s.phdrs, s.n, sizeof(Elf32_Phdr *), segment_compare);
+
+    /* Each segment gives at most a gap, its content and its .bss */
+    img->spans = malloc(3 * s.n * sizeof(struct nxtspan));
+    assert(img->spans != NULL);
+    img->base = s.phdrs[0]->p_paddr;
+
+    content = elf_get_content(elf);
+    end = img->base;
+    for (i = 0; i < s.n; i++) {
+        p = s.phdrs[i];
+        if (p->p_paddr < end || p->p_filesz > p->p_memsz) {
+            /* Overlapping or malformed segments */
+            free(s.phdrs);
+            image_release(img);
+            return false;
+        }
+        span_add(img, NULL, p->p_paddr - end);
+        span_add(img, content + p->p_offset, p->p_filesz);
+        span_add(img, NULL, p->p_memsz - p->p_filesz);
+        end = p->p_paddr + p->p_memsz;
+    }
+
+    free(s.phdrs);
+    return true;
+}
+
+size_t image_slice(const struct image *img, size_t off, size_t len,
+                   struct nxtspan *out)
+{
+    const struct nxtspan *s;
+    size_t i, n, skip;
+
+    for (i = 0, n = 0; i < img->nspans && len > 0; i++) {
+        s = &img->spans[i];
+        if (off >= s->len) {
+            off -= s->len;
+            continue;
+        }
+        skip = off;
+        off = 0;
+        out[n].data = s->data != NULL ? (const uint8_t *)s->data + skip
+                                      : NULL;
+        out[n].len = s->len - skip < len ? s->len - skip : len;
+        len -= out[n].len;
+        n++;
+    }
+    return n;
+}
+
+/* Zero source for the zero spans */
+static const uint8_t zeros[1024];
+
+uint32_t spans_crc32(const struct nxtspan *spans, size_t n)
+{
+    uint32_t crc = 0;
+    size_t i, off, k;
+
+    for (i = 0; i < n; i++) {
+        if (spans[i].data != NULL) {
+            crc = nxtcrc32(crc, spans[i].data, spans[i].len);
+            continue;
+        }
+        for (off = 0; off < spans[i].len; off += k) {
+            k = spans[i].len - off < sizeof(zeros) ? spans[i].len - off
+                                                   : sizeof(zeros);
+            crc = nxtcrc32(crc, zeros, k);
+        }
+    }
+    return crc;
+}
+
+void image_release(struct image *img)
+{
+    free(img->spans);
+    memset(img, 0, sizeof(struct image));
+}
@@ -0,0 +1,35 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../ElfSword/elf.h"
+#include "../NxtAccess/nxtusb.h"
+
+/* Memory image of the PT_LOAD segments of an ELF file, described as a
+ * scatter list over the file mapping: file contents are referenced in
+ * place, .bss and the gaps between segments are zero spans. */
+struct image {
+    struct nxtspan *spans;                  /* Scatter list */
+    size_t nspans;                          /* Number of spans */
+    Elf32_Addr base;                        /* Load address of the image */
+    size_t len;                             /* Image size in bytes */
+};
+
+/* Builds the image of the given ELF file. The image refers to the ELF
+ * mapping, which must outlive it. */
+bool image_from_elf(struct image *img, Elf elf);
+
+/* Describes len bytes of the image from offset off with at most nspans
+ * spans, written to out. Returns the number of spans. */
+size_t image_slice(const struct image *img, size_t off, size_t len,
+                   struct nxtspan *out);
+
+/* CRC-32 of the bytes described by n spans (see nxtcrc.h) */
+uint32_t spans_crc32(const struct nxtspan *spans, size_t n);
+
+/* Releases the scatter list */
+void image_release(struct image *img);
+
+#endif /* __IMAGE_H__ */
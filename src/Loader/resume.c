@@ -0,0 +1,273 @@
+#include "resume.h"
+#include "delta.h"
+#include "../NxtAccess/nxtres.h"
+#include "../NxtAccess/nxtcrc.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+/* Reception buffer: a whole full speed packet plus a partial reply */
+#define RX_PACKET 64
+#define RX_LEN (RX_PACKET + NXTRES_REPLYLEN)
+
+struct block {
+    size_t off;                             /* Offset in the image */
+    uint32_t addr;                          /* Load address */
+    uint32_t len;                           /* Length */
+    uint32_t crc;                           /* CRC of the content */
+    unsigned nacks;                         /* Rejections so far */
+    bool acked;                             /* Held by the device */
+    bool failed;                            /* Given up */
+};
+
+struct uploader {
+    nxtusb_t nxt;
+    const struct image *img;
+    nxtframe_t framing;
+    struct nxtspan *spans;                  /* Frame scatter list */
+    uint8_t header[NXTRES_HDRLEN];          /* Frame header */
+    struct block *blocks;                   /* Blocks by sequence number */
+    uint32_t n;                             /* Number of blocks */
+    uint32_t session;                       /* Upload identifier */
+    uint32_t *todo;                         /* Sequence numbers to send */
+    size_t todo_head, todo_tail;
+    uint32_t window[RESUME_WINDOW];         /* Blocks waiting for reply */
+    unsigned win_head, win_count;
+    uint8_t rx[RX_LEN];                     /* Received bytes */
+    size_t rx_fill;
+    bool progress;                          /* Blocks acknowledged */
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_header(struct uploader *u, uint32_t w0, uint32_t w1,
+                       uint32_t w2, uint32_t w3)
+{
+    put_le32(u->header, w0);
+    put_le32(u->header + 4, w1);
+    put_le32(u->header + 8, w2);
+    put_le32(u->header + 12, w3);
+}
+
+/* Describes the blocks, and identifies the upload by their content */
+static void prepare(struct uploader *u, const uint32_t *blocks)
+{
+    uint8_t hdr[DELTA_HDRLEN];
+    struct block *b;
+    size_t n;
+    uint32_t i;
+
+    u->session = 0;
+    for (i = 0; i < u->n; i++) {
+        b = &u->blocks[i];
+        delta_header(u->img, blocks[i], 1, hdr, &b->off, &n);
+        b->addr = get_le32(hdr);
+        b->len = n;
+        n = image_slice(u->img, b->off, b->len, u->spans);
+        b->crc = spans_crc32(u->spans, n);
+        put_header(u, i, b->addr, b->len, b->crc);
+        u->session = nxtcrc32(u->session, u->header, NXTRES_HDRLEN);
+    }
+}
+
+static nxterr_t read_reply(struct uploader *u, uint32_t *id, uint32_t *value,
+                           int *libusb_err)
+{
+    size_t got;
+    nxterr_t err;
+
+    while (u->rx_fill < NXTRES_REPLYLEN) {
+        err = nxtusb_recv(u->nxt, u->rx + u->rx_fill, RX_PACKET,
+                          &got, libusb_err);
+        if (err != NXERR_SUCCESS)
+            return err;
+        u->rx_fill += got;
+    }
+    *id = get_le32(u->rx);
+    *value = get_le32(u->rx + 4);
+    memmove(u->rx, u->rx + NXTRES_REPLYLEN, u->rx_fill - NXTRES_REPLYLEN);
+    u->rx_fill -= NXTRES_REPLYLEN;
+    return NXERR_SUCCESS;
+}
+
+/* Asks the device for the first block it doesn't hold */
+static nxterr_t query(struct uploader *u, uint32_t *cursor, int *libusb_err)
+{
+    struct nxtspan span;
+    uint32_t id;
+    nxterr_t err;
+
+    put_header(u, NXTRES_QUERY, u->session, u->n, 0);
+    span.data = u->header;
+    span.len = NXTRES_HDRLEN;
+    err = nxtusb_send_spans(u->nxt, &span, 1, u->framing, libusb_err);
+    do {
+        /* Late replies to the blocks sent before the failure */
+        if (err == NXERR_SUCCESS)
+            err = read_reply(u, &id, cursor, libusb_err);
+    } while (err == NXERR_SUCCESS && id != NXTRES_QUERY);
+    return err;
+}
+
+static nxterr_t send_block(struct uploader *u, uint32_t seq,
+                           int *libusb_err)
+{
+    struct block *b = &u->blocks[seq];
+    size_t n;
+    nxterr_t err;
+
+    put_header(u, seq, b->addr, b->len, b->crc);
+    u->spans[0].data = u->header;
+    u->spans[0].len = NXTRES_HDRLEN;
+    n = image_slice(u->img, b->off, b->len, u->spans + 1);
+
+    err = nxtusb_send_spans(u->nxt, u->spans, n + 1, u->framing, libusb_err);
+    if (err == NXERR_SUCCESS)
+        u->window[(u->win_head + u->win_count++) % RESUME_WINDOW] = seq;
+    return err;
+}
+
+/* Checks the reply to the oldest block in the window */
+static nxterr_t check_block(struct uploader *u, struct resume_report *r,
+                            int *libusb_err)
+{
+    struct block *b;
+    uint32_t seq, id, status;
+    nxterr_t err;
+
+    if ((err = read_reply(u, &id, &status, libusb_err)) != NXERR_SUCCESS)
+        return err;
+    seq = u->window[u->win_head];
+    if (id != seq) {
+        /* Replies come in order: the stream is out of sync */
+        *libusb_err = LIBUSB_ERROR_IO;
+        return NXERR_LIBUSB;
+    }
+
+    b = &u->blocks[seq];
+    if (status == NXTRES_ACK) {
+        b->acked = true;
+        u->progress = true;
+        r->blocks++;
+    } else if (++b->nacks <= RESUME_RETRIES) {
+        u->todo[u->todo_tail++] = seq;
+        r->resent++;
+    } else {
+        b->failed = true;
+        r->failed++;
+    }
+    u->win_head = (u->win_head + 1) % RESUME_WINDOW;
+    u->win_count--;
+    return NXERR_SUCCESS;
+}
+
+/* Carries on from the resume cursor until all the blocks are settled or
+ * the link fails */
+static nxterr_t upload(struct uploader *u, struct resume_report *r,
+                       int *libusb_err)
+{
+    uint32_t cursor, seq;
+    nxterr_t err;
+
+    u->rx_fill = 0;
+    u->win_head = u->win_count = 0;
+    u->todo_head = u->todo_tail = 0;
+    if ((err = query(u, &cursor, libusb_err)) != NXERR_SUCCESS)
+        return err;
+
+    for (seq = 0; seq < u->n; seq++) {
+        if (seq < cursor && !u->blocks[seq].acked) {
+            /* Stored before the failure, but never acknowledged */
+            u->blocks[seq].acked = true;
+            u->progress = true;
+            r->held++;
+        }
+        if (!u->blocks[seq].acked && !u->blocks[seq].failed)
+            u->todo[u->todo_tail++] = seq;
+    }
+
+    while (err == NXERR_SUCCESS &&
+           (u->todo_head < u->todo_tail || u->win_count > 0)) {
+        /* Keeping the window full, then checking the oldest block */
+        if (u->todo_head < u->todo_tail && u->win_count < RESUME_WINDOW)
+            err = send_block(u, u->todo[u->todo_head++], libusb_err);
+        else
+            err = check_block(u, r, libusb_err);
+    }
+    return err;
+}
+
+/* Gives the device 100 ms before the first attempt, doubling the wait up
+ * to 1.6 s */
+static void backoff(unsigned attempt)
+{
+    struct timespec ts;
+    unsigned ms;
+
+    ms = 100 << (attempt < 4 ? attempt : 4);
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+nxterr_t resume_send(nxtusb_t nxt, const struct image *img,
+                     const uint32_t *blocks, size_t n, nxtframe_t framing,
+                     struct resume_report *r, int *libusb_err)
+{
+    struct uploader u;
+    unsigned attempts, timeout;
+    nxterr_t err;
+
+    memset(&u, 0, sizeof(u));
+    memset(r, 0, sizeof(struct resume_report));
+    u.nxt = nxt;
+    u.img = img;
+    u.framing = framing;
+    u.n = n;
+    u.spans = malloc((img->nspans + 1) * sizeof(struct nxtspan));
+    u.blocks = calloc(n + 1, sizeof(struct block));
+    u.todo = calloc(n * (RESUME_RETRIES + 1) + 1, sizeof(uint32_t));
+    assert(u.spans != NULL && u.blocks != NULL && u.todo != NULL);
+    prepare(&u, blocks);
+
+    timeout = nxtusb_set_timeout(nxt, RESUME_TIMEOUT);
+    attempts = 0;
+    for (;;) {
+        u.progress = false;
+        err = upload(&u, r, libusb_err);
+        if (err != NXERR_LIBUSB || *libusb_err == LIBUSB_ERROR_NOT_SUPPORTED)
+            break;
+        if (u.progress)
+            attempts = 0;
+
+        /* Link failure: waiting for the device to come back */
+        while (err != NXERR_SUCCESS && attempts < RESUME_RECONNECTS) {
+            backoff(attempts++);
+            err = nxtusb_reconnect(nxt, libusb_err);
+        }
+        if (err != NXERR_SUCCESS)
+            break;
+        r->reconnects++;
+    }
+    nxtusb_set_timeout(nxt, timeout);
+
+    free(u.spans);
+    free(u.blocks);
+    free(u.todo);
+    return err;
+}
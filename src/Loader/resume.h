@@ -0,0 +1,35 @@
+#ifndef __RESUME_H__
+#define __RESUME_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "image.h"
+#include "../NxtAccess/nxtusb.h"
+
+/* Resumable upload, on the protocol described in nxtres.h. Blocks are
+ * numbered in sending order and acknowledged one by one by the device,
+ * with up to RESUME_WINDOW blocks in flight; a rejected block is sent
+ * again up to RESUME_RETRIES times. Writes time out after RESUME_TIMEOUT
+ * ms. On a link failure the device is reopened, waiting a little longer
+ * after each failed attempt, and asked for the resume cursor; the upload
+ * gives up after RESUME_RECONNECTS attempts in a row without progress. */
+#define RESUME_WINDOW 8
+#define RESUME_RETRIES 3
+#define RESUME_TIMEOUT 2000
+#define RESUME_RECONNECTS 5
+
+struct resume_report {
+    size_t blocks;                          /* Blocks acknowledged */
+    size_t held;                            /* Blocks found on resume */
+    size_t resent;                          /* Retransmissions */
+    size_t failed;                          /* Blocks given up */
+    unsigned reconnects;                    /* Link recoveries */
+};
+
+/* Uploads the n given blocks of the image (DELTA_BLOCK sized, see
+ * delta.h). Reports how it went through r. */
+nxterr_t resume_send(nxtusb_t nxt, const struct image *img,
+                     const uint32_t *blocks, size_t n, nxtframe_t framing,
+                     struct resume_report *r, int *libusb_err);
+
+#endif /* __RESUME_H__ */
@@ -0,0 +1,146 @@
+#include "verify.h"
+#include "delta.h"
+
+#include <assert.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+/* Size of a reply: address and CRC */
+#define REPLY_LEN 8
+
+/* Reception buffer: a whole full speed packet plus a partial reply */
+#define RX_PACKET 64
+#define RX_LEN (RX_PACKET + REPLY_LEN)
+
+struct pending {
+    uint32_t block;                         /* Block position */
+    uint32_t addr;                          /* Block address */
+    uint32_t crc;                           /* Expected CRC */
+    unsigned tries;                         /* Transmissions so far */
+};
+
+struct verifier {
+    nxtusb_t nxt;
+    const struct image *img;
+    nxtframe_t framing;
+    struct nxtspan *spans;                  /* Frame scatter list */
+    uint8_t header[DELTA_HDRLEN];           /* Record header */
+    struct pending *todo;                   /* Blocks to be sent */
+    size_t todo_head, todo_tail;
+    struct pending window[VERIFY_WINDOW];   /* Blocks waiting for reply */
+    unsigned win_head, win_count;
+    uint8_t rx[RX_LEN];                     /* Received bytes */
+    size_t rx_fill;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Sends a block in its own frame and moves it to the window */
+static nxterr_t send_block(struct verifier *v, struct pending *p,
+                           int *libusb_err)
+{
+    size_t off, len, n;
+    nxterr_t err;
+
+    delta_header(v->img, p->block, 1, v->header, &off, &len);
+    v->spans[0].data = v->header;
+    v->spans[0].len = DELTA_HDRLEN;
+    n = image_slice(v->img, off, len, v->spans + 1);
+    if (p->tries == 0) {
+        p->addr = get_le32(v->header);
+        p->crc = spans_crc32(v->spans + 1, n);
+    }
+    p->tries++;
+
+    err = nxtusb_send_spans(v->nxt, v->spans, n + 1, v->framing, libusb_err);
+    if (err == NXERR_SUCCESS)
+        v->window[(v->win_head + v->win_count++) % VERIFY_WINDOW] = *p;
+    return err;
+}
+
+/* Waits for the next reply */
+static nxterr_t read_reply(struct verifier *v, uint8_t *reply,
+                           int *libusb_err)
+{
+    size_t got;
+    nxterr_t err;
+
+    while (v->rx_fill < REPLY_LEN) {
+        err = nxtusb_recv(v->nxt, v->rx + v->rx_fill, RX_PACKET,
+                          &got, libusb_err);
+        if (err != NXERR_SUCCESS)
+            return err;
+        v->rx_fill += got;
+    }
+    memcpy(reply, v->rx, REPLY_LEN);
+    memmove(v->rx, v->rx + REPLY_LEN, v->rx_fill - REPLY_LEN);
+    v->rx_fill -= REPLY_LEN;
+    return NXERR_SUCCESS;
+}
+
+/* Checks the reply to the oldest block in the window */
+static nxterr_t check_block(struct verifier *v, struct verify_report *r,
+                            int *libusb_err)
+{
+    uint8_t reply[REPLY_LEN];
+    struct pending *p;
+    nxterr_t err;
+
+    if ((err = read_reply(v, reply, libusb_err)) != NXERR_SUCCESS)
+        return err;
+    p = &v->window[v->win_head];
+    if (get_le32(reply) != p->addr) {
+        /* Replies come in order: the stream is out of sync */
+        *libusb_err = LIBUSB_ERROR_IO;
+        return NXERR_LIBUSB;
+    }
+
+    if (get_le32(reply + 4) == p->crc) {
+        r->blocks++;
+    } else if (p->tries <= VERIFY_RETRIES) {
+        v->todo[v->todo_tail++] = *p;
+        r->resent++;
+    } else {
+        r->failed++;
+    }
+    v->win_head = (v->win_head + 1) % VERIFY_WINDOW;
+    v->win_count--;
+    return NXERR_SUCCESS;
+}
+
+nxterr_t verify_send(nxtusb_t nxt, const struct image *img,
+                     const uint32_t *blocks, size_t n, nxtframe_t framing,
+                     struct verify_report *r, int *libusb_err)
+{
+    struct verifier v;
+    nxterr_t err;
+    size_t i;
+
+    memset(&v, 0, sizeof(v));
+    memset(r, 0, sizeof(struct verify_report));
+    v.nxt = nxt;
+    v.img = img;
+    v.framing = framing;
+    v.spans = malloc((img->nspans + 1) * sizeof(struct nxtspan));
+    v.todo = calloc(n * (VERIFY_RETRIES + 1) + 1, sizeof(struct pending));
+    assert(v.spans != NULL && v.todo != NULL);
+    for (i = 0; i < n; i++)
+        v.todo[v.todo_tail++].block = blocks[i];
+
+    err = NXERR_SUCCESS;
+    while (err == NXERR_SUCCESS &&
+           (v.todo_head < v.todo_tail || v.win_count > 0)) {
+        /* Keeping the window full, then checking the oldest block */
+        if (v.todo_head < v.todo_tail && v.win_count < VERIFY_WINDOW)
+            err = send_block(&v, &v.todo[v.todo_head++], libusb_err);
+        else
+            err = check_block(&v, r, libusb_err);
+    }
+
+    free(v.spans);
+    free(v.todo);
+    return err;
+}
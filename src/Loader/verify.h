@@ -0,0 +1,29 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "image.h"
+#include "../NxtAccess/nxtusb.h"
+
+/* Verified upload. Every block is sent in its own frame, as a delta
+ * record, and the device replies with the CRC-32 of the content it
+ * stored. Replies are checked while the following blocks are being
+ * sent, with up to VERIFY_WINDOW blocks in flight, and the blocks whose
+ * CRC doesn't match are sent again up to VERIFY_RETRIES times. */
+#define VERIFY_WINDOW 8
+#define VERIFY_RETRIES 3
+
+struct verify_report {
+    size_t blocks;                          /* Blocks verified */
+    size_t resent;                          /* Retransmissions */
+    size_t failed;                          /* Blocks given up */
+};
+
+/* Sends and verifies the n given blocks of the image (DELTA_BLOCK sized,
+ * see delta.h). Reports how it went through r. */
+nxterr_t verify_send(nxtusb_t nxt, const struct image *img,
+                     const uint32_t *blocks, size_t n, nxtframe_t framing,
+                     struct verify_report *r, int *libusb_err);
+
+#endif /* __VERIFY_H__ */
@@ -0,0 +1,230 @@
+#include "wirecache.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WIRE_MAGIC "BLDWIRE\n"
+#define WIRE_VERSION 2
+#define WIRE_SUFFIX ".wire"
+
+/* Entry layout: the header, then the stream */
+struct wire_header {
+    char magic[8];                          /* WIRE_MAGIC */
+    uint32_t version;                       /* WIRE_VERSION */
+    uint32_t framing;                       /* Key */
+    uint64_t hash;
+    uint32_t compressed;
+    uint32_t head;                          /* Leading bytes sent apart */
+    uint64_t len;                           /* Stream length */
+};
+
+/* Entry candidate for eviction */
+struct entry {
+    char *path;
+    off_t size;
+    struct timespec mtime;                  /* Last use */
+};
+
+static char *entry_path(const char *dir, const struct wire_key *key)
+{
+    static const char *framings[] = {
+        [NXTFRAME_ESC] = "esc",
+        [NXTFRAME_COBS] = "cobs",
+        [NXTFRAME_RAW] = "raw"
+    };
+    char *path;
+
+    if (asprintf(&path, "%s/%016llx-%s%s" WIRE_SUFFIX, dir,
+                 (unsigned long long)key->hash, framings[key->framing],
+                 key->compressed ? "-lz" : "") == -1)
+        return NULL;
+    return path;
+}
+
+bool wirecache_open(struct wire *w, const char *dir,
+                    const struct wire_key *key)
+{
+    const struct wire_header *h;
+    struct stat st;
+    char *path;
+    void *map;
+    int fd;
+
+    if ((path = entry_path(dir, key)) == NULL)
+        return false;
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        goto fail0;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct wire_header))
+        goto fail1;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail1;
+
+    h = map;
+    if (memcmp(h->magic, WIRE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != WIRE_VERSION || h->hash != key->hash ||
+        h->framing != key->framing || h->compressed != key->compressed ||
+        h->len != st.st_size - sizeof(struct wire_header) ||
+        h->head > h->len) {
+        munmap(map, st.st_size);
+        goto fail1;
+    }
+
+    /* Marking the entry as recently used */
+    futimens(fd, NULL);
+    close(fd);
+    free(path);
+    w->map = map;
+    w->maplen = st.st_size;
+    w->data = (const uint8_t *)map + sizeof(struct wire_header);
+    w->len = h->len;
+    w->head = h->head;
+    return true;
+
+  fail1:
+    close(fd);
+  fail0:
+    free(path);
+    return false;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Drops the least recently used entries, but keep, until the entries
+ * fit in limit bytes */
+static void evict(const char *dir, const char *keep, size_t limit)
+{
+    struct entry *entries, *e;
+    struct dirent *de;
+    struct stat st;
+    size_t n, size, i, len;
+    uint64_t total;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+    entries = NULL;
+    n = size = 0;
+    total = 0;
+    while ((de = readdir(d)) != NULL) {
+        len = strlen(de->d_name);
+        if (len <= strlen(WIRE_SUFFIX) ||
+            strcmp(de->d_name + len - strlen(WIRE_SUFFIX), WIRE_SUFFIX) != 0)
+            continue;
+        if (n == size) {
+            size = size ? size * 2 : 16;
+            entries = realloc(entries, size * sizeof(struct entry));
+            assert(entries != NULL);
+        }
+        e = &entries[n];
+        if (asprintf(&e->path, "%s/%s", dir, de->d_name) == -1)
+            continue;
+        if (stat(e->path, &st) == -1) {
+            free(e->path);
+            continue;
+        }
+        e->size = st.st_size;
+        e->mtime = st.st_mtim;
+        total += st.st_size;
+        n++;
+    }
+    closedir(d);
+
+    qsort(entries, n, sizeof(struct entry), entry_cmp);
+    for (i = 0; i < n; i++) {
+        if (total > limit && strcmp(entries[i].path, keep) != 0 &&
+            unlink(entries[i].path) == 0)
+            total -= entries[i].size;
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+bool wirecache_store(const char *dir, const struct wire_key *key,
+                     const struct nxtspan *spans, size_t n, size_t head,
+                     size_t limit)
+{
+    static const uint8_t zeros[4096];
+    struct wire_header h;
+    char *path, *tmpname;
+    size_t i, k, off;
+    FILE *out;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, WIRE_MAGIC, sizeof(h.magic));
+    h.version = WIRE_VERSION;
+    h.hash = key->hash;
+    h.framing = key->framing;
+    h.compressed = key->compressed;
+    h.head = head;
+    for (i = 0; i < n; i++)
+        h.len += spans[i].len;
+
+    if ((path = entry_path(dir, key)) == NULL)
+        return false;
+    /* Written aside and renamed, so that readers never map a partial
+     * entry */
+    if (asprintf(&tmpname, "%s.XXXXXX", path) == -1)
+        goto fail0;
+    if ((fd = mkstemp(tmpname)) == -1)
+        goto fail1;
+    if ((out = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        goto fail2;
+    }
+    if (fwrite(&h, sizeof(h), 1, out) != 1)
+        goto fail3;
+    for (i = 0; i < n; i++) {
+        if (spans[i].data != NULL) {
+            if (fwrite(spans[i].data, 1, spans[i].len, out) != spans[i].len)
+                goto fail3;
+            continue;
+        }
+        for (off = 0; off < spans[i].len; off += k) {
+            k = spans[i].len - off < sizeof(zeros) ? spans[i].len - off
+                                                   : sizeof(zeros);
+            if (fwrite(zeros, 1, k, out) != k)
+                goto fail3;
+        }
+    }
+    if (fclose(out) != 0 || rename(tmpname, path) == -1)
+        goto fail2;
+
+    evict(dir, path, limit);
+    free(tmpname);
+    free(path);
+    return true;
+
+  fail3:
+    fclose(out);
+  fail2:
+    unlink(tmpname);
+  fail1:
+    free(tmpname);
+  fail0:
+    free(path);
+    return false;
+}
+
+void wirecache_release(struct wire *w)
+{
+    munmap(w->map, w->maplen);
+    w->map = NULL;
+}
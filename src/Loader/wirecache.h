@@ -0,0 +1,47 @@
+#ifndef __WIRECACHE_H__
+#define __WIRECACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../NxtAccess/nxtusb.h"
+
+/* On-disk cache of upload streams, stored as they go on the wire. Each
+ * entry is keyed on the content hash of the ELF file and on the encoder
+ * settings, and is mapped in place when used, so that a cached upload
+ * costs no encoding. The directory is kept within a size bound by
+ * dropping the least recently used entries. */
+
+/* Default size bound of the cache directory */
+#define WIRECACHE_LIMIT (64UL << 20)
+
+struct wire_key {
+    uint64_t hash;                          /* elf_content_hash */
+    nxtframe_t framing;                     /* Image framing */
+    bool compressed;                        /* Image compressed */
+};
+
+/* Mapped stream */
+struct wire {
+    const uint8_t *data;                    /* Stream */
+    size_t len;                             /* Stream length */
+    size_t head;                            /* Leading bytes sent apart */
+    void *map;                              /* Entry mapping */
+    size_t maplen;
+};
+
+/* Maps the entry of the key, if any. */
+bool wirecache_open(struct wire *w, const char *dir,
+                    const struct wire_key *key);
+
+/* Stores the stream made of n spans as the entry of the key, dropping
+ * old entries to keep the directory within limit bytes. The first head
+ * bytes, as the activation record, are meant to be sent as a transfer
+ * of their own: their length is kept in the entry. */
+bool wirecache_store(const char *dir, const struct wire_key *key,
+                     const struct nxtspan *spans, size_t n, size_t head,
+                     size_t limit);
+
+void wirecache_release(struct wire *w);
+
+#endif /* __WIRECACHE_H__ */
@@ -0,0 +1,285 @@
+#include "nxtasync.h"
+#include "nxtusb_private.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+/* Default number of transfers in flight */
+static const unsigned default_depth = 8;
+
+/* Consecutive event handling failures before giving up on the transfers
+ * in flight */
+static const unsigned max_event_errors = 8;
+
+struct slot {
+    struct nxtasync *owner;                 /* Engine */
+    struct nxt_xfer xfer;                   /* Transfer descriptor */
+    uint8_t *buffer;                        /* Transfer buffer */
+    size_t fill;                            /* Bytes in buffer */
+    bool busy;                              /* Transfer in flight */
+    bool cancelled;                         /* Cancellation requested */
+};
+
+struct nxtasync {
+    nxtusb_t nxt;                           /* Device */
+    struct slot *slots;                     /* Ring of transfers */
+    unsigned depth;                         /* Number of slots */
+    unsigned head;                          /* Slot being filled */
+    unsigned inflight;                      /* Submitted transfers */
+    size_t buflen;                          /* Size of each buffer */
+    int error;                              /* First libusb error */
+    nxtasync_cb_t cb;                       /* Completion callback */
+    void *udata;                            /* Callback user data */
+    bool stuck;                             /* Transfers never drained */
+};
+
+static void complete(struct slot *s, size_t transf, int err)
+{
+    struct nxtasync *a = s->owner;
+
+    /* A short write on a bulk OUT endpoint means the device dropped
+     * data: there's no way to recover the stream position */
+    if (err == 0 && transf != s->fill)
+        err = LIBUSB_ERROR_IO;
+    if (err != 0 && a->error == 0)
+        a->error = err;
+
+    s->busy = false;
+    s->fill = 0;
+    a->inflight --;
+    if (a->cb != NULL)
+        a->cb(a->udata, transf, err);
+}
+
+static void xfer_done(struct nxt_xfer *x, size_t transf, int err)
+{
+    complete((struct slot *)x->udata, transf, err);
+}
+
+/* Submits the slot being filled and moves to the next one */
+static int submit(struct nxtasync *a)
+{
+    struct slot *s = &a->slots[a->head];
+    int ret;
+
+    s->busy = true;
+    s->cancelled = false;
+    a->inflight ++;
+    a->head = (a->head + 1) % a->depth;
+
+    s->xfer.buffer = s->buffer;
+    s->xfer.len = s->fill;
+    s->xfer.done = xfer_done;
+    s->xfer.udata = s;
+    if ((ret = nxt_submit(a->nxt, &s->xfer)) != 0)
+        complete(s, 0, ret);
+
+    return a->error;
+}
+
+/* Waits until the given condition on the engine is false */
+static int wait_while(struct nxtasync *a, bool (*cond)(struct nxtasync *))
+{
+    int (*events)(nxtusb_t) = a->nxt->ops->events;
+    int ret;
+
+    /* Transports without events complete each transfer on submission */
+    while (events != NULL && cond(a)) {
+        if ((ret = events(a->nxt)) != 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            return ret;
+    }
+    return a->error;
+}
+
+static bool head_busy(struct nxtasync *a)
+{
+    return a->slots[a->head].busy;
+}
+
+static bool any_inflight(struct nxtasync *a)
+{
+    return a->inflight > 0;
+}
+
+/* After a failure, cancels the transfers in flight and waits for them as
+ * long as the events are served. The engine is stuck if they never
+ * complete. */
+static void settle(struct nxtasync *a)
+{
+    int (*events)(nxtusb_t) = a->nxt->ops->events;
+    int (*cancel)(nxtusb_t, struct nxt_xfer *) = a->nxt->ops->cancel;
+    unsigned i, failures;
+    struct slot *s;
+    int ret;
+
+    for (i = 0; i < a->depth; i++) {
+        s = &a->slots[i];
+        if (s->busy && !s->cancelled && cancel != NULL) {
+            s->cancelled = true;
+            cancel(a->nxt, &s->xfer);
+        }
+    }
+
+    failures = 0;
+    while (events != NULL && a->inflight > 0) {
+        ret = events(a->nxt);
+        if (ret == 0 || ret == LIBUSB_ERROR_INTERRUPTED) {
+            failures = 0;
+        } else if (++failures == max_event_errors) {
+            a->stuck = true;
+            return;
+        }
+    }
+}
+
+nxterr_t nxtasync_new(nxtasync_t *async, nxtusb_t nxt, unsigned depth,
+                      size_t buflen)
+{
+    nxtasync_t ret;
+    unsigned i;
+
+    assert(nxt != NULL);
+    if (depth == 0)
+        depth = default_depth;
+    if (buflen == 0)
+        buflen = nxt->xfer_len;
+
+    ret = malloc(sizeof(struct nxtasync));
+    assert(ret != NULL);
+    ret->slots = calloc(depth, sizeof(struct slot));
+    assert(ret->slots != NULL);
+    for (i = 0; i < depth; i++) {
+        ret->slots[i].owner = ret;
+        ret->slots[i].buffer = malloc(buflen);
+        assert(ret->slots[i].buffer != NULL);
+    }
+    ret->nxt = nxt;
+    ret->depth = depth;
+    ret->head = 0;
+    ret->inflight = 0;
+    ret->buflen = buflen;
+    ret->error = 0;
+    ret->cb = NULL;
+    ret->udata = NULL;
+    ret->stuck = false;
+
+    *async = ret;
+    return NXERR_SUCCESS;
+}
+
+void nxtasync_free(nxtasync_t async)
+{
+    unsigned i;
+    int err;
+
+    if (async == NULL)
+        return;
+
+    /* Transfers still in flight reference the buffers. Those never
+     * drained may still complete: the engine is left to them. */
+    nxtasync_drain(async, &err);
+    if (async->stuck)
+        return;
+    for (i = 0; i < async->depth; i++) {
+        if (async->nxt->ops->xfer_free != NULL)
+            async->nxt->ops->xfer_free(async->nxt, &async->slots[i].xfer);
+        free(async->slots[i].buffer);
+    }
+    free(async->slots);
+    free(async);
+}
+
+void nxtasync_set_callback(nxtasync_t async, nxtasync_cb_t cb, void *udata)
+{
+    async->cb = cb;
+    async->udata = udata;
+}
+
+/* Copies the data in the ring, submitting the buffers as they fill up.
+ * Returns the libusb return value. */
+static int queue(struct nxtasync *a, const uint8_t *in, size_t len)
+{
+    struct slot *s;
+    size_t n;
+    int ret;
+
+    while (len > 0) {
+        /* Waiting for the next buffer of the ring to be released */
+        if ((ret = wait_while(a, head_busy)) != 0)
+            return ret;
+
+        s = &a->slots[a->head];
+        n = a->buflen - s->fill;
+        if (n > len)
+            n = len;
+        memcpy(s->buffer + s->fill, in, n);
+        s->fill += n;
+        in += n;
+        len -= n;
+
+        if (s->fill == a->buflen && (ret = submit(a)) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+nxterr_t nxtasync_write(nxtasync_t async, const void *buffer, size_t len,
+                        int *libusb_err)
+{
+    int ret;
+
+    async->nxt->stats.payload += len;
+    if ((ret = queue(async, buffer, len)) != 0) {
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
+    return NXERR_SUCCESS;
+}
+
+nxterr_t nxtasync_flush(nxtasync_t async, int *libusb_err)
+{
+    struct slot *s = &async->slots[async->head];
+    int ret;
+
+    if (!s->busy && s->fill > 0 && (ret = submit(async)) != 0) {
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
+    return NXERR_SUCCESS;
+}
+
+int nxt_async_send(struct nxtasync *a, const uint8_t *buffer, size_t len)
+{
+    struct slot *s;
+    int ret;
+
+    if ((ret = queue(a, buffer, len)) != 0)
+        return ret;
+    /* The partial buffer goes out as it is, ending the transfer there */
+    s = &a->slots[a->head];
+    return !s->busy && s->fill > 0 ? submit(a) : 0;
+}
+
+nxterr_t nxtasync_drain(nxtasync_t async, int *libusb_err)
+{
+    int ret;
+
+    if (async->stuck) {
+        *libusb_err = async->error != 0 ? async->error : LIBUSB_ERROR_IO;
+        return NXERR_LIBUSB;
+    }
+    if (nxtasync_flush(async, libusb_err) != NXERR_SUCCESS) {
+        /* Still waiting for what's in flight, the buffers belong to it */
+        settle(async);
+        return NXERR_LIBUSB;
+    }
+    if ((ret = wait_while(async, any_inflight)) != 0) {
+        settle(async);
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
+    return NXERR_SUCCESS;
+}
@@ -0,0 +1,28 @@
+#ifndef __NXTASYNC_H__
+#define __NXTASYNC_H__
+
+#include <stdlib.h>
+#include "nxtusb.h"
+
+/* Asynchronous transmit engine: data is copied into a ring of transfer
+ * buffers and up to depth transfers are kept in flight at once. The
+ * senders of nxtusb.h go through it on USB devices. */
+typedef struct nxtasync * nxtasync_t;
+
+/* Completion notification, called once per transfer with the number of
+ * transmitted bytes and the libusb error code (0 on success). */
+typedef void (*nxtasync_cb_t)(void *udata, size_t transf, int libusb_err);
+
+/* A depth or buflen of 0 selects the default, buffers being as large as
+ * the device transfer size (see nxtusb_set_xfer_len) */
+nxterr_t nxtasync_new(nxtasync_t *async, nxtusb_t nxt, unsigned depth,
+                      size_t buflen);
+void nxtasync_free(nxtasync_t async);
+void nxtasync_set_callback(nxtasync_t async, nxtasync_cb_t cb,
+                           void *udata);
+nxterr_t nxtasync_write(nxtasync_t async, const void *buffer, size_t len,
+                        int *libusb_err);
+nxterr_t nxtasync_flush(nxtasync_t async, int *libusb_err);
+nxterr_t nxtasync_drain(nxtasync_t async, int *libusb_err);
+
+#endif /* __NXTASYNC_H__ */
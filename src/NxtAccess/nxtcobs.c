@@ -0,0 +1,109 @@
+#include "nxtcobs.h"
+
+#include <string.h>
+
+/* Largest group code: 254 bytes and no implicit zero */
+static const unsigned max_code = 0xff;
+
+/* Writes the code of the open group and opens a new one at fill */
+static size_t group_close(struct nxtcobs_enc *e, uint8_t *out, size_t fill)
+{
+    out[e->code] = e->run;
+    e->code = fill;
+    e->run = 1;
+    return fill + 1;
+}
+
+size_t nxtcobs_begin(struct nxtcobs_enc *e, uint8_t *out, size_t fill)
+{
+    e->code = fill;
+    e->run = 1;
+    return fill + 1;
+}
+
+size_t nxtcobs_encode(struct nxtcobs_enc *e, const uint8_t *in, size_t len,
+                      uint8_t *out, size_t fill)
+{
+    const uint8_t *zero;
+    size_t n;
+
+    while (len > 0) {
+        /* Copying up to the next zero or the end of the group */
+        n = max_code - e->run;
+        if (n > len)
+            n = len;
+        zero = memchr(in, 0, n);
+        if (zero != NULL)
+            n = zero - in;
+        memcpy(out + fill, in, n);
+        fill += n;
+        e->run += n;
+        in += n;
+        len -= n;
+
+        if (zero != NULL) {
+            /* The zero is implied by the group code */
+            in++;
+            len--;
+            fill = group_close(e, out, fill);
+        } else if (e->run == max_code) {
+            fill = group_close(e, out, fill);
+        }
+    }
+    return fill;
+}
+
+size_t nxtcobs_end(struct nxtcobs_enc *e, uint8_t *out, size_t fill)
+{
+    out[e->code] = e->run;
+    out[fill++] = NXTCOBS_DELIM;
+    return fill;
+}
+
+void nxtcobs_dec_init(struct nxtcobs_dec *d)
+{
+    d->left = 0;
+    d->zero = 0;
+}
+
+size_t nxtcobs_decode(struct nxtcobs_dec *d, const uint8_t *in, size_t len,
+                      uint8_t *out, size_t *outlen, int *status)
+{
+    const uint8_t *zero;
+    size_t i, o, n;
+    uint8_t code;
+
+    *status = NXTCOBS_MORE;
+    for (i = 0, o = 0; i < len; ) {
+        if (d->left > 0) {
+            n = d->left < len - i ? d->left : len - i;
+            zero = memchr(in + i, NXTCOBS_DELIM, n);
+            if (zero != NULL) {
+                /* Terminator inside a group */
+                i = zero - in + 1;
+                nxtcobs_dec_init(d);
+                *status = NXTCOBS_BROKEN;
+                break;
+            }
+            memcpy(out + o, in + i, n);
+            o += n;
+            i += n;
+            d->left -= n;
+            continue;
+        }
+
+        code = in[i++];
+        if (code == NXTCOBS_DELIM) {
+            /* The zero of the last group is not part of the payload */
+            nxtcobs_dec_init(d);
+            *status = NXTCOBS_FRAME;
+            break;
+        }
+        if (d->zero)
+            out[o++] = 0;
+        d->left = code - 1;
+        d->zero = code < max_code;
+    }
+    *outlen = o;
+    return i;
+}
@@ -0,0 +1,58 @@
+#ifndef __NXTCOBS_H__
+#define __NXTCOBS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Consistent overhead byte stuffing. The payload is split in groups of
+ * at most 254 non-zero bytes, each preceded by a code byte holding the
+ * group length plus one. A code below 0xff stands for a zero following
+ * the group, except in the last group of the frame. The frame is
+ * terminated by a zero, which can't appear anywhere else. */
+#define NXTCOBS_DELIM 0x00
+
+/* Worst case encoded size for len payload bytes, terminator excluded */
+#define NXTCOBS_MAXLEN(len) ((len) + (len) / 254 + 1)
+
+/* Streaming encoder. The code byte of the open group is written when the
+ * group is closed: the output from position code on is not final yet.
+ * Callers moving the output buffer must adjust code accordingly. */
+struct nxtcobs_enc {
+    size_t code;                            /* Open group code position */
+    unsigned run;                           /* Open group code so far */
+};
+
+/* Opens a frame at position fill of out. Returns the new fill. */
+size_t nxtcobs_begin(struct nxtcobs_enc *e, uint8_t *out, size_t fill);
+
+/* Encodes len bytes at position fill of out, which must have room for
+ * NXTCOBS_MAXLEN(len) more bytes. Returns the new fill. */
+size_t nxtcobs_encode(struct nxtcobs_enc *e, const uint8_t *in, size_t len,
+                      uint8_t *out, size_t fill);
+
+/* Closes the frame and appends the terminator. Returns the new fill. */
+size_t nxtcobs_end(struct nxtcobs_enc *e, uint8_t *out, size_t fill);
+
+/* Reference decoder, as run by the brick */
+struct nxtcobs_dec {
+    unsigned left;                          /* Bytes left in the group */
+    int zero;                               /* Group ends with a zero */
+};
+
+/* Decoding status */
+enum {
+    NXTCOBS_MORE = 0,                       /* Frame not complete yet */
+    NXTCOBS_FRAME,                          /* Frame completed */
+    NXTCOBS_BROKEN                          /* Frame truncated */
+};
+
+/* Initializes the decoder, before the first frame */
+void nxtcobs_dec_init(struct nxtcobs_dec *d);
+
+/* Decodes at most len wire bytes into out, which must hold len bytes,
+ * stopping after a terminator. Returns the consumed bytes, the decoded
+ * length through outlen and the frame status through status. */
+size_t nxtcobs_decode(struct nxtcobs_dec *d, const uint8_t *in, size_t len,
+                      uint8_t *out, size_t *outlen, int *status);
+
+#endif /* __NXTCOBS_H__ */
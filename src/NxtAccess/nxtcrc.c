@@ -0,0 +1,55 @@
+#include "nxtcrc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Reflected polynomial */
+static const uint32_t poly = 0xedb88320;
+
+/* Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k
+ * zero bytes, so that eight input bytes are folded with eight lookups */
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void)
+{
+    uint32_t c;
+    unsigned b, k;
+
+    for (b = 0; b < 256; b++) {
+        c = b;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+        table[0][b] = c;
+    }
+    for (b = 0; b < 256; b++)
+        for (k = 1; k < 8; k++)
+            table[k][b] = (table[k - 1][b] >> 8) ^
+                          table[0][table[k - 1][b] & 0xff];
+}
+
+uint32_t nxtcrc32(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t lo, hi;
+
+    pthread_once(&table_once, table_init);
+
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+        #endif
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; len > 0; len--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
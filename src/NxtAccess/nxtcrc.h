@@ -0,0 +1,11 @@
+#ifndef __NXTCRC_H__
+#define __NXTCRC_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* CRC-32 (IEEE 802.3, as zlib). The checksum of a sequence of buffers is
+ * obtained by chaining the calls, starting from 0. */
+uint32_t nxtcrc32(uint32_t crc, const void *data, size_t len);
+
+#endif /* __NXTCRC_H__ */
@@ -0,0 +1,89 @@
+#include "nxtesc.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Portable scanner: eight bytes at a time, using the classic "has zero
+ * byte" test on the word xored with the two escape patterns */
+static size_t scan_words(const uint8_t *in, size_t len)
+{
+    static const uint64_t ones = 0x0101010101010101ULL;
+    static const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t w, a, b;
+    size_t i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, in + i, sizeof(w));
+        a = w ^ (ones * NXTESC_ESC);
+        b = w ^ (ones * NXTESC_EOT);
+        if ((((a - ones) & ~a) | ((b - ones) & ~b)) & highs)
+            break;
+    }
+    for (; i < len; i++)
+        if (in[i] == NXTESC_ESC || in[i] == NXTESC_EOT)
+            break;
+    return i;
+}
+
+size_t nxtesc_scan(const uint8_t *in, size_t len)
+{
+    size_t i = 0;
+
+    #if defined(__AVX2__)
+
+    const __m256i vesc = _mm256_set1_epi8(NXTESC_ESC);
+    const __m256i veot = _mm256_set1_epi8(NXTESC_EOT);
+    __m256i v;
+    uint32_t mask;
+
+    for (; i + sizeof(v) <= len; i += sizeof(v)) {
+        v = _mm256_loadu_si256((const __m256i *)(in + i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, vesc), _mm256_cmpeq_epi8(v, veot)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    #elif defined(__SSE2__)
+
+    const __m128i vesc = _mm_set1_epi8(NXTESC_ESC);
+    const __m128i veot = _mm_set1_epi8(NXTESC_EOT);
+    __m128i v;
+    uint32_t mask;
+
+    for (; i + sizeof(v) <= len; i += sizeof(v)) {
+        v = _mm_loadu_si128((const __m128i *)(in + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vesc),
+                                              _mm_cmpeq_epi8(v, veot)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    #endif
+
+    return i + scan_words(in + i, len - i);
+}
+
+size_t nxtesc_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    uint8_t *o = out;
+    size_t n;
+
+    while (len > 0) {
+        /* Copying the run up to the next byte to be escaped */
+        n = nxtesc_scan(in, len);
+        memcpy(o, in, n);
+        o += n;
+        in += n;
+        len -= n;
+        if (len == 0)
+            break;
+        *o++ = NXTESC_ESC;
+        *o++ = *in++;
+        len--;
+    }
+    return o - out;
+}
@@ -0,0 +1,22 @@
+#ifndef __NXTESC_H__
+#define __NXTESC_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Byte stuffing: each ESC or EOT byte of the payload is preceded by ESC,
+ * and the stream is terminated by an unescaped EOT. */
+#define NXTESC_ESC 0x1b
+#define NXTESC_EOT 0x04
+
+/* Worst case encoded size for len payload bytes, terminator excluded */
+#define NXTESC_MAXLEN(len) (2 * (len))
+
+/* Returns the position of the first byte needing escape, or len */
+size_t nxtesc_scan(const uint8_t *in, size_t len);
+
+/* Encodes len bytes into out, which must hold NXTESC_MAXLEN(len) bytes.
+ * Returns the encoded size. */
+size_t nxtesc_encode(const uint8_t *in, size_t len, uint8_t *out);
+
+#endif /* __NXTESC_H__ */
@@ -0,0 +1,367 @@
+#include "nxtlz.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Encoder hash table size */
+#define HASH_BITS 12
+
+/* Blocks being read, compressed or written per thread */
+static const unsigned slots_per_thread = 2;
+
+/* -------------------------------------------------------------------- */
+/* Block encoder                                                        */
+/* -------------------------------------------------------------------- */
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *o, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *o++ = 255;
+    *o++ = n;
+    return o;
+}
+
+static uint8_t *put_token(uint8_t *o, const uint8_t *lit, size_t nlit,
+                          size_t off, size_t mlen)
+{
+    size_t m = off != 0 ? mlen - NXTLZ_MINMATCH : 0;
+
+    *o++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15)
+        o = put_len(o, nlit - 15);
+    memcpy(o, lit, nlit);
+    o += nlit;
+    *o++ = off & 0xff;
+    *o++ = off >> 8;
+    if (off != 0 && m >= 15)
+        o = put_len(o, m - 15);
+    return o;
+}
+
+/* Compresses a block into out, which must hold NXTLZ_MAXLEN(len) bytes.
+ * Matches are searched through a single probe hash table. */
+static size_t lz_block(const uint8_t *in, size_t len, uint8_t *out,
+                       uint32_t *table)
+{
+    uint8_t *o = out;
+    size_t i, anchor, cand, ml;
+    uint32_t h;
+
+    memset(table, 0, sizeof(uint32_t) << HASH_BITS);
+    for (i = 0, anchor = 0; i + NXTLZ_MINMATCH <= len; ) {
+        h = lz_hash(in + i);
+        cand = table[h];
+        table[h] = i + 1;
+        if (cand == 0 || i - (cand - 1) >= NXTLZ_WINDOW ||
+            memcmp(in + cand - 1, in + i, NXTLZ_MINMATCH) != 0) {
+            i++;
+            continue;
+        }
+
+        cand--;
+        for (ml = NXTLZ_MINMATCH; i + ml < len && in[cand + ml] == in[i + ml];
+             ml++)
+            ;
+        o = put_token(o, in + anchor, i - anchor, i - cand, ml);
+        i += ml;
+        anchor = i;
+    }
+    if (anchor < len)
+        o = put_token(o, in + anchor, len - anchor, 0, 0);
+    return o - out;
+}
+
+/* -------------------------------------------------------------------- */
+/* Parallel encoder                                                     */
+/* -------------------------------------------------------------------- */
+
+/* Block states */
+enum {
+    SLOT_FREE = 0,                          /* Owned by the reader */
+    SLOT_READY,                             /* Waiting for a worker */
+    SLOT_BUSY,                              /* Being compressed */
+    SLOT_DONE                               /* Waiting for the writer */
+};
+
+struct slot {
+    int state;
+    uint8_t *in;                            /* Block content */
+    size_t inlen;
+    uint8_t *out;                           /* Compressed block */
+    size_t outlen;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                    /* Any slot changed state */
+    struct slot *slots;
+    unsigned nslots;
+    size_t filled;                          /* Blocks handed to workers */
+    size_t taken;                           /* Blocks taken by workers */
+    bool stop;                              /* Workers must exit */
+};
+
+static void *worker(void *arg)
+{
+    struct pool *p = arg;
+    struct slot *s;
+    uint32_t *table;
+
+    table = malloc(sizeof(uint32_t) << HASH_BITS);
+    assert(table != NULL);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && p->taken == p->filled)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->stop)
+            break;
+        s = &p->slots[p->taken++ % p->nslots];
+        s->state = SLOT_BUSY;
+        pthread_mutex_unlock(&p->lock);
+
+        s->outlen = lz_block(s->in, s->inlen, s->out, table);
+
+        pthread_mutex_lock(&p->lock);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    free(table);
+    return NULL;
+}
+
+/* Scatter list reader */
+struct reader {
+    const struct nxtspan *span;             /* Current span */
+    const struct nxtspan *end;              /* Past the last span */
+    size_t off;                             /* Offset in current span */
+};
+
+/* Gathers up to len bytes into dst; returns the gathered length */
+static size_t reader_fill(struct reader *r, uint8_t *dst, size_t len)
+{
+    const struct nxtspan *s;
+    size_t got, n;
+
+    for (got = 0; got < len && r->span < r->end; ) {
+        s = r->span;
+        n = s->len - r->off < len - got ? s->len - r->off : len - got;
+        if (s->data != NULL)
+            memcpy(dst + got, (const uint8_t *)s->data + r->off, n);
+        else
+            memset(dst + got, 0, n);
+        got += n;
+        r->off += n;
+        if (r->off == s->len) {
+            r->span++;
+            r->off = 0;
+        }
+    }
+    return got;
+}
+
+int nxtlz_compress(const struct nxtspan *spans, size_t n, unsigned threads,
+                   nxtlz_out_t out, void *udata)
+{
+    struct pool p;
+    struct reader r;
+    struct slot *s;
+    pthread_t *tids;
+    size_t total, nblocks, written, i;
+    long cpus;
+    int ret;
+
+    for (i = 0, total = 0; i < n; i++)
+        total += spans[i].len;
+    nblocks = (total + NXTLZ_BLOCK - 1) / NXTLZ_BLOCK;
+
+    if (threads == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+    if (threads > nblocks)
+        threads = nblocks > 0 ? nblocks : 1;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.nslots = threads * slots_per_thread;
+    p.slots = calloc(p.nslots, sizeof(struct slot));
+    assert(p.slots != NULL);
+    for (i = 0; i < p.nslots; i++) {
+        p.slots[i].in = malloc(NXTLZ_BLOCK);
+        p.slots[i].out = malloc(NXTLZ_MAXLEN(NXTLZ_BLOCK));
+        assert(p.slots[i].in != NULL && p.slots[i].out != NULL);
+    }
+    p.filled = p.taken = 0;
+    p.stop = false;
+
+    tids = malloc(threads * sizeof(pthread_t));
+    assert(tids != NULL);
+    for (i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, worker, &p);
+
+    r.span = spans;
+    r.end = spans + n;
+    r.off = 0;
+    ret = 0;
+    for (written = 0; written < nblocks && ret == 0; written++) {
+        /* Reading ahead into every free slot */
+        while (p.filled < nblocks && p.filled - written < p.nslots) {
+            s = &p.slots[p.filled % p.nslots];
+            s->inlen = reader_fill(&r, s->in, NXTLZ_BLOCK);
+            pthread_mutex_lock(&p.lock);
+            s->state = SLOT_READY;
+            p.filled++;
+            pthread_cond_broadcast(&p.cond);
+            pthread_mutex_unlock(&p.lock);
+        }
+
+        /* Writing the next block in order */
+        s = &p.slots[written % p.nslots];
+        pthread_mutex_lock(&p.lock);
+        while (s->state != SLOT_DONE)
+            pthread_cond_wait(&p.cond, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+        ret = out(udata, s->out, s->outlen);
+        s->state = SLOT_FREE;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = true;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    for (i = 0; i < p.nslots; i++) {
+        free(p.slots[i].in);
+        free(p.slots[i].out);
+    }
+    free(p.slots);
+    free(tids);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    return ret;
+}
+
+/* -------------------------------------------------------------------- */
+/* Reference decoder                                                    */
+/* -------------------------------------------------------------------- */
+
+/* Parser states */
+enum {
+    DEC_TOKEN = 0,                          /* Control byte */
+    DEC_LITEXT,                             /* Literal length extension */
+    DEC_LIT,                                /* Literals */
+    DEC_OFFLO,                              /* Offset, low byte */
+    DEC_OFFHI,                              /* Offset, high byte */
+    DEC_MATCHEXT                            /* Match length extension */
+};
+
+static void dec_flush(struct nxtlz_dec *d, nxtlz_emit_t emit, void *udata)
+{
+    size_t from = d->flushed % NXTLZ_WINDOW;
+
+    if (d->pos == d->flushed)
+        return;
+    emit(udata, d->window + from, d->pos - d->flushed);
+    d->flushed = d->pos;
+}
+
+static void dec_put(struct nxtlz_dec *d, uint8_t b, nxtlz_emit_t emit,
+                    void *udata)
+{
+    d->window[d->pos++ % NXTLZ_WINDOW] = b;
+
+    /* The window is passed on before being overwritten */
+    if (d->pos % NXTLZ_WINDOW == 0)
+        dec_flush(d, emit, udata);
+}
+
+/* Copies the current match */
+static bool dec_match(struct nxtlz_dec *d, nxtlz_emit_t emit, void *udata)
+{
+    size_t i;
+
+    if (d->off > d->pos || d->off > NXTLZ_WINDOW)
+        return false;
+    for (i = 0; i < d->match; i++)
+        dec_put(d, d->window[(d->pos - d->off) % NXTLZ_WINDOW], emit, udata);
+    d->state = DEC_TOKEN;
+    return true;
+}
+
+void nxtlz_dec_init(struct nxtlz_dec *d)
+{
+    d->pos = 0;
+    d->flushed = 0;
+    d->state = DEC_TOKEN;
+}
+
+bool nxtlz_decode(struct nxtlz_dec *d, const uint8_t *in, size_t len,
+                  nxtlz_emit_t emit, void *udata)
+{
+    const uint8_t *end = in + len;
+    uint8_t b;
+    bool ok = true;
+
+    while (ok && in < end) {
+        b = *in++;
+        switch (d->state) {
+            case DEC_TOKEN:
+                d->token = b;
+                d->lit = b >> 4;
+                d->match = (b & 0x0f) + NXTLZ_MINMATCH;
+                d->state = d->lit == 15 ? DEC_LITEXT
+                         : d->lit > 0 ? DEC_LIT : DEC_OFFLO;
+                break;
+            case DEC_LITEXT:
+                d->lit += b;
+                if (b < 255)
+                    d->state = d->lit > 0 ? DEC_LIT : DEC_OFFLO;
+                break;
+            case DEC_LIT:
+                dec_put(d, b, emit, udata);
+                if (--d->lit == 0)
+                    d->state = DEC_OFFLO;
+                break;
+            case DEC_OFFLO:
+                d->off = b;
+                d->state = DEC_OFFHI;
+                break;
+            case DEC_OFFHI:
+                d->off |= b << 8;
+                if (d->off == 0)
+                    d->state = DEC_TOKEN;
+                else if ((d->token & 0x0f) == 15)
+                    d->state = DEC_MATCHEXT;
+                else
+                    ok = dec_match(d, emit, udata);
+                break;
+            case DEC_MATCHEXT:
+                d->match += b;
+                if (b < 255)
+                    ok = dec_match(d, emit, udata);
+                break;
+        }
+    }
+    dec_flush(d, emit, udata);
+    return ok;
+}
+
+bool nxtlz_dec_complete(const struct nxtlz_dec *d)
+{
+    return d->state == DEC_TOKEN;
+}
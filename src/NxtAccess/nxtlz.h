@@ -0,0 +1,66 @@
+#ifndef __NXTLZ_H__
+#define __NXTLZ_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "nxtusb.h"
+
+/* LZ compression of the upload payload.
+ *
+ * The stream is a sequence of tokens. Each token starts with a control
+ * byte: the high nibble is the literal length, the low nibble the match
+ * length minus NXTLZ_MINMATCH. Then come the literals and a little
+ * endian 16 bit match offset, where 0 stands for no match. A length
+ * nibble of 15 is extended by the bytes following the control byte for
+ * literals, or the offset for matches: each is added to the length,
+ * until one below 255.
+ *
+ * Offsets never exceed the window, so the decoder needs no more memory
+ * than NXTLZ_WINDOW bytes of history. The encoder compresses blocks of
+ * NXTLZ_BLOCK bytes independently, so that they can be compressed in
+ * parallel. */
+#define NXTLZ_WINDOW 4096
+#define NXTLZ_MINMATCH 4
+#define NXTLZ_BLOCK (64 * 1024)
+
+/* Worst case compressed size of a block of len bytes */
+#define NXTLZ_MAXLEN(len) ((len) + (len) / 255 + 16)
+
+/* Compressed stream consumer, called in stream order. A non zero return
+ * value stops the compression. */
+typedef int (*nxtlz_out_t)(void *udata, const uint8_t *data, size_t len);
+
+/* Compresses the scatter list, using the given number of threads (0 for
+ * one per online CPU). The compressed stream is passed to out block by
+ * block, as soon as each block is available. Returns 0 on success or
+ * the value returned by out. */
+int nxtlz_compress(const struct nxtspan *spans, size_t n, unsigned threads,
+                   nxtlz_out_t out, void *udata);
+
+/* Reference decoder, as run by the brick */
+struct nxtlz_dec {
+    uint8_t window[NXTLZ_WINDOW];           /* History */
+    size_t pos;                             /* Decoded bytes */
+    size_t flushed;                         /* Bytes passed to the output */
+    int state;                              /* Parser state */
+    uint8_t token;                          /* Current control byte */
+    size_t lit;                             /* Literal bytes to go */
+    size_t match;                           /* Match length */
+    unsigned off;                           /* Match offset */
+};
+
+/* Decoded data consumer */
+typedef void (*nxtlz_emit_t)(void *udata, const uint8_t *data, size_t len);
+
+void nxtlz_dec_init(struct nxtlz_dec *d);
+
+/* Decodes len compressed bytes, passing the decoded ones to emit.
+ * Returns false if the stream is malformed. */
+bool nxtlz_decode(struct nxtlz_dec *d, const uint8_t *in, size_t len,
+                  nxtlz_emit_t emit, void *udata);
+
+/* Tells whether the stream decoded so far ends on a token boundary */
+bool nxtlz_dec_complete(const struct nxtlz_dec *d);
+
+#endif /* __NXTLZ_H__ */
@@ -0,0 +1,298 @@
+#include "nxtmulti.h"
+#include "nxtusb_private.h"
+#include "nxtesc.h"
+#include "nxtcobs.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/* Default number of transfers in flight per device */
+static const unsigned default_depth = 4;
+
+/* Consecutive failures of the event handling before giving up on the
+ * transfers still in flight */
+static const unsigned max_event_errors = 8;
+
+struct target;
+
+struct mxfer {
+    struct nxt_xfer x;                      /* Transfer descriptor */
+    struct target *owner;                   /* Device */
+    bool busy;                              /* In flight */
+    bool cancelled;                         /* Cancellation requested */
+};
+
+struct target {
+    nxtusb_t nxt;                           /* Device */
+    size_t pos;                             /* Position in the device list */
+    struct mxfer *xfers;                    /* Transfer descriptors */
+    unsigned inflight;                      /* Submitted transfers */
+    size_t next;                            /* Next byte to submit */
+    size_t acked;                           /* Bytes completed */
+    int error;                              /* First libusb error */
+    struct timespec start;                  /* Upload start */
+    struct nxtmulti_report *report;         /* Final report */
+    bool reported;                          /* Report filled */
+    nxtmulti_progress_t progress;           /* Progress callback */
+    void *udata;                            /* Callback user data */
+    size_t total;                           /* Stream length */
+};
+
+/* Encodes a span, zeros included, with the COBS encoder */
+static size_t span_cobs(struct nxtcobs_enc *e, const struct nxtspan *span,
+                         uint8_t *wire, size_t w)
+{
+    static const uint8_t zeros[256];
+    size_t off, n;
+
+    if (span->data != NULL)
+        return nxtcobs_encode(e, span->data, span->len, wire, w);
+    for (off = 0; off < span->len; off += n) {
+        n = span->len - off < sizeof(zeros) ? span->len - off
+                                            : sizeof(zeros);
+        w = nxtcobs_encode(e, zeros, n, wire, w);
+    }
+    return w;
+}
+
+uint8_t *nxtmulti_prepare_spans(const struct nxtspan *spans, size_t n,
+                                nxtframe_t framing, size_t *wire_len)
+{
+    struct nxtcobs_enc e;
+    uint8_t *wire;
+    size_t i, len, w;
+
+    /* Zeros don't need escaping */
+    for (i = 0, len = 0; i < n; i++)
+        len += framing == NXTFRAME_ESC && spans[i].data != NULL
+               ? NXTESC_MAXLEN(spans[i].len) : spans[i].len;
+    if (framing == NXTFRAME_COBS)
+        len = NXTCOBS_MAXLEN(len);
+    wire = malloc(len + 1);
+    assert(wire != NULL);
+
+    w = framing == NXTFRAME_COBS ? nxtcobs_begin(&e, wire, 0) : 0;
+    for (i = 0; i < n; i++) {
+        if (framing == NXTFRAME_COBS) {
+            w = span_cobs(&e, &spans[i], wire, w);
+        } else if (spans[i].data == NULL) {
+            memset(wire + w, 0, spans[i].len);
+            w += spans[i].len;
+        } else if (framing == NXTFRAME_ESC) {
+            w += nxtesc_encode(spans[i].data, spans[i].len, wire + w);
+        } else {
+            memcpy(wire + w, spans[i].data, spans[i].len);
+            w += spans[i].len;
+        }
+    }
+    if (framing == NXTFRAME_ESC)
+        wire[w++] = NXTESC_EOT;
+    else if (framing == NXTFRAME_COBS)
+        w = nxtcobs_end(&e, wire, w);
+    *wire_len = w;
+    return wire;
+}
+
+uint8_t *nxtmulti_prepare_escaped(const void *payload, size_t len,
+                                  size_t *wire_len)
+{
+    struct nxtspan span = {
+        .data = payload,
+        .len = len
+    };
+
+    return nxtmulti_prepare_spans(&span, 1, NXTFRAME_ESC, wire_len);
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void mxfer_done(struct nxt_xfer *x, size_t transf, int err)
+{
+    struct mxfer *m = x->udata;
+    struct target *t = m->owner;
+
+    if (err == 0 && transf != x->len)
+        err = LIBUSB_ERROR_IO;
+    if (err != 0 && t->error == 0)
+        t->error = err;
+    if (err == 0)
+        t->acked += transf;
+
+    m->busy = false;
+    t->inflight--;
+    if (t->progress != NULL)
+        t->progress(t->udata, t->pos, t->acked, t->total);
+}
+
+/* Submits one more transfer of the stream, if there's a free descriptor */
+static bool target_push(struct target *t, const uint8_t *wire,
+                        unsigned depth)
+{
+    struct mxfer *m;
+    unsigned i;
+    int ret;
+
+    if (t->error != 0 || t->next == t->total || t->inflight == depth)
+        return false;
+    for (i = 0; t->xfers[i].busy; i++)
+        ;
+    m = &t->xfers[i];
+    m->busy = true;
+    m->cancelled = false;
+    m->x.buffer = (uint8_t *)wire + t->next;
+    m->x.len = t->total - t->next < t->nxt->xfer_len ? t->total - t->next
+                                                      : t->nxt->xfer_len;
+    m->x.done = mxfer_done;
+    m->x.udata = m;
+    t->next += m->x.len;
+    t->inflight++;
+    if ((ret = nxt_submit(t->nxt, &m->x)) != 0)
+        mxfer_done(&m->x, 0, ret);
+    return true;
+}
+
+/* Cancels the transfers in flight, which complete on the next events */
+static void target_cancel(struct target *t, unsigned depth)
+{
+    struct mxfer *m;
+    unsigned k;
+
+    if (t->nxt->ops->cancel == NULL)
+        return;
+    for (k = 0; k < depth; k++) {
+        m = &t->xfers[k];
+        if (m->busy && !m->cancelled) {
+            m->cancelled = true;
+            t->nxt->ops->cancel(t->nxt, &m->x);
+        }
+    }
+}
+
+static bool target_active(const struct target *t)
+{
+    return t->inflight > 0 ||
+           (t->error == 0 && t->next < t->total);
+}
+
+static void target_report(struct target *t)
+{
+    struct nxtmulti_report *r = t->report;
+
+    r->sent = t->acked;
+    r->libusb_err = t->error;
+    r->err = t->error != 0 ? NXERR_LIBUSB : NXERR_SUCCESS;
+    r->seconds = elapsed(&t->start);
+    t->reported = true;
+}
+
+size_t nxtmulti_send(nxtusb_t *nxts, size_t n, const uint8_t *wire,
+                     size_t wire_len, unsigned depth,
+                     struct nxtmulti_report *reports,
+                     nxtmulti_progress_t progress, void *udata)
+{
+    struct target *targets, *t;
+    size_t i, active, done;
+    unsigned k, failures;
+    bool pushed, stuck;
+    nxtusb_t waiter;
+    int ret;
+
+    if (depth == 0)
+        depth = default_depth;
+
+    targets = calloc(n > 0 ? n : 1, sizeof(struct target));
+    assert(targets != NULL);
+    for (i = 0; i < n; i++) {
+        t = &targets[i];
+        t->nxt = nxts[i];
+        t->pos = i;
+        t->xfers = calloc(depth, sizeof(struct mxfer));
+        assert(t->xfers != NULL);
+        for (k = 0; k < depth; k++)
+            t->xfers[k].owner = t;
+        t->report = &reports[i];
+        t->progress = progress;
+        t->udata = udata;
+        t->total = wire_len;
+        clock_gettime(CLOCK_MONOTONIC, &t->start);
+    }
+
+    active = n;
+    failures = 0;
+    stuck = false;
+    while (active > 0) {
+        /* Topping up every device, one transfer per round each, so that
+         * transports completing on submission don't starve the others */
+        do {
+            pushed = false;
+            for (i = 0; i < n; i++)
+                pushed |= target_push(&targets[i], wire, depth);
+        } while (pushed);
+
+        /* Waiting for completions: all libusb devices share the same
+         * context, so serving one serves them all */
+        waiter = NULL;
+        active = 0;
+        for (i = 0; i < n; i++) {
+            t = &targets[i];
+            if (!target_active(t)) {
+                if (!t->reported)
+                    target_report(t);
+                continue;
+            }
+            active++;
+            if (t->inflight > 0 && t->nxt->ops->events != NULL)
+                waiter = t->nxt;
+        }
+        if (waiter == NULL)
+            continue;
+        ret = waiter->ops->events(waiter);
+        if (ret == 0 || ret == LIBUSB_ERROR_INTERRUPTED) {
+            failures = 0;
+            continue;
+        }
+
+        /* The uploads in flight fail, their transfers are cancelled and
+         * drained as long as the events are served */
+        for (i = 0; i < n; i++) {
+            t = &targets[i];
+            if (t->inflight == 0)
+                continue;
+            if (t->error == 0)
+                t->error = ret;
+            target_cancel(t, depth);
+        }
+        if (++failures == max_event_errors) {
+            stuck = true;
+            break;
+        }
+    }
+
+    for (i = 0, done = 0; i < n; i++) {
+        t = &targets[i];
+        if (!t->reported)
+            target_report(t);
+        if (t->report->err == NXERR_SUCCESS)
+            done++;
+        if (stuck)
+            continue;
+        if (t->nxt->ops->xfer_free != NULL)
+            for (k = 0; k < depth; k++)
+                t->nxt->ops->xfer_free(t->nxt, &t->xfers[k].x);
+        free(t->xfers);
+    }
+    /* Transfers never drained may still complete: their descriptors are
+     * left to the transport */
+    if (!stuck)
+        free(targets);
+    return done;
+}
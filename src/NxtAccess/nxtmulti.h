@@ -0,0 +1,40 @@
+#ifndef __NXTMULTI_H__
+#define __NXTMULTI_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "nxtusb.h"
+
+/* Concurrent upload of the same stream to many devices, driven by a
+ * single event loop. The stream buffer is shared by all the devices. */
+
+struct nxtmulti_report {
+    nxterr_t err;                           /* Upload result */
+    int libusb_err;                         /* libusb error, if any */
+    size_t sent;                            /* Bytes acknowledged */
+    double seconds;                         /* Upload duration */
+};
+
+/* Progress notification: device position, bytes sent, total bytes */
+typedef void (*nxtmulti_progress_t)(void *udata, size_t dev, size_t sent,
+                                    size_t total);
+
+/* Encodes the payload once, terminator included. The returned buffer
+ * must be released with free(3). */
+uint8_t *nxtmulti_prepare_escaped(const void *payload, size_t len,
+                                  size_t *wire_len);
+
+/* Same as nxtmulti_prepare_escaped, for a scatter list and the given
+ * framing */
+uint8_t *nxtmulti_prepare_spans(const struct nxtspan *spans, size_t n,
+                                nxtframe_t framing, size_t *wire_len);
+
+/* Sends wire_len bytes of wire to the n devices, keeping up to depth
+ * transfers in flight on each of them. Returns the number of devices
+ * which completed the upload; reports must hold n elements. */
+size_t nxtmulti_send(nxtusb_t *nxts, size_t n, const uint8_t *wire,
+                     size_t wire_len, unsigned depth,
+                     struct nxtmulti_report *reports,
+                     nxtmulti_progress_t progress, void *udata);
+
+#endif /* __NXTMULTI_H__ */
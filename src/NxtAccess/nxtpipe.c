@@ -0,0 +1,186 @@
+#include "nxtusb.h"
+#include "nxtusb_private.h"
+#include "nxtesc.h"
+#include "nxtcobs.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+/* Pipelined frame sender. An encoder thread fills the slots of a ring
+ * while the calling thread sends the slots already encoded, so that the
+ * encoding of a slot overlaps the transfer of the previous one. There
+ * is a single producer and a single consumer: the slots are handed over
+ * by two counting semaphores, with no lock on the ring itself. Waiting
+ * threads sleep, since a transfer can take milliseconds. */
+
+/* Number of slots in the ring */
+#define PIPE_SLOTS 4
+
+struct slot {
+    uint8_t *buffer;                        /* Encoded stream */
+    size_t len;                             /* Bytes to send */
+    bool last;                              /* Frame terminated */
+};
+
+struct pipe {
+    const struct nxtspan *spans;            /* Payload */
+    size_t nspans;
+    nxtframe_t framing;
+    size_t block;                           /* Payload bytes per slot */
+    struct slot slots[PIPE_SLOTS];
+    sem_t filled;                           /* Slots ready to be sent */
+    sem_t empty;                            /* Slots ready to be encoded */
+    atomic_bool abort;                      /* Sender gave up */
+};
+
+/* Zero source for the zero spans */
+static const uint8_t zeros[4096];
+
+/* Waits for the next slot to encode; false if the sender gave up */
+static bool slot_get(struct pipe *p, unsigned k, struct slot **s)
+{
+    while (sem_wait(&p->empty) == -1)
+        ;
+    *s = &p->slots[k % PIPE_SLOTS];
+    return !atomic_load(&p->abort);
+}
+
+static void *encoder(void *arg)
+{
+    struct pipe *p = arg;
+    struct nxtcobs_enc cobs;
+    struct slot *s, *t;
+    const uint8_t *in;
+    size_t i, off, n, max, fill, keep, len, used;
+    unsigned k = 0;
+
+    if (!slot_get(p, k++, &s))
+        return NULL;
+    fill = 0;
+    if (p->framing == NXTFRAME_COBS)
+        fill = nxtcobs_begin(&cobs, s->buffer, 0);
+    used = 0;
+
+    for (i = 0; i < p->nspans; i++) {
+        in = p->spans[i].data;
+        for (off = 0; off < p->spans[i].len; off += n) {
+            max = p->block - used;
+            if (in == NULL && max > sizeof(zeros))
+                max = sizeof(zeros);
+            n = p->spans[i].len - off < max ? p->spans[i].len - off : max;
+
+            if (p->framing == NXTFRAME_ESC) {
+                fill += nxtesc_encode(in != NULL ? in + off : zeros, n,
+                                      s->buffer + fill);
+                keep = fill;
+            } else {
+                fill = nxtcobs_encode(&cobs, in != NULL ? in + off : zeros,
+                                      n, s->buffer, fill);
+                keep = cobs.code;
+            }
+            used += n;
+            if (used < p->block)
+                continue;
+
+            /* Whole packets go out, the rest opens the next slot */
+            len = keep - keep % usb_buflen;
+            s->len = len;
+            s->last = false;
+            sem_post(&p->filled);
+            if (!slot_get(p, k++, &t))
+                return NULL;
+            memcpy(t->buffer, s->buffer + len, fill - len);
+            fill -= len;
+            cobs.code -= len;
+            s = t;
+            used = 0;
+        }
+    }
+
+    if (p->framing == NXTFRAME_ESC)
+        s->buffer[fill++] = NXTESC_EOT;
+    else
+        fill = nxtcobs_end(&cobs, s->buffer, fill);
+    s->len = fill;
+    s->last = true;
+    sem_post(&p->filled);
+    return NULL;
+}
+
+/* Sends a slot: whole packets, plus the last partial one at frame end */
+static int slot_send(nxtusb_t nxt, struct slot *s)
+{
+    size_t sent;
+    int ret;
+
+    if ((ret = nxt_packets(nxt, s->buffer, s->len, &sent)) != 0)
+        return ret;
+    if (s->last)
+        return nxt_write(nxt, s->buffer + sent, s->len - sent);
+    return 0;
+}
+
+int nxt_send_pipelined(nxtusb_t nxt, const struct nxtspan *spans, size_t n,
+                       nxtframe_t framing)
+{
+    struct pipe p;
+    struct slot *s;
+    pthread_t thread;
+    size_t buflen;
+    unsigned i, k;
+    bool last;
+    int ret;
+
+    assert(framing == NXTFRAME_ESC || framing == NXTFRAME_COBS);
+
+    p.spans = spans;
+    p.nspans = n;
+    p.framing = framing;
+    p.block = pipe_blocks * nxt_block_len(nxt);
+    atomic_init(&p.abort, false);
+
+    /* Partial packet and open group carried over, an encoded slot and
+     * the terminator */
+    buflen = usb_buflen + 255 + NXTESC_MAXLEN(p.block) + 1;
+    for (i = 0; i < PIPE_SLOTS; i++) {
+        p.slots[i].buffer = malloc(buflen);
+        assert(p.slots[i].buffer != NULL);
+    }
+    sem_init(&p.filled, 0, 0);
+    sem_init(&p.empty, 0, PIPE_SLOTS);
+
+    if (pthread_create(&thread, NULL, encoder, &p) != 0) {
+        ret = LIBUSB_ERROR_NO_MEM;
+        goto fail;
+    }
+
+    ret = 0;
+    for (k = 0, last = false; !last; k++) {
+        while (sem_wait(&p.filled) == -1)
+            ;
+        s = &p.slots[k % PIPE_SLOTS];
+        last = s->last;
+        ret = slot_send(nxt, s);
+        sem_post(&p.empty);
+        if (ret != 0) {
+            /* The encoder stops at its next slot */
+            atomic_store(&p.abort, true);
+            sem_post(&p.empty);
+            break;
+        }
+    }
+    pthread_join(thread, NULL);
+
+  fail:
+    sem_destroy(&p.filled);
+    sem_destroy(&p.empty);
+    for (i = 0; i < PIPE_SLOTS; i++)
+        free(p.slots[i].buffer);
+    return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef __NXTRES_H__
+#define __NXTRES_H__
+
+/* Resumable upload protocol. Each frame starts with a header of four
+ * little endian 32 bit words:
+ *
+ *   query: NXTRES_QUERY, session, number of blocks, 0
+ *   block: sequence number, address, length, CRC-32 of the content
+ *
+ * followed, for blocks, by the content. The device answers every frame
+ * with two 32 bit words: NXTRES_QUERY and the resume cursor for a query,
+ * the sequence number and NXTRES_ACK or NXTRES_NACK for a block.
+ *
+ * A query with an unknown session starts a new upload. The cursor is the
+ * first sequence number the device doesn't hold yet: after a reconnect
+ * the host asks for it and carries on from there. */
+#define NXTRES_HDRLEN 16
+#define NXTRES_REPLYLEN 8
+#define NXTRES_QUERY 0xffffffffu
+#define NXTRES_ACK 0
+#define NXTRES_NACK 1
+
+#endif /* __NXTRES_H__ */
@@ -0,0 +1,428 @@
+#include "nxtusb.h"
+#include "nxtusb_private.h"
+#include "nxtesc.h"
+#include "nxtcobs.h"
+#include "nxtlz.h"
+#include "nxtcrc.h"
+#include "nxtres.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Software NXT device: receives the byte stream, models the time spent
+ * on the bus and decodes the frames as the brick would. */
+
+struct growbuf {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+struct sim_dev {
+    struct nxtsim_params params;            /* Device model */
+    uint64_t time;                          /* Modeled time (ns) */
+    struct growbuf wire;                    /* Raw received bytes */
+    struct growbuf image;                   /* Decoded bytes */
+    size_t record_left;                     /* Raw bytes still expected */
+    size_t image_done;                      /* Decoded bytes in frames */
+    unsigned frames;                        /* Completed frames */
+    bool escaped;                           /* Previous byte was ESC */
+    struct nxtcobs_dec cobs;                /* COBS decoder */
+    struct nxtlz_dec *lz;                   /* Decompressor, if enabled */
+    struct growbuf frame;                   /* Decompressed frame */
+    struct growbuf replies;                 /* Data for the host */
+    size_t replied;                         /* Replies read by the host */
+    bool down;                              /* Link failure */
+    uint32_t session;                       /* Resume session */
+    uint32_t nblocks;                       /* Blocks of the session */
+    uint8_t *held;                          /* Blocks held, if a session */
+    uint32_t cursor;                        /* First block not held */
+};
+
+static void grow_reserve(struct growbuf *b, size_t len)
+{
+    if (b->len + len > b->size) {
+        b->size = b->size ? b->size : 4096;
+        while (b->len + len > b->size)
+            b->size *= 2;
+        b->data = realloc(b->data, b->size);
+        assert(b->data != NULL);
+    }
+}
+
+static void grow_append(struct growbuf *b, const uint8_t *data, size_t len)
+{
+    if (len == 0)
+        return;
+    grow_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void lz_emit(void *udata, const uint8_t *data, size_t len)
+{
+    grow_append(udata, data, len);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Replies to a frame holding a delta record with its address and the
+ * CRC of its content as stored, after injecting the configured faults */
+static void frame_verify(struct sim_dev *dev, uint8_t *frame, size_t len)
+{
+    uint8_t reply[8];
+    uint32_t n;
+
+    if (len < 8)
+        return;
+    /* Other frames, like the activation record, get no reply */
+    n = get_le32(frame + 4);
+    if (n != len - 8)
+        return;
+    if (n > 0 && dev->params.fault_every != 0 &&
+        dev->frames % dev->params.fault_every == dev->params.fault_every - 1)
+        frame[8] ^= 0xff;
+
+    memcpy(reply, frame, 4);
+    put_le32(reply + 4, nxtcrc32(0, frame + 8, n));
+    grow_append(&dev->replies, reply, sizeof(reply));
+}
+
+static void reply(struct sim_dev *dev, uint32_t id, uint32_t value)
+{
+    uint8_t buf[NXTRES_REPLYLEN];
+
+    put_le32(buf, id);
+    put_le32(buf + 4, value);
+    grow_append(&dev->replies, buf, sizeof(buf));
+}
+
+/* Answers a frame of the resume protocol. Returns true if the frame is
+ * a block to be kept. */
+static bool frame_resume(struct sim_dev *dev, uint8_t *frame, size_t len)
+{
+    uint32_t seq, n;
+    bool ok;
+
+    if (len < NXTRES_HDRLEN)
+        return false;
+    seq = get_le32(frame);
+    if (seq == NXTRES_QUERY) {
+        if (dev->held == NULL || get_le32(frame + 4) != dev->session) {
+            /* New upload */
+            dev->session = get_le32(frame + 4);
+            dev->nblocks = get_le32(frame + 8);
+            free(dev->held);
+            dev->held = calloc(dev->nblocks + 1, 1);
+            assert(dev->held != NULL);
+            dev->cursor = 0;
+        }
+        reply(dev, NXTRES_QUERY, dev->cursor);
+        return false;
+    }
+    if (dev->held == NULL || seq >= dev->nblocks)
+        return false;
+
+    n = len - NXTRES_HDRLEN;
+    if (n > 0 && dev->params.fault_every != 0 &&
+        dev->frames % dev->params.fault_every == dev->params.fault_every - 1)
+        frame[NXTRES_HDRLEN] ^= 0xff;
+    ok = get_le32(frame + 8) == n &&
+         get_le32(frame + 12) == nxtcrc32(0, frame + NXTRES_HDRLEN, n);
+    if (ok) {
+        dev->held[seq] = 1;
+        while (dev->cursor < dev->nblocks && dev->held[dev->cursor])
+            dev->cursor++;
+    }
+    reply(dev, seq, ok ? NXTRES_ACK : NXTRES_NACK);
+    return ok;
+}
+
+/* Accounts a completed frame, decompressing it if needed. Corrupted
+ * frames are dropped. */
+static void frame_done(struct sim_dev *dev)
+{
+    const uint8_t *in;
+    size_t len;
+    bool ok;
+
+    if (dev->params.glitch_every != 0 &&
+        dev->frames % dev->params.glitch_every ==
+            dev->params.glitch_every - 1) {
+        /* The frame never makes it: the host must reconnect */
+        dev->image.len = dev->image_done;
+        dev->down = true;
+        dev->frames++;
+        return;
+    }
+    if (dev->lz != NULL) {
+        in = dev->image.data + dev->image_done;
+        len = dev->image.len - dev->image_done;
+        dev->frame.len = 0;
+        nxtlz_dec_init(dev->lz);
+        ok = nxtlz_decode(dev->lz, in, len, lz_emit, &dev->frame) &&
+             nxtlz_dec_complete(dev->lz);
+        dev->image.len = dev->image_done;
+        if (!ok)
+            return;
+        grow_append(&dev->image, dev->frame.data, dev->frame.len);
+    }
+    if (dev->params.resume) {
+        if (!frame_resume(dev, dev->image.data + dev->image_done,
+                          dev->image.len - dev->image_done))
+            dev->image.len = dev->image_done;
+    } else if (dev->params.verify) {
+        frame_verify(dev, dev->image.data + dev->image_done,
+                     dev->image.len - dev->image_done);
+    }
+    dev->image_done = dev->image.len;
+    dev->frames++;
+}
+
+/* Reference decoder for the escaped stream */
+static void esc_decode(struct sim_dev *dev, const uint8_t *in, size_t len)
+{
+    size_t i, run;
+
+    i = 0;
+    while (i < len) {
+        if (dev->escaped) {
+            grow_append(&dev->image, in + i, 1);
+            dev->escaped = false;
+            i++;
+            continue;
+        }
+        run = nxtesc_scan(in + i, len - i);
+        grow_append(&dev->image, in + i, run);
+        i += run;
+        if (i == len)
+            break;
+        if (in[i] == NXTESC_ESC)
+            dev->escaped = true;
+        else
+            frame_done(dev);
+        if (dev->down)
+            return;
+        i++;
+    }
+}
+
+static void cobs_decode(struct sim_dev *dev, const uint8_t *in, size_t len)
+{
+    size_t used, out;
+    int status;
+
+    while (len > 0) {
+        /* Decoded frames are never larger than their encoding. Reserved
+         * again at each round, since frame_done may decompress in image
+         * and take the room. */
+        grow_reserve(&dev->image, len);
+        used = nxtcobs_decode(&dev->cobs, in, len,
+                              dev->image.data + dev->image.len, &out,
+                              &status);
+        dev->image.len += out;
+        in += used;
+        len -= used;
+        if (status == NXTCOBS_FRAME) {
+            frame_done(dev);
+            if (dev->down)
+                return;
+        } else if (status == NXTCOBS_BROKEN) {
+            /* Dropping the truncated frame */
+            dev->image.len = dev->image_done;
+        }
+    }
+}
+
+static void sim_decode(struct sim_dev *dev, const uint8_t *in, size_t len)
+{
+    size_t n;
+
+    /* The record is stored as it comes, outside any frame */
+    if (dev->record_left > 0) {
+        n = len < dev->record_left ? len : dev->record_left;
+        grow_append(&dev->image, in, n);
+        dev->image_done = dev->image.len;
+        dev->record_left -= n;
+        in += n;
+        len -= n;
+    }
+
+    switch (dev->params.framing) {
+        case NXTFRAME_ESC:
+            esc_decode(dev, in, len);
+            break;
+        case NXTFRAME_COBS:
+            cobs_decode(dev, in, len);
+            break;
+        default:
+            grow_append(&dev->image, in, len);
+            dev->image_done = dev->image.len;
+            break;
+    }
+}
+
+static uint64_t sim_delay(const struct nxtsim_params *p, size_t len)
+{
+    uint64_t ns, packets;
+
+    packets = (len + usb_buflen - 1) / usb_buflen;
+    ns = packets * p->latency_us * 1000ULL;
+    if (p->bandwidth != 0)
+        ns += (uint64_t)len * 1000000000ULL / p->bandwidth;
+    return ns;
+}
+
+static int sim_write(nxtusb_t nxt, uint8_t *buffer, size_t len, int *transf)
+{
+    struct sim_dev *dev = nxt->priv;
+    struct timespec ts;
+    uint64_t ns;
+
+    ns = sim_delay(&dev->params, len);
+    dev->time += ns;
+    if (dev->params.realtime && ns > 0) {
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        while (nanosleep(&ts, &ts) != 0)
+            ;
+    }
+
+    if (dev->down)
+        return LIBUSB_ERROR_NO_DEVICE;
+    grow_append(&dev->wire, buffer, len);
+    sim_decode(dev, buffer, len);
+    *transf = len;
+    return dev->down ? LIBUSB_ERROR_IO : 0;
+}
+
+static int sim_read(nxtusb_t nxt, uint8_t *buffer, size_t len, int *transf)
+{
+    struct sim_dev *dev = nxt->priv;
+    size_t n;
+
+    if (dev->down)
+        return LIBUSB_ERROR_NO_DEVICE;
+    /* Nothing to say: the host would wait for rx_timeout */
+    if ((n = dev->replies.len - dev->replied) == 0)
+        return LIBUSB_ERROR_TIMEOUT;
+    if (n > len)
+        n = len;
+    memcpy(buffer, dev->replies.data + dev->replied, n);
+    dev->replied += n;
+    *transf = n;
+    return 0;
+}
+
+/* The device keeps what it stored, the link state starts over */
+static int sim_reopen(nxtusb_t nxt)
+{
+    struct sim_dev *dev = nxt->priv;
+
+    dev->down = false;
+    dev->image.len = dev->image_done;
+    dev->escaped = false;
+    nxtcobs_dec_init(&dev->cobs);
+    dev->replied = dev->replies.len;
+    return 0;
+}
+
+static void sim_close(nxtusb_t nxt)
+{
+    struct sim_dev *dev = nxt->priv;
+
+    free(dev->wire.data);
+    free(dev->image.data);
+    free(dev->frame.data);
+    free(dev->replies.data);
+    free(dev->lz);
+    free(dev->held);
+    free(dev);
+}
+
+/* Naming counter for simulated devices */
+static unsigned sim_count;
+
+static const struct nxt_transport sim_transport = {
+    .write = sim_write,
+    .read = sim_read,
+    .submit = nxt_submit_sync,
+    .events = NULL,
+    .cancel = NULL,
+    .xfer_free = NULL,
+    .reopen = sim_reopen,
+    .close = sim_close
+};
+
+nxterr_t nxtusb_new_sim(nxtusb_t *nxt, const struct nxtsim_params *params)
+{
+    struct sim_dev *dev;
+
+    dev = calloc(1, sizeof(struct sim_dev));
+    assert(dev != NULL);
+    if (params != NULL)
+        dev->params = *params;
+    dev->record_left = dev->params.record_len;
+    nxtcobs_dec_init(&dev->cobs);
+    if (dev->params.compressed) {
+        dev->lz = malloc(sizeof(struct nxtlz_dec));
+        assert(dev->lz != NULL);
+    }
+
+    *nxt = nxtusb_alloc(&sim_transport, dev);
+    snprintf((*nxt)->name, sizeof((*nxt)->name), "sim:%u", sim_count++);
+    return NXERR_SUCCESS;
+}
+
+static struct sim_dev *sim_of(nxtusb_t nxt)
+{
+    return nxt->ops == &sim_transport ? nxt->priv : NULL;
+}
+
+const uint8_t *nxtsim_image(nxtusb_t nxt, size_t *len)
+{
+    struct sim_dev *dev = sim_of(nxt);
+
+    if (dev == NULL)
+        return NULL;
+    *len = dev->image_done;
+    return dev->image.data;
+}
+
+unsigned nxtsim_frames(nxtusb_t nxt)
+{
+    struct sim_dev *dev = sim_of(nxt);
+
+    return dev == NULL ? 0 : dev->frames;
+}
+
+const uint8_t *nxtsim_wire(nxtusb_t nxt, size_t *len)
+{
+    struct sim_dev *dev = sim_of(nxt);
+
+    if (dev == NULL)
+        return NULL;
+    *len = dev->wire.len;
+    return dev->wire.data;
+}
+
+uint64_t nxtsim_time(nxtusb_t nxt)
+{
+    struct sim_dev *dev = sim_of(nxt);
+
+    return dev == NULL ? 0 : dev->time;
+}
@@ -0,0 +1,85 @@
+#include "nxtusb.h"
+#include "nxtusb_private.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* File or pipe sink: the byte stream is written to a file descriptor,
+ * either as it is or as an hexadecimal dump. */
+
+struct sink_dev {
+    int fd;                                 /* Output */
+    bool hexdump;                           /* Dump format */
+};
+
+static int sink_write(nxtusb_t nxt, uint8_t *buffer, size_t len,
+                      int *transf)
+{
+    struct sink_dev *dev = nxt->priv;
+    char line[5 * 4 + 1];
+    size_t i, off;
+    ssize_t w;
+
+    if (dev->hexdump) {
+        /* One line per packet word, as the DUMMY build used to print */
+        for (i = 0; i < len; i += 4) {
+            for (off = 0; off < 4 && i + off < len; off++)
+                snprintf(line + off * 5, 6, "0x%02x%c", buffer[i + off],
+                         off == 3 ? '\n' : ' ');
+            if (off < 4)
+                line[off * 5 - 1] = '\n';
+            if (write(dev->fd, line, off * 5) != (ssize_t)(off * 5))
+                return LIBUSB_ERROR_IO;
+        }
+        *transf = len;
+        return 0;
+    }
+
+    for (off = 0; off < len; off += w) {
+        if ((w = write(dev->fd, buffer + off, len - off)) == -1) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            *transf = off;
+            return errno == EPIPE ? LIBUSB_ERROR_NO_DEVICE
+                                  : LIBUSB_ERROR_IO;
+        }
+    }
+    *transf = len;
+    return 0;
+}
+
+static void sink_close(nxtusb_t nxt)
+{
+    free(nxt->priv);
+}
+
+static const struct nxt_transport sink_transport = {
+    .write = sink_write,
+    .read = NULL,
+    .submit = nxt_submit_sync,
+    .events = NULL,
+    .cancel = NULL,
+    .xfer_free = NULL,
+    .reopen = NULL,
+    .close = sink_close
+};
+
+nxterr_t nxtusb_new_sink(nxtusb_t *nxt, int fd, bool hexdump)
+{
+    struct sink_dev *dev;
+
+    dev = malloc(sizeof(struct sink_dev));
+    assert(dev != NULL);
+    dev->fd = fd;
+    dev->hexdump = hexdump;
+
+    *nxt = nxtusb_alloc(&sink_transport, dev);
+    snprintf((*nxt)->name, sizeof((*nxt)->name), "fd:%d", fd);
+    return NXERR_SUCCESS;
+}
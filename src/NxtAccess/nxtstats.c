@@ -0,0 +1,104 @@
+#include "nxtstats.h"
+
+#include <inttypes.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+uint64_t nxtstats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static unsigned bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned b;
+
+    /* Position of the highest bit, plus one */
+    b = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    return b < NXTSTATS_BUCKETS ? b : NXTSTATS_BUCKETS - 1;
+}
+
+void nxtstats_transfer(struct nxtstats *s, uint64_t start, size_t len,
+                       size_t transf, int err)
+{
+    uint64_t end = nxtstats_now();
+
+    if (s->transfers == 0 && s->stalls == 0 && s->errors == 0)
+        s->first_ns = start;
+    s->last_ns = end;
+
+    s->wire += transf;
+    if (err == LIBUSB_ERROR_PIPE || err == LIBUSB_ERROR_TIMEOUT) {
+        s->stalls ++;
+        return;
+    }
+    if (err != 0) {
+        s->errors ++;
+        return;
+    }
+    if (transf < len)
+        s->short_writes ++;
+    s->transfers ++;
+    s->busy_ns += end - start;
+    s->latency[bucket(end - start)] ++;
+}
+
+double nxtstats_overhead(const struct nxtstats *s)
+{
+    return s->payload ? (double)s->wire / s->payload : 0;
+}
+
+double nxtstats_throughput(const struct nxtstats *s)
+{
+    uint64_t span = s->last_ns - s->first_ns;
+
+    return span ? s->wire * 1e9 / span : 0;
+}
+
+uint64_t nxtstats_percentile(const struct nxtstats *s, double fraction)
+{
+    uint64_t target, count;
+    unsigned i;
+
+    target = s->transfers * fraction;
+    for (i = 0, count = 0; i < NXTSTATS_BUCKETS; i++) {
+        count += s->latency[i];
+        if (count > target)
+            break;
+    }
+    return i < NXTSTATS_BUCKETS - 1 ? (uint64_t)1 << i : UINT64_MAX;
+}
+
+void nxtstats_print(const struct nxtstats *s, FILE *out)
+{
+    unsigned i;
+
+    fprintf(out, "  payload %" PRIu64 " bytes, wire %" PRIu64 " bytes",
+            s->payload, s->wire);
+    if (s->payload)
+        fprintf(out, " (x%.3f)", nxtstats_overhead(s));
+    fprintf(out, "\n  %" PRIu64 " transfers, %" PRIu64 " short, %" PRIu64
+            " stalled, %" PRIu64 " failed\n",
+            s->transfers, s->short_writes, s->stalls, s->errors);
+    if (s->transfers == 0)
+        return;
+    fprintf(out, "  %.0f bytes per transfer\n",
+            (double)s->wire / s->transfers);
+    fprintf(out, "  %.1f KiB/s, mean latency %.1f us, p50 < %" PRIu64
+            " us, p99 < %" PRIu64 " us\n",
+            nxtstats_throughput(s) / 1024,
+            s->busy_ns / 1e3 / s->transfers,
+            nxtstats_percentile(s, 0.5), nxtstats_percentile(s, 0.99));
+
+    for (i = 0; i < NXTSTATS_BUCKETS - 1; i++)
+        if (s->latency[i] != 0)
+            fprintf(out, "    < %8" PRIu64 " us: %" PRIu64 "\n",
+                    (uint64_t)1 << i, s->latency[i]);
+    if (s->latency[i] != 0)
+        fprintf(out, "   >= %8" PRIu64 " us: %" PRIu64 "\n",
+                (uint64_t)1 << (i - 1), s->latency[i]);
+}
@@ -0,0 +1,49 @@
+#ifndef __NXTSTATS_H__
+#define __NXTSTATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Transfer counters, kept by every device. Updating them costs a clock
+ * read and a few increments per bulk transfer, so they're always on. */
+
+/* Latency histogram buckets: bucket i counts the transfers which took
+ * less than 2^i microseconds, the last one counts all the slower ones */
+#define NXTSTATS_BUCKETS 24
+
+struct nxtstats {
+    uint64_t payload;                       /* Bytes requested */
+    uint64_t wire;                          /* Bytes accepted by the device */
+    uint64_t transfers;                     /* Completed bulk transfers */
+    uint64_t short_writes;                  /* Partially accepted transfers */
+    uint64_t stalls;                        /* Stalled or timed out */
+    uint64_t errors;                        /* Other failures */
+    uint64_t busy_ns;                       /* Sum of transfer latencies */
+    uint64_t first_ns;                      /* Start of the first transfer */
+    uint64_t last_ns;                       /* End of the last transfer */
+    uint64_t latency[NXTSTATS_BUCKETS];     /* Latency histogram */
+};
+
+/* Monotonic clock, in nanoseconds */
+uint64_t nxtstats_now(void);
+
+/* Accounts a bulk transfer of len bytes started at start, of which
+ * transf were accepted, with the given libusb result */
+void nxtstats_transfer(struct nxtstats *s, uint64_t start, size_t len,
+                       size_t transf, int err);
+
+/* Wire bytes over payload bytes (0 if nothing was requested) */
+double nxtstats_overhead(const struct nxtstats *s);
+
+/* Wire bytes per second, from the first to the last transfer */
+double nxtstats_throughput(const struct nxtstats *s);
+
+/* Latency below which the given fraction of the transfers completed,
+ * in microseconds, as resolved by the histogram (UINT64_MAX if beyond
+ * the last bucket) */
+uint64_t nxtstats_percentile(const struct nxtstats *s, double fraction);
+
+/* Human readable report */
+void nxtstats_print(const struct nxtstats *s, FILE *out);
+
+#endif /* __NXTSTATS_H__ */
@@ -1,8 +1,15 @@
 #include "nxtusb.h"
+#include "nxtusb_private.h"
+#include "nxtesc.h"
+#include "nxtcobs.h"
+#include "nxtasync.h"
 
 #include <assert.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <libusb-1.0/libusb.h>
 
@@ -14,22 +21,34 @@ static const uint16_t nxt_product_id = 0xff00;
 static const uint16_t samba_vendor_id = 0x03eb;
 static const uint16_t samba_product_id = 0x6124;
 
-/* Transmission constants */
-static const int tx_endpoint = 1;
-static const int tx_timeout = 0;
+/* Payload bytes encoded at once by the escaped senders, unless the
+ * transfer size is larger */
+static const size_t esc_block = 4096;
 
-/* Escapes */
-static const uint8_t esc = 0x1b;
-static const uint8_t eot = 0x04;
+/* Default and largest bulk transfer size. Transfers are split in
+ * packets by the host controller, so their size only trades the cost
+ * of each submission against memory and latency. */
+static const size_t default_xfer_len = 4096;
+static const size_t max_xfer_len = 1 << 20;
 
-/* Nxt buffer size */
-static const uint32_t usb_buflen = 64;
+/* Payload bytes encoded at once for the given transfer size */
+static size_t esc_block_len(size_t xfer_len)
+{
+    return xfer_len > esc_block ? xfer_len : esc_block;
+}
 
-struct nxtusb {
-    struct libusb_context *context;         /* LibUSB Context */
-    struct libusb_device_handle *handle;    /* Nxt handle */
-    uint8_t *buffer;                        /* Byte stuffing buffer */
-};
+size_t nxt_block_len(nxtusb_t nxt)
+{
+    return esc_block_len(nxt->xfer_len);
+}
+
+/* Byte stuffing buffer size: a partial packet left from the previous
+ * block, an encoded block and the terminator. This also covers the open
+ * COBS group, whose 255 bytes are far below the ESC/EOT worst case. */
+static size_t esc_buflen(size_t xfer_len)
+{
+    return usb_buflen + NXTESC_MAXLEN(esc_block_len(xfer_len)) + 1;
+}
 
 static const char *errmsg[] = {
     "Success",
@@ -43,136 +62,664 @@ const char *nxtusb_geterr(nxterr_t e)
     return errmsg[e];
 }
 
-/* Short for libusb_bulk_transfer */
-static inline int send_raw(struct libusb_device_handle *handle,
-                           uint8_t *buffer, size_t len, int *transf)
+/* Drops the transfer queue, waiting for what's in flight */
+static void async_drop(nxtusb_t nxt)
 {
-    #ifdef DUMMY
+    nxtasync_free(nxt->async);
+    nxt->async = NULL;
+}
 
-    int i;
+int nxt_write(nxtusb_t nxt, const uint8_t *buffer, size_t len)
+{
+    size_t n;
+    int t;
+    int ret;
 
-    for (i = 0; i < len; i++)
-        printf("0x%02x%c", buffer[i], (i & 3) == 3 && i ? '\n' : ' ');
-    putchar(10);
-    return 0;
+    /* Transfers completing on submission gain nothing from a queue */
+    if (nxt->ops->events == NULL) {
+        for (; len > 0; len -= t, buffer += t) {
+            n = nxt->xfer_len < len ? nxt->xfer_len : len;
+            if ((ret = send_raw(nxt, (uint8_t *)buffer, n, &t)) != 0)
+                return ret;
+        }
+        return 0;
+    }
 
-    #else
+    if (nxt->async == NULL)
+        nxtasync_new(&nxt->async, nxt, 0, nxt->xfer_len);
+    if ((ret = nxt_async_send(nxt->async, buffer, len)) != 0)
+        async_drop(nxt);
+    return ret;
+}
 
-    return libusb_bulk_transfer(handle, tx_endpoint, buffer, len, transf,
-                                tx_timeout);
+int nxt_wait(nxtusb_t nxt)
+{
+    int ret;
 
-    #endif
+    if (nxt->async == NULL ||
+        nxtasync_drain(nxt->async, &ret) == NXERR_SUCCESS)
+        return 0;
+    async_drop(nxt);
+    return ret;
 }
 
-/* After putting a byte into the buffer, we need to check if the buffer is
- * full.
- * returns the libusb return value for transmission.
+/* Sends the whole packets in the buffer.
+ * returns the libusb return value for transmission, and the number of
+ * bytes sent through sent.
  */
-static int chunk(struct libusb_device_handle *handle, uint8_t *buffer,
-                 size_t *fill)
+int nxt_packets(nxtusb_t nxt, uint8_t *buffer, size_t fill, size_t *sent)
 {
-    size_t f;
-    int32_t t;
+    size_t n;
     int ret;
 
-    f = *fill;
-    if ((f % usb_buflen) == 0 && f != 0) {
-        /* The buffer must be flushed */
-        if ((ret = send_raw(handle, buffer, f, &t)) != 0) {
-            return ret;
-        }
-        *fill = 0;
-    }
+    n = fill - fill % usb_buflen;
+    if ((ret = nxt_write(nxt, buffer, n)) != 0)
+        return ret;
+    *sent = n;
     return 0;
 }
 
 nxterr_t nxtusb_send(nxtusb_t nxt, void *buffer, ssize_t len,
                      int *libusb_err)
 {
-    uint8_t *out;
-    int transf;
+    assert(nxt != NULL);
+    nxt->stats.payload += len;
+
+    if ((*libusb_err = nxt_write(nxt, buffer, len)) != 0 ||
+        (*libusb_err = nxt_wait(nxt)) != 0)
+        return NXERR_LIBUSB;
+    return NXERR_SUCCESS;
+}
+
+/* Zero source for the zero spans */
+static const uint8_t zeros[4096];
+
+/* Keeps the partial packet in the buffer for the next chunk, moving
+ * the sent bytes out. Returns the libusb return value. */
+static int frame_flush(nxtusb_t nxt, size_t keep)
+{
+    size_t sent;
+    int ret;
+
+    if ((ret = nxt_packets(nxt, nxt->buffer, keep, &sent)) != 0)
+        return ret;
+    memmove(nxt->buffer, nxt->buffer + sent, nxt->fill - sent);
+    nxt->fill -= sent;
+    nxt->cobs.code -= sent;
+    return 0;
+}
+
+static int frame_raw(nxtusb_t nxt, const uint8_t *in, size_t n)
+{
+    uint8_t *out = nxt->buffer;
+    size_t m;
+    int ret;
+
+    /* Completing the packet left by the previous chunk */
+    if (nxt->fill > 0) {
+        m = usb_buflen - nxt->fill < n ? usb_buflen - nxt->fill : n;
+        memcpy(out + nxt->fill, in, m);
+        nxt->fill += m;
+        in += m;
+        n -= m;
+        if (nxt->fill < usb_buflen)
+            return 0;
+        if ((ret = nxt_write(nxt, out, nxt->fill)) != 0)
+            return ret;
+        nxt->fill = 0;
+    }
+
+    /* Whole packets are sent from the source */
+    m = n - n % usb_buflen;
+    if ((ret = nxt_write(nxt, in, m)) != 0)
+        return ret;
+    in += m;
+    n -= m;
+    memcpy(out, in, n);
+    nxt->fill = n;
+    return 0;
+}
+
+static int frame_escaped(nxtusb_t nxt, const uint8_t *in, size_t n)
+{
+    nxt->fill += nxtesc_encode(in, n, nxt->buffer + nxt->fill);
+
+    /* The last partial packet is kept for the next block */
+    return frame_flush(nxt, nxt->fill);
+}
 
+static int frame_cobs(nxtusb_t nxt, const uint8_t *in, size_t n)
+{
+    nxt->fill = nxtcobs_encode(&nxt->cobs, in, n, nxt->buffer, nxt->fill);
+
+    /* The open group is kept along with the last partial packet */
+    return frame_flush(nxt, nxt->cobs.code);
+}
+
+/* Sends a chunk of at most one encoding block */
+static int frame_chunk(nxtusb_t nxt, const uint8_t *in, size_t n)
+{
+    switch (nxt->framing) {
+        case NXTFRAME_ESC:
+            return frame_escaped(nxt, in, n);
+        case NXTFRAME_COBS:
+            return frame_cobs(nxt, in, n);
+        default:
+            return frame_raw(nxt, in, n);
+    }
+}
+
+void nxtusb_frame_begin(nxtusb_t nxt, nxtframe_t framing)
+{
     assert(nxt != NULL);
-    out = (uint8_t *)buffer;
 
-    while (len > 0) {
-        if ((*libusb_err = send_raw(nxt->handle, buffer,
-                                    usb_buflen < len ? usb_buflen : len,
-                                    &transf)) != 0)
+    nxt->framing = framing;
+    nxt->fill = 0;
+    if (framing == NXTFRAME_COBS)
+        nxt->fill = nxtcobs_begin(&nxt->cobs, nxt->buffer, 0);
+    else
+        nxt->cobs.code = 0;
+}
+
+nxterr_t nxtusb_frame_write(nxtusb_t nxt, const void *data, size_t len,
+                            int *libusb_err)
+{
+    const uint8_t *in = data;
+    size_t n, max;
+    int ret;
+
+    nxt->stats.payload += len;
+
+    /* Raw chunks are sent in place, whatever their size */
+    max = nxt->framing == NXTFRAME_RAW ? SIZE_MAX
+                                        : esc_block_len(nxt->xfer_len);
+    if (in == NULL && max > sizeof(zeros))
+        max = sizeof(zeros);
+
+    for (; len > 0; len -= n) {
+        n = len < max ? len : max;
+        if ((ret = frame_chunk(nxt, in != NULL ? in : zeros, n)) != 0) {
+            *libusb_err = ret;
             return NXERR_LIBUSB;
-        len -= transf;
-        buffer += transf;
+        }
+        if (in != NULL)
+            in += n;
     }
+    return NXERR_SUCCESS;
+}
 
+nxterr_t nxtusb_frame_end(nxtusb_t nxt, int *libusb_err)
+{
+    size_t sent;
+    int ret;
+
+    switch (nxt->framing) {
+        case NXTFRAME_ESC:
+            nxt->buffer[nxt->fill++] = NXTESC_EOT;
+            break;
+        case NXTFRAME_COBS:
+            nxt->fill = nxtcobs_end(&nxt->cobs, nxt->buffer, nxt->fill);
+            break;
+        default:
+            break;
+    }
+
+    /* The frame is complete once the queue is */
+    sent = 0;
+    if ((ret = nxt_packets(nxt, nxt->buffer, nxt->fill, &sent)) == 0)
+        ret = nxt_write(nxt, nxt->buffer + sent, nxt->fill - sent);
+    if (ret == 0)
+        ret = nxt_wait(nxt);
+    nxt->fill = 0;
+    if (ret != 0) {
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
     return NXERR_SUCCESS;
 }
 
+nxterr_t nxtusb_send_spans(nxtusb_t nxt, const struct nxtspan *spans,
+                           size_t n, nxtframe_t framing, int *libusb_err)
+{
+    nxterr_t err;
+    size_t i, total;
+    int ret;
+
+    /* Worth a thread only if there is a slot to encode while another
+     * one is on the wire */
+    for (i = 0, total = 0; i < n; i++)
+        total += spans[i].len;
+    if (nxt->pipelined && framing != NXTFRAME_RAW &&
+        total >= 2 * pipe_blocks * esc_block_len(nxt->xfer_len)) {
+        nxt->stats.payload += total;
+        if ((ret = nxt_send_pipelined(nxt, spans, n, framing)) != 0 ||
+            (ret = nxt_wait(nxt)) != 0) {
+            *libusb_err = ret;
+            return NXERR_LIBUSB;
+        }
+        return NXERR_SUCCESS;
+    }
+
+    nxtusb_frame_begin(nxt, framing);
+    for (i = 0; i < n; i++) {
+        err = nxtusb_frame_write(nxt, spans[i].data, spans[i].len,
+                                 libusb_err);
+        if (err != NXERR_SUCCESS)
+            return err;
+    }
+    return nxtusb_frame_end(nxt, libusb_err);
+}
+
 nxterr_t nxtusb_send_escaped(nxtusb_t nxt, void *buffer, size_t len,
                              int *libusb_err)
 {
-    uint32_t i, j;
-    int32_t t;
-    uint8_t *out, val;
-    struct libusb_device_handle *handle;
+    struct nxtspan span = {
+        .data = buffer,
+        .len = len
+    };
+
+    return nxtusb_send_spans(nxt, &span, 1, NXTFRAME_ESC, libusb_err);
+}
+
+nxtusb_t nxtusb_alloc(const struct nxt_transport *ops, void *priv)
+{
+    nxtusb_t ret;
+
+    ret = malloc(sizeof(struct nxtusb));
+    assert(ret != NULL);
+    ret->xfer_len = default_xfer_len;
+    ret->timeout = tx_timeout;
+    ret->pipelined = false;
+    ret->async = NULL;
+    ret->framing = NXTFRAME_RAW;
+    ret->fill = 0;
+    ret->buffer = malloc(sizeof(uint8_t) * esc_buflen(ret->xfer_len));
+    assert(ret->buffer != NULL);
+    ret->ops = ops;
+    ret->priv = priv;
+    ret->name[0] = '\0';
+    ret->id[0] = '\0';
+    memset(&ret->stats, 0, sizeof(struct nxtstats));
+    return ret;
+}
+
+size_t nxtusb_set_xfer_len(nxtusb_t nxt, size_t len)
+{
+    if (len > max_xfer_len)
+        len = max_xfer_len;
+    len -= len % usb_buflen;
+    if (len == 0)
+        len = usb_buflen;
+
+    /* The queue buffers are as large as the transfers */
+    if (nxt->async != NULL)
+        async_drop(nxt);
+    nxt->xfer_len = len;
+    nxt->buffer = realloc(nxt->buffer, esc_buflen(len));
+    assert(nxt->buffer != NULL);
+    return len;
+}
+
+size_t nxtusb_get_xfer_len(nxtusb_t nxt)
+{
+    return nxt->xfer_len;
+}
+
+void nxtusb_set_pipelined(nxtusb_t nxt, bool enable)
+{
+    nxt->pipelined = enable;
+}
+
+void nxt_complete(struct nxt_xfer *x, size_t transf, int err)
+{
+    nxtstats_transfer(&x->nxt->stats, x->start, x->len, transf, err);
+    x->done(x, transf, err);
+}
+
+int nxt_submit_sync(nxtusb_t nxt, struct nxt_xfer *x)
+{
+    int transf = 0;
+    int ret;
+
+    ret = nxt->ops->write(nxt, x->buffer, x->len, &transf);
+    nxt_complete(x, transf, ret);
+    return 0;
+}
+
+unsigned nxtusb_set_timeout(nxtusb_t nxt, unsigned ms)
+{
+    unsigned old = nxt->timeout;
+
+    nxt->timeout = ms;
+    return old;
+}
+
+nxterr_t nxtusb_reconnect(nxtusb_t nxt, int *libusb_err)
+{
     int ret;
 
     assert(nxt != NULL);
 
-    out = nxt->buffer;
-    handle = nxt->handle;
-    printf("Sending %d bytes\n", len);
-    for (i = 0, j = 0; i < len; i++) {
-        val = ((uint8_t *)buffer)[i];
-        if (val == esc || val == eot) {
-            printf("esc %02x\n", val);
-            out[j++] = esc;
-            if ((ret = chunk(handle, out, &j)) != 0) {
-                goto fail;
-            }
+    /* The open frame is lost with the link, with the queued transfers */
+    if (nxt->async != NULL)
+        async_drop(nxt);
+    nxt->fill = 0;
+    nxt->framing = NXTFRAME_RAW;
+
+    if (nxt->ops->reopen == NULL)
+        ret = LIBUSB_ERROR_NOT_SUPPORTED;
+    else
+        ret = nxt->ops->reopen(nxt);
+    if (ret != 0) {
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
+    return NXERR_SUCCESS;
+}
+
+nxterr_t nxtusb_recv(nxtusb_t nxt, void *buffer, size_t len, size_t *got,
+                     int *libusb_err)
+{
+    int transf = 0;
+    int ret;
+
+    assert(nxt != NULL);
+
+    /* Replies follow the data they answer */
+    if ((ret = nxt_wait(nxt)) != 0) {
+        *got = 0;
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
+    if (nxt->ops->read == NULL)
+        ret = LIBUSB_ERROR_NOT_SUPPORTED;
+    else
+        ret = nxt->ops->read(nxt, buffer, len, &transf);
+    *got = transf;
+    if (ret != 0) {
+        *libusb_err = ret;
+        return NXERR_LIBUSB;
+    }
+    return NXERR_SUCCESS;
+}
+
+const struct nxtstats *nxtusb_stats(nxtusb_t nxt)
+{
+    return &nxt->stats;
+}
+
+void nxtusb_stats_reset(nxtusb_t nxt)
+{
+    memset(&nxt->stats, 0, sizeof(struct nxtstats));
+}
+
+/* -------------------------------------------------------------------- */
+/* LibUSB transport                                                     */
+/* -------------------------------------------------------------------- */
+
+struct usb_dev {
+    struct libusb_context *context;         /* LibUSB Context */
+    struct libusb_device_handle *handle;    /* Nxt handle */
+    uint8_t bus;                            /* Bus of the device */
+    uint8_t ports[7];                       /* Port path on the bus */
+    int nports;                             /* Port path length */
+    nxtusb_t nxt;                           /* Owner, if watched */
+    struct usb_dev *next;                   /* Next watched device */
+};
+
+/* Hotplug watch: the devices it opened are tracked until they leave */
+static struct {
+    bool active;
+    libusb_hotplug_callback_handle handle;
+    nxtusb_hotplug_t cb;
+    void *udata;
+    struct usb_dev *devs;                   /* Opened devices */
+    libusb_device **arrived;                /* Devices to be opened */
+    size_t narrived, size;
+} watch;
+
+/* LibUSB context shared by all the opened devices, so that a single
+ * event loop serves all of them */
+static struct libusb_context *usb_context;
+static unsigned usb_refs;
+
+static int context_get(struct libusb_context **ctx)
+{
+    int err;
+
+    if (usb_refs == 0 && (err = libusb_init(&usb_context)) != 0)
+        return err;
+    usb_refs++;
+    *ctx = usb_context;
+    return 0;
+}
+
+static void context_put(void)
+{
+    if (--usb_refs == 0)
+        libusb_exit(usb_context);
+}
+
+static int usb_write(nxtusb_t nxt, uint8_t *buffer, size_t len,
+                     int *transf)
+{
+    struct usb_dev *dev = nxt->priv;
+
+    return libusb_bulk_transfer(dev->handle, tx_endpoint, buffer, len,
+                                transf, nxt->timeout);
+}
+
+static int usb_read(nxtusb_t nxt, uint8_t *buffer, size_t len,
+                    int *transf)
+{
+    struct usb_dev *dev = nxt->priv;
+
+    return libusb_bulk_transfer(dev->handle, rx_endpoint, buffer, len,
+                                transf, rx_timeout);
+}
+
+static int status_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+static void LIBUSB_CALL usb_xfer_done(struct libusb_transfer *xfer)
+{
+    struct nxt_xfer *x = xfer->user_data;
+
+    nxt_complete(x, xfer->actual_length, status_error(xfer->status));
+}
+
+static int usb_submit(nxtusb_t nxt, struct nxt_xfer *x)
+{
+    struct usb_dev *dev = nxt->priv;
+    struct libusb_transfer *xfer;
+
+    if ((xfer = x->priv) == NULL) {
+        xfer = x->priv = libusb_alloc_transfer(0);
+        if (xfer == NULL)
+            return LIBUSB_ERROR_NO_MEM;
+    }
+    libusb_fill_bulk_transfer(xfer, dev->handle, tx_endpoint, x->buffer,
+                              x->len, usb_xfer_done, x, nxt->timeout);
+    return libusb_submit_transfer(xfer);
+}
+
+static int usb_events(nxtusb_t nxt)
+{
+    struct usb_dev *dev = nxt->priv;
+
+    return libusb_handle_events(dev->context);
+}
+
+static int usb_cancel(nxtusb_t nxt, struct nxt_xfer *x)
+{
+    return libusb_cancel_transfer(x->priv);
+}
+
+static void usb_xfer_free(nxtusb_t nxt, struct nxt_xfer *x)
+{
+    libusb_free_transfer(x->priv);
+    x->priv = NULL;
+}
+
+static void usb_close(nxtusb_t nxt)
+{
+    struct usb_dev *dev = nxt->priv;
+    struct usb_dev **d;
+
+    for (d = &watch.devs; *d != NULL; d = &(*d)->next)
+        if (*d == dev) {
+            *d = dev->next;
+            break;
+        }
+    libusb_close(dev->handle);
+    context_put();
+    free(dev);
+}
+
+static void usb_name(nxtusb_t nxt, libusb_device *device)
+{
+    snprintf(nxt->name, sizeof(nxt->name), "usb:%03u:%03u",
+             libusb_get_bus_number(device),
+             libusb_get_device_address(device));
+}
+
+/* Names the device, and reads its serial number as its identity. The
+ * port path is kept as well, for devices without a serial number. */
+static void usb_identify(nxtusb_t nxt, libusb_device_handle *handle)
+{
+    struct usb_dev *dev = nxt->priv;
+    struct libusb_device_descriptor desc;
+    libusb_device *device = libusb_get_device(handle);
+
+    usb_name(nxt, device);
+    dev->bus = libusb_get_bus_number(device);
+    dev->nports = libusb_get_port_numbers(device, dev->ports,
+                                          sizeof(dev->ports));
+    if (libusb_get_device_descriptor(device, &desc) != 0 ||
+        desc.iSerialNumber == 0 ||
+        libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                           (unsigned char *)nxt->id,
+                                           sizeof(nxt->id)) <= 0)
+        nxt->id[0] = '\0';
+}
+
+/* Whether the opened NXT is the device of nxt: same serial number, or
+ * same port if it has none */
+static bool usb_same(nxtusb_t nxt, libusb_device_handle *handle)
+{
+    struct usb_dev *dev = nxt->priv;
+    struct libusb_device_descriptor desc;
+    libusb_device *device = libusb_get_device(handle);
+    uint8_t ports[sizeof(dev->ports)];
+    char serial[sizeof(nxt->id)];
+    int n;
+
+    if (nxt->id[0] != '\0')
+        return libusb_get_device_descriptor(device, &desc) == 0 &&
+               desc.iSerialNumber != 0 &&
+               libusb_get_string_descriptor_ascii(handle,
+                                                  desc.iSerialNumber,
+                                                  (unsigned char *)serial,
+                                                  sizeof(serial)) > 0 &&
+               strcmp(serial, nxt->id) == 0;
+
+    n = libusb_get_port_numbers(device, ports, sizeof(ports));
+    return dev->nports > 0 && n == dev->nports &&
+           libusb_get_bus_number(device) == dev->bus &&
+           memcmp(ports, dev->ports, n) == 0;
+}
+
+static int usb_reopen(nxtusb_t nxt)
+{
+    struct usb_dev *dev = nxt->priv;
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    libusb_device_handle *handle = NULL;
+    ssize_t count, i;
+
+    /* The brick comes back with a new address, and other bricks may be
+     * connected: looking for the same one */
+    if ((count = libusb_get_device_list(dev->context, &list)) < 0)
+        return count;
+    for (i = 0; i < count && handle == NULL; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != nxt_vendor_id ||
+            desc.idProduct != nxt_product_id ||
+            libusb_open(list[i], &handle) != 0) {
+            handle = NULL;
+            continue;
         }
-        out[j++] = val;
-        if ((ret = chunk(handle, out, &j)) != 0) {
-            goto fail;
+        if (!usb_same(nxt, handle)) {
+            libusb_close(handle);
+            handle = NULL;
         }
     }
-    out[j++] = eot;
-    if ((ret = send_raw(handle, out, j, &t)) == 0)
-        return NXERR_SUCCESS;
-  fail:
-    *libusb_err = ret;
-    return NXERR_LIBUSB;
+    libusb_free_device_list(list, 1);
+    if (handle == NULL)
+        return LIBUSB_ERROR_NO_DEVICE;
+    libusb_close(dev->handle);
+    dev->handle = handle;
+    usb_name(nxt, libusb_get_device(handle));
+    return 0;
 }
 
+static const struct nxt_transport usb_transport = {
+    .write = usb_write,
+    .read = usb_read,
+    .submit = usb_submit,
+    .events = usb_events,
+    .cancel = usb_cancel,
+    .xfer_free = usb_xfer_free,
+    .reopen = usb_reopen,
+    .close = usb_close
+};
+
 nxterr_t nxtusb_new(nxtusb_t *nxt, int *libusb_err)
 {
-    nxtusb_t ret;
-
-    #ifndef DUMMY
+    struct usb_dev *dev;
+    libusb_device_handle *handle;
     int err;
-    #endif
 
-    libusb_device_handle *handle;
+    #ifdef DUMMY
 
-    ret = malloc(sizeof(struct nxtusb));
-    assert(ret != NULL);
-    ret->buffer = malloc(sizeof(uint8_t) * usb_buflen);
-    assert(ret->buffer != NULL);
+    /* Dumping the traffic instead of accessing the device */
+    return nxtusb_new_sink(nxt, 1, true);
 
-    #ifndef DUMMY 
+    #endif
 
-    if ((err = libusb_init(&ret->context)) != 0) {
+    dev = malloc(sizeof(struct usb_dev));
+    assert(dev != NULL);
+
+    if ((err = context_get(&dev->context)) != 0) {
         *libusb_err = err;
         err = NXERR_LIBUSB;
         goto fail0;
     }
 
     /* Assigning handle */
-    handle = libusb_open_device_with_vid_pid(ret->context,
+    handle = libusb_open_device_with_vid_pid(dev->context,
                                              nxt_vendor_id,
                                              nxt_product_id);
     if (handle == NULL) {
         /* No such usb device. Checking if there's a SAM-BA device */
-        handle = libusb_open_device_with_vid_pid(ret->context,
+        handle = libusb_open_device_with_vid_pid(dev->context,
                                                  samba_vendor_id,
                                                  samba_product_id);
         if (handle != NULL) {
@@ -184,38 +731,268 @@ nxterr_t nxtusb_new(nxtusb_t *nxt, int *libusb_err)
         goto fail1;
     }
 
-    #endif
-
-    ret->handle = handle;
-    *nxt = ret;
+    dev->handle = handle;
+    dev->next = NULL;
+    *nxt = nxtusb_alloc(&usb_transport, dev);
+    usb_identify(*nxt, handle);
     return NXERR_SUCCESS;
 
-    #ifndef DUMMY
-
   fail1:
-    libusb_exit(ret->context);
+    context_put();
   fail0:
-    free(ret->buffer);
-    free(ret);
+    free(dev);
     *nxt = NULL;
     return err;
+}
 
-    #endif
+nxterr_t nxtusb_new_all(nxtusb_t **nxts, size_t *n, int *libusb_err)
+{
+    struct libusb_context *ctx;
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    libusb_device_handle *handle;
+    struct usb_dev *dev;
+    nxtusb_t *ret;
+    ssize_t count, i;
+    size_t found;
+    bool samba;
+    int err;
+
+    *nxts = NULL;
+    *n = 0;
+    if ((err = context_get(&ctx)) != 0) {
+        *libusb_err = err;
+        return NXERR_LIBUSB;
+    }
+    if ((count = libusb_get_device_list(ctx, &list)) < 0) {
+        *libusb_err = count;
+        context_put();
+        return NXERR_LIBUSB;
+    }
+
+    ret = calloc(count > 0 ? count : 1, sizeof(nxtusb_t));
+    assert(ret != NULL);
+    found = 0;
+    samba = false;
+    for (i = 0; i < count; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) != 0)
+            continue;
+        if (desc.idVendor == samba_vendor_id &&
+            desc.idProduct == samba_product_id)
+            samba = true;
+        if (desc.idVendor != nxt_vendor_id ||
+            desc.idProduct != nxt_product_id)
+            continue;
+        if ((err = libusb_open(list[i], &handle)) != 0) {
+            /* Busy or not accessible: the others are still usable */
+            *libusb_err = err;
+            continue;
+        }
+
+        dev = malloc(sizeof(struct usb_dev));
+        assert(dev != NULL);
+        context_get(&dev->context);
+        dev->handle = handle;
+        dev->next = NULL;
+        ret[found] = nxtusb_alloc(&usb_transport, dev);
+        usb_identify(ret[found], handle);
+        found++;
+    }
+    libusb_free_device_list(list, 1);
+    context_put();
+
+    if (found == 0) {
+        free(ret);
+        return samba ? NXERR_SAMBA : NXERR_NOTFOUND;
+    }
+    *nxts = ret;
+    *n = found;
+    return NXERR_SUCCESS;
 }
 
-void nxtusb_free(nxtusb_t u)
+/* Hotplug callback. No synchronous I/O is allowed from there, as it
+ * runs inside the event handling: arrived devices are only queued, and
+ * opened by watch_open once the events are handled. */
+static int LIBUSB_CALL watch_event(libusb_context *ctx,
+                                   libusb_device *device,
+                                   libusb_hotplug_event event, void *udata)
 {
-    if (u == NULL)
+    struct usb_dev *dev, **d;
+    size_t i;
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        if (watch.narrived == watch.size) {
+            watch.size = watch.size ? watch.size * 2 : 8;
+            watch.arrived = realloc(watch.arrived,
+                                    watch.size * sizeof(libusb_device *));
+            assert(watch.arrived != NULL);
+        }
+        watch.arrived[watch.narrived++] = libusb_ref_device(device);
+        return 0;
+    }
+
+    /* Gone before being opened */
+    for (i = 0; i < watch.narrived; i++) {
+        if (watch.arrived[i] == device) {
+            libusb_unref_device(device);
+            watch.arrived[i] = watch.arrived[--watch.narrived];
+            return 0;
+        }
+    }
+
+    for (d = &watch.devs; *d != NULL; d = &(*d)->next) {
+        dev = *d;
+        if (libusb_get_device(dev->handle) == device) {
+            *d = dev->next;
+            dev->next = NULL;
+            watch.cb(watch.udata, dev->nxt, false);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Opens and reports the devices queued by watch_event */
+static void watch_open(void)
+{
+    libusb_device_handle *handle;
+    libusb_device *device;
+    struct usb_dev *dev;
+    int ret;
+
+    while (watch.narrived > 0) {
+        device = watch.arrived[--watch.narrived];
+        ret = libusb_open(device, &handle);
+        libusb_unref_device(device);
+        if (ret != 0)
+            continue;   /* Busy or not accessible */
+        dev = malloc(sizeof(struct usb_dev));
+        assert(dev != NULL);
+        context_get(&dev->context);
+        dev->handle = handle;
+        dev->nxt = nxtusb_alloc(&usb_transport, dev);
+        usb_identify(dev->nxt, handle);
+        dev->next = watch.devs;
+        watch.devs = dev;
+        watch.cb(watch.udata, dev->nxt, true);
+    }
+}
+
+nxterr_t nxtusb_watch(nxtusb_hotplug_t cb, void *udata, int *libusb_err)
+{
+    struct libusb_context *ctx;
+    int err;
+
+    assert(!watch.active);
+    if ((err = context_get(&ctx)) != 0) {
+        *libusb_err = err;
+        return NXERR_LIBUSB;
+    }
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        err = LIBUSB_ERROR_NOT_SUPPORTED;
+        goto fail;
+    }
+
+    watch.cb = cb;
+    watch.udata = udata;
+    err = libusb_hotplug_register_callback(ctx,
+                                           LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                           LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                           LIBUSB_HOTPLUG_ENUMERATE,
+                                           nxt_vendor_id, nxt_product_id,
+                                           LIBUSB_HOTPLUG_MATCH_ANY,
+                                           watch_event, NULL, &watch.handle);
+    if (err != 0)
+        goto fail;
+    watch.active = true;
+    /* The devices already plugged in were enumerated by the
+     * registration */
+    watch_open();
+    return NXERR_SUCCESS;
+
+  fail:
+    context_put();
+    *libusb_err = err;
+    return NXERR_LIBUSB;
+}
+
+size_t nxtusb_watch_pollfds(struct pollfd *fds, size_t max)
+{
+    const struct libusb_pollfd **list;
+    size_t n;
+
+    if (!watch.active || (list = libusb_get_pollfds(usb_context)) == NULL)
+        return 0;
+    for (n = 0; n < max && list[n] != NULL; n++) {
+        fds[n].fd = list[n]->fd;
+        fds[n].events = list[n]->events;
+        fds[n].revents = 0;
+    }
+    libusb_free_pollfds(list);
+    return n;
+}
+
+nxterr_t nxtusb_watch_events(int *libusb_err)
+{
+    struct timeval tv = {0, 0};
+    int err;
+
+    err = libusb_handle_events_timeout(usb_context, &tv);
+    watch_open();
+    if (err != 0) {
+        *libusb_err = err;
+        return NXERR_LIBUSB;
+    }
+    return NXERR_SUCCESS;
+}
+
+bool nxtusb_watch_pending(void)
+{
+    return watch.narrived > 0;
+}
+
+void nxtusb_unwatch(void)
+{
+    if (!watch.active)
         return;
+    libusb_hotplug_deregister_callback(usb_context, watch.handle);
+    while (watch.narrived > 0)
+        libusb_unref_device(watch.arrived[--watch.narrived]);
+    free(watch.arrived);
+    watch.arrived = NULL;
+    watch.size = 0;
+    watch.active = false;
+    context_put();
+}
 
-    #ifndef DUMMY
+void nxtusb_free_all(nxtusb_t *nxts, size_t n)
+{
+    size_t i;
 
-    libusb_close(u->handle);
-    libusb_exit(u->context);
+    if (nxts == NULL)
+        return;
+    for (i = 0; i < n; i++)
+        nxtusb_free(nxts[i]);
+    free(nxts);
+}
 
-    #endif
+const char *nxtusb_name(nxtusb_t nxt)
+{
+    return nxt->name;
+}
 
+const char *nxtusb_id(nxtusb_t nxt)
+{
+    return nxt->id[0] != '\0' ? nxt->id : NULL;
+}
+
+void nxtusb_free(nxtusb_t u)
+{
+    if (u == NULL)
+        return;
+
+    nxtasync_free(u->async);
+    u->ops->close(u);
     free(u->buffer);
     free(u);
 }
-
@@ -1,7 +1,10 @@
 #ifndef __NXTUSB_H__
 #define __NXTUSB_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include "nxtstats.h"
 
 typedef enum {
     NXERR_SUCCESS = 0,
@@ -11,11 +14,119 @@ typedef enum {
 } nxterr_t;
 typedef struct nxtusb * nxtusb_t;
 
+/* Stream framing */
+typedef enum {
+    NXTFRAME_ESC = 0,           /* ESC/EOT byte stuffing */
+    NXTFRAME_COBS,              /* Consistent overhead byte stuffing */
+    NXTFRAME_RAW                /* No framing */
+} nxtframe_t;
+
+/* Simulated NXT device model */
+struct nxtsim_params {
+    unsigned latency_us;        /* Latency of each packet */
+    unsigned long bandwidth;    /* Bytes per second, 0 for unlimited */
+    bool realtime;              /* Sleep for the modeled time */
+    nxtframe_t framing;         /* Expected stream framing */
+    size_t record_len;          /* Raw bytes ahead of the first frame, as
+                                   the activation record */
+    bool compressed;            /* Frames hold nxtlz streams */
+    bool verify;                /* Reply to frames with their CRC */
+    unsigned fault_every;       /* Corrupt one frame out of fault_every */
+    bool resume;                /* Speak the resume protocol (nxtres.h) */
+    unsigned glitch_every;      /* Drop the link on one frame out of
+                                   glitch_every, until reconnected */
+};
+
+/* Scatter list element: len bytes at data, or len zeros if data is NULL */
+struct nxtspan {
+    const void *data;
+    size_t len;
+};
+
 nxterr_t nxtusb_new(nxtusb_t *nxt, int *libusb_err);
+nxterr_t nxtusb_new_all(nxtusb_t **nxts, size_t *n, int *libusb_err);
+void nxtusb_free_all(nxtusb_t *nxts, size_t n);
+
+/* Hotplug notification: nxt was plugged in and opened (arrived), or is
+ * gone and must be freed by the callee */
+typedef void (*nxtusb_hotplug_t)(void *udata, nxtusb_t nxt, bool arrived);
+
+/* Watches the bricks being plugged and unplugged, reporting those already
+ * plugged in as arrived. Departures are delivered while handling USB
+ * events, which happens in nxtusb_watch_events and during transfers.
+ * Arrivals are delivered by nxtusb_watch_events only, once the events
+ * are handled, since opening a device can't be done from there. The
+ * libusb context stays open until nxtusb_unwatch. */
+struct pollfd;
+nxterr_t nxtusb_watch(nxtusb_hotplug_t cb, void *udata, int *libusb_err);
+/* Fills up to max descriptors to poll(2) for events, returns how many */
+size_t nxtusb_watch_pollfds(struct pollfd *fds, size_t max);
+/* Handles the pending events without blocking */
+nxterr_t nxtusb_watch_events(int *libusb_err);
+/* Whether bricks arrived during transfers, and wait for
+ * nxtusb_watch_events to be opened and reported */
+bool nxtusb_watch_pending(void);
+void nxtusb_unwatch(void);
+nxterr_t nxtusb_new_sim(nxtusb_t *nxt, const struct nxtsim_params *params);
+nxterr_t nxtusb_new_sink(nxtusb_t *nxt, int fd, bool hexdump);
 void nxtusb_free(nxtusb_t e);
 nxterr_t nxtusb_send(nxtusb_t nxt, void *buffer, ssize_t len, int *libusb_err);
 nxterr_t nxtusb_send_escaped(nxtusb_t nxt, void *buffer, size_t len,
                              int *libusb_err);
+nxterr_t nxtusb_recv(nxtusb_t nxt, void *buffer, size_t len, size_t *got,
+                     int *libusb_err);
+nxterr_t nxtusb_send_spans(nxtusb_t nxt, const struct nxtspan *spans,
+                           size_t n, nxtframe_t framing, int *libusb_err);
+
+/* Streaming version of nxtusb_send_spans: the frame is opened, written
+ * in chunks of any size (NULL data stands for zeros) and closed. Only
+ * one frame at a time can be open on a device. */
+void nxtusb_frame_begin(nxtusb_t nxt, nxtframe_t framing);
+nxterr_t nxtusb_frame_write(nxtusb_t nxt, const void *data, size_t len,
+                            int *libusb_err);
+nxterr_t nxtusb_frame_end(nxtusb_t nxt, int *libusb_err);
+
 const char *nxtusb_geterr(nxterr_t e);
+const char *nxtusb_name(nxtusb_t nxt);
+
+/* Identity of the device that survives replugs, unlike its name: the
+ * USB serial number. NULL if the device has none, as simulated devices
+ * and sinks. */
+const char *nxtusb_id(nxtusb_t nxt);
+
+/* Bulk transfer size policy. Streams are submitted in transfers of up
+ * to len bytes, rounded down to whole packets; the setter returns the
+ * size actually used. */
+size_t nxtusb_set_xfer_len(nxtusb_t nxt, size_t len);
+size_t nxtusb_get_xfer_len(nxtusb_t nxt);
+
+/* With pipelining enabled, escaped and COBS frames of several blocks
+ * are encoded by a separate thread while the previous blocks are being
+ * sent. The stream is the same. Disabled by default. */
+void nxtusb_set_pipelined(nxtusb_t nxt, bool enable);
+
+/* Write timeout in ms, 0 (the default) to wait forever. The setter
+ * returns the previous value. */
+unsigned nxtusb_set_timeout(nxtusb_t nxt, unsigned ms);
+
+/* Opens the device again after a link failure, dropping the open frame.
+ * Fails until the device is back. */
+nxterr_t nxtusb_reconnect(nxtusb_t nxt, int *libusb_err);
+
+/* Transfer counters of the device, since creation or the last reset */
+const struct nxtstats *nxtusb_stats(nxtusb_t nxt);
+void nxtusb_stats_reset(nxtusb_t nxt);
+
+/* With verify set, the simulated device replies to each frame holding a
+ * single record (32 bit address, 32 bit length, content) with the address
+ * and the CRC-32 of the stored content, little endian. */
+
+/* Simulated device inspection: the decoded content of the completed
+ * frames, the number of completed frames, the raw bytes received and the
+ * modeled transmission time in nanoseconds. */
+const uint8_t *nxtsim_image(nxtusb_t nxt, size_t *len);
+unsigned nxtsim_frames(nxtusb_t nxt);
+const uint8_t *nxtsim_wire(nxtusb_t nxt, size_t *len);
+uint64_t nxtsim_time(nxtusb_t nxt);
 
 #endif /* __NXTUSB_H__ */
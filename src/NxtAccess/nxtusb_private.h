@@ -0,0 +1,140 @@
+#ifndef __NXTUSB_PRIVATE_H__
+#define __NXTUSB_PRIVATE_H__
+
+/* Definitions shared by the NxtAccess modules. Not part of the API. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <libusb-1.0/libusb.h>
+
+#include "nxtusb.h"
+#include "nxtstats.h"
+#include "nxtcobs.h"
+
+/* Transmission constants: tx_timeout is the default timeout in ms, 0 to
+ * wait forever */
+static const int tx_endpoint = 1;
+static const unsigned tx_timeout = 0;
+
+/* Reception constants: replies are expected within rx_timeout ms */
+static const int rx_endpoint = 0x82;
+static const int rx_timeout = 1000;
+
+/* Nxt buffer size */
+static const uint32_t usb_buflen = 64;
+
+/* Encoding blocks in each slot of the pipelined sender, so that the
+ * hand-offs between the threads stay rare */
+static const size_t pipe_blocks = 4;
+
+/* Transfer descriptor for asynchronous writes */
+struct nxt_xfer {
+    uint8_t *buffer;                        /* Data to be sent */
+    size_t len;                             /* Data length */
+    void (*done)(struct nxt_xfer *x, size_t transf, int err);
+    void *udata;                            /* User data for done */
+    void *priv;                             /* Transport private data */
+    nxtusb_t nxt;                           /* Device, set by nxt_submit */
+    uint64_t start;                         /* Submission time */
+};
+
+/* Transport interface. Errors are reported as libusb error codes. */
+struct nxt_transport {
+    /* Synchronous write */
+    int (*write)(nxtusb_t nxt, uint8_t *buffer, size_t len, int *transf);
+    /* Synchronous read; NULL if the transport can't receive */
+    int (*read)(nxtusb_t nxt, uint8_t *buffer, size_t len, int *transf);
+    /* Asynchronous write, completion is notified through x->done */
+    int (*submit)(nxtusb_t nxt, struct nxt_xfer *x);
+    /* Waits for completions; NULL if submit completes immediately */
+    int (*events)(nxtusb_t nxt);
+    /* Cancels a submitted write, still notified through x->done; NULL
+     * if submit completes immediately */
+    int (*cancel)(nxtusb_t nxt, struct nxt_xfer *x);
+    /* Releases the transport data of a descriptor (may be NULL) */
+    void (*xfer_free)(nxtusb_t nxt, struct nxt_xfer *x);
+    /* Opens the device again after a link failure; NULL if unsupported */
+    int (*reopen)(nxtusb_t nxt);
+    /* Releases the transport */
+    void (*close)(nxtusb_t nxt);
+};
+
+struct nxtusb {
+    const struct nxt_transport *ops;        /* Transport */
+    void *priv;                             /* Transport data */
+    uint8_t *buffer;                        /* Byte stuffing buffer */
+    size_t xfer_len;                        /* Bulk transfer size */
+    unsigned timeout;                       /* Write timeout (ms) */
+    bool pipelined;                         /* Encode while sending */
+    struct nxtasync *async;                 /* Transfer queue, if any */
+    nxtframe_t framing;                     /* Framing of the open frame */
+    size_t fill;                            /* Pending bytes in buffer */
+    struct nxtcobs_enc cobs;                /* COBS encoder state */
+    char name[24];                          /* Device name */
+    char id[32];                            /* Stable identity, if any */
+    struct nxtstats stats;                  /* Transfer counters */
+};
+
+/* Transport synchronous write, with accounting */
+static inline int send_raw(nxtusb_t nxt, uint8_t *buffer, size_t len,
+                           int *transf)
+{
+    uint64_t start = nxtstats_now();
+    int ret;
+
+    *transf = 0;
+    ret = nxt->ops->write(nxt, buffer, len, transf);
+    nxtstats_transfer(&nxt->stats, start, len, *transf, ret);
+    return ret;
+}
+
+/* Transport asynchronous write, with accounting */
+static inline int nxt_submit(nxtusb_t nxt, struct nxt_xfer *x)
+{
+    int ret;
+
+    x->nxt = nxt;
+    x->start = nxtstats_now();
+    if ((ret = nxt->ops->submit(nxt, x)) != 0)
+        nxtstats_transfer(&nxt->stats, x->start, x->len, 0, ret);
+    return ret;
+}
+
+/* Completion of a submitted transfer, to be called by the transports */
+void nxt_complete(struct nxt_xfer *x, size_t transf, int err);
+
+/* Allocates the device structure for the given transport */
+nxtusb_t nxtusb_alloc(const struct nxt_transport *ops, void *priv);
+
+/* Submit operation for transports that can only write synchronously */
+int nxt_submit_sync(nxtusb_t nxt, struct nxt_xfer *x);
+
+/* Sends the buffer as transfers of up to xfer_len bytes, the last one
+ * possibly shorter. On transports queueing transfers they go through the
+ * asynchronous engine (nxtasync.c), so that the bus stays busy while the
+ * caller prepares the next data: the call returns once they are
+ * submitted, their errors being reported by the next calls or by
+ * nxt_wait. Returns the libusb return value. */
+int nxt_write(nxtusb_t nxt, const uint8_t *buffer, size_t len);
+
+/* Waits for the transfers queued by nxt_write. Returns the first libusb
+ * error of the queue, which is dropped on errors. */
+int nxt_wait(nxtusb_t nxt);
+
+/* Engine side of nxt_write: copies the data in the ring and submits the
+ * last partial buffer as well. Returns the libusb return value. */
+int nxt_async_send(struct nxtasync *a, const uint8_t *buffer, size_t len);
+
+/* Sends the whole packets out of fill bytes, the count through sent.
+ * Returns the libusb return value. */
+int nxt_packets(nxtusb_t nxt, uint8_t *buffer, size_t fill, size_t *sent);
+
+/* Payload bytes encoded at once by the escaped senders */
+size_t nxt_block_len(nxtusb_t nxt);
+
+/* Sends the spans as an escaped or COBS frame, encoding in a separate
+ * thread. Returns the libusb return value. */
+int nxt_send_pipelined(nxtusb_t nxt, const struct nxtspan *spans, size_t n,
+                       nxtframe_t framing);
+
+#endif /* __NXTUSB_PRIVATE_H__ */
@@ -0,0 +1,300 @@
+#include "batch.h"
+#include "ElfSword/elf.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct batch;
+
+struct worker {
+    struct batch *b;
+    pthread_t thread;
+    pthread_mutex_t lock;        /* Guards lo and hi */
+    size_t lo, hi;               /* Files left, [lo, hi) */
+    ElfArena arena;              /* Memory of the file being inspected */
+};
+
+struct batch {
+    char **paths;                /* Input files */
+    size_t n;
+    char **names;                /* Requested names */
+    size_t nnames;
+    struct worker *workers;
+    unsigned nworkers;
+    pthread_mutex_t lock;        /* Guards out and failed */
+    pthread_cond_t ready;        /* A result was stored */
+    char **out;                  /* Result lines, NULL until done */
+    size_t failed;               /* Files in error */
+};
+
+static void paths_add(char ***paths, size_t *n, size_t *size, char *path)
+{
+    if (*n == *size) {
+        *size = *size ? *size * 2 : 64;
+        *paths = realloc(*paths, *size * sizeof(char *));
+        assert(*paths != NULL);
+    }
+    (*paths)[(*n)++] = path;
+}
+
+/* Regular files of the directory, sorted by name */
+static bool paths_dir(const char *dir, char ***paths, size_t *n)
+{
+    struct dirent **ents;
+    struct stat st;
+    size_t size = 0;
+    char *path;
+    int i, nents;
+
+    if ((nents = scandir(dir, &ents, NULL, alphasort)) == -1)
+        return false;
+    for (i = 0; i < nents; i++) {
+        if (asprintf(&path, "%s/%s", dir, ents[i]->d_name) != -1) {
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+                paths_add(paths, n, &size, path);
+            else
+                free(path);
+        }
+        free(ents[i]);
+    }
+    free(ents);
+    return true;
+}
+
+/* One path per line, blank lines skipped */
+static bool paths_list(const char *list, char ***paths, size_t *n)
+{
+    FILE *in;
+    char *line = NULL;
+    size_t size = 0, linesize = 0;
+    ssize_t len;
+
+    in = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (in == NULL)
+        return false;
+    while ((len = getline(&line, &linesize, in)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len > 0)
+            paths_add(paths, n, &size, strdup(line));
+    }
+    free(line);
+    if (in != stdin)
+        fclose(in);
+    return true;
+}
+
+static void inspect_name(FILE *out, Elf elf, const char *name)
+{
+    Elf32_Shdr *shdr;
+    Elf32_Sym *sym;
+
+    if (name[0] == '.') {
+        if ((shdr = elf_section_get(elf, name)) == NULL)
+            fprintf(out, " %s=-", name);
+        else
+            fprintf(out, " %s=0x%x+%u", name, shdr->sh_offset,
+                    shdr->sh_size);
+    } else {
+        if ((sym = elf_symbol_get(elf, name)) == NULL)
+            fprintf(out, " %s=-", name);
+        else
+            fprintf(out, " %s=0x%08x/%u", name, sym->st_value,
+                    sym->st_size);
+    }
+}
+
+/* Result line of a file; false on errors */
+static bool inspect(struct batch *b, ElfArena arena, const char *path,
+                    char **line)
+{
+    size_t len, i;
+    FILE *out;
+    Elf elf;
+    bool ok = false;
+
+    out = open_memstream(line, &len);
+    assert(out != NULL);
+    if ((elf = elf_map_file_in(arena, path)) == NULL) {
+        fprintf(out, "%s: error not an ELF file\n", path);
+    } else if (!elf_check_format(elf)) {
+        fprintf(out, "%s: error malformed ELF file\n", path);
+    } else {
+        elf_index_build(elf);
+        fprintf(out, "%s: ok", path);
+        for (i = 0; i < b->nnames; i++)
+            inspect_name(out, elf, b->names[i]);
+        fputc('\n', out);
+        ok = true;
+    }
+    elf_release_file(elf);
+    if (arena != NULL)
+        elf_arena_reset(arena);
+    fclose(out);
+    return ok;
+}
+
+static bool take(struct worker *w, size_t *i)
+{
+    bool ret;
+
+    pthread_mutex_lock(&w->lock);
+    if ((ret = w->lo < w->hi))
+        *i = w->lo++;
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* Moves the upper half of the largest range left to w. The victim is
+ * picked on a snapshot of the ranges, and checked again once locked. */
+static bool steal(struct worker *w)
+{
+    struct batch *b = w->b;
+    struct worker *v, *victim;
+    size_t left, most, lo, hi;
+    unsigned k;
+
+    for (;;) {
+        victim = NULL;
+        most = 0;
+        for (k = 0; k < b->nworkers; k++) {
+            v = &b->workers[k];
+            pthread_mutex_lock(&v->lock);
+            left = v->hi - v->lo;
+            pthread_mutex_unlock(&v->lock);
+            if (left > most) {
+                most = left;
+                victim = v;
+            }
+        }
+        if (victim == NULL)
+            return false;
+
+        pthread_mutex_lock(&victim->lock);
+        left = victim->hi - victim->lo;
+        hi = victim->hi;
+        lo = hi - (left + 1) / 2;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0)
+            continue;
+
+        pthread_mutex_lock(&w->lock);
+        w->lo = lo;
+        w->hi = hi;
+        pthread_mutex_unlock(&w->lock);
+        return true;
+    }
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *b = w->b;
+    char *line;
+    size_t i;
+    bool ok;
+
+    while (take(w, &i) || (steal(w) && take(w, &i))) {
+        ok = inspect(b, w->arena, b->paths[i], &line);
+        pthread_mutex_lock(&b->lock);
+        b->out[i] = line;
+        if (!ok)
+            b->failed++;
+        pthread_cond_broadcast(&b->ready);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+int batch_run(const char *list, char **names, size_t nnames,
+              unsigned nthreads)
+{
+    struct batch b;
+    struct worker *w;
+    struct stat st;
+    char *line;
+    size_t i;
+    unsigned k;
+    long ncpu;
+    int ret;
+    bool ok;
+
+    memset(&b, 0, sizeof(b));
+    b.names = names;
+    b.nnames = nnames;
+    if (stat(list, &st) == 0 && S_ISDIR(st.st_mode))
+        ok = paths_dir(list, &b.paths, &b.n);
+    else
+        ok = paths_list(list, &b.paths, &b.n);
+    if (!ok) {
+        perror(list);
+        return 1;
+    }
+    if (b.n == 0) {
+        free(b.paths);
+        return 0;
+    }
+
+    if (nthreads == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? ncpu : 1;
+    }
+    if (nthreads > b.n)
+        nthreads = b.n;
+    b.nworkers = nthreads;
+    b.workers = calloc(nthreads, sizeof(struct worker));
+    b.out = calloc(b.n, sizeof(char *));
+    assert(b.workers != NULL && b.out != NULL);
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.ready, NULL);
+
+    /* Even split to start with, stealing balances the rest */
+    for (k = 0; k < nthreads; k++) {
+        w = &b.workers[k];
+        w->b = &b;
+        pthread_mutex_init(&w->lock, NULL);
+        /* Without an arena, files are mapped on the heap */
+        w->arena = elf_arena_new(0);
+        w->lo = b.n * k / nthreads;
+        w->hi = b.n * (k + 1) / nthreads;
+    }
+    for (k = 0; k < nthreads; k++) {
+        ret = pthread_create(&b.workers[k].thread, NULL, work,
+                             &b.workers[k]);
+        assert(ret == 0);
+    }
+
+    /* Streaming the results in input order */
+    for (i = 0; i < b.n; i++) {
+        pthread_mutex_lock(&b.lock);
+        while (b.out[i] == NULL)
+            pthread_cond_wait(&b.ready, &b.lock);
+        line = b.out[i];
+        pthread_mutex_unlock(&b.lock);
+        fputs(line, stdout);
+        free(line);
+        free(b.paths[i]);
+    }
+    fflush(stdout);
+
+    /* Idle workers may still be probing the others */
+    for (k = 0; k < nthreads; k++)
+        pthread_join(b.workers[k].thread, NULL);
+    for (k = 0; k < nthreads; k++) {
+        pthread_mutex_destroy(&b.workers[k].lock);
+        elf_arena_free(b.workers[k].arena);
+    }
+    pthread_cond_destroy(&b.ready);
+    pthread_mutex_destroy(&b.lock);
+    free(b.workers);
+    free(b.out);
+    free(b.paths);
+    return b.failed > 0 ? 1 : 0;
+}
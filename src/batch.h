@@ -0,0 +1,26 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdlib.h>
+
+/* Batch inspection of ELF files. Each file is mapped, checked and
+ * indexed, then the requested names are looked up: names starting with
+ * a dot are sections, the others are symbols. Files are processed by a
+ * pool of worker threads, each one owning a range of the input and
+ * stealing half of the largest range left once its own is done. Results
+ * are printed in input order, one line per file, as soon as the files
+ * before it are done:
+ *
+ *   PATH: ok [SYMBOL=ADDR/SIZE] [.SECTION=OFFSET+SIZE] ...
+ *   PATH: error MESSAGE
+ *
+ * Missing names are printed as NAME=-. Each worker maps its files in
+ * its own arena, reset after each file. */
+
+/* Runs the batch on the files of list, which is either a directory or a
+ * file holding one path per line ("-" for the standard input), with
+ * nthreads workers (0 for one per core). Returns the exit status. */
+int batch_run(const char *list, char **names, size_t nnames,
+              unsigned nthreads);
+
+#endif /* __BATCH_H__ */
@@ -0,0 +1,500 @@
+#include "daemon.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Descriptors polled for USB events */
+#define USB_POLLFDS 16
+
+struct brick {
+    nxtusb_t nxt;
+    bool busy;                   /* Being flashed */
+    bool gone;                   /* Unplugged while busy */
+    struct brick *next;
+};
+
+struct job {
+    int fd;                      /* Client, -1 for automatic jobs */
+    char *path;                  /* ELF file */
+    char *brick;                 /* Brick name, NULL for any */
+    struct job *next;
+};
+
+struct client {
+    int fd;                      /* Connection, -1 if unused */
+    char line[DAEMON_LINE];      /* Request being read */
+    size_t fill;
+};
+
+struct cached {
+    char *path;                  /* ELF file, NULL if unused */
+    struct stat st;              /* File identity when prepared */
+    struct prepared p;
+    unsigned long used;          /* Last use, for eviction */
+};
+
+struct daemon {
+    const struct settings *set;
+    const char *autoflash;       /* Image for new bricks, if any */
+    int fd;                      /* Listening socket */
+    struct brick *bricks;
+    struct job *jobs, **tail;    /* Queue */
+    struct client clients[DAEMON_CLIENTS];
+    struct cached cache[DAEMON_CACHE];
+    unsigned long clock;         /* Cache use counter */
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static void reply(int fd, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void reply(int fd, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (fd == -1)
+        return;
+    va_start(ap, fmt);
+    vdprintf(fd, fmt, ap);
+    va_end(ap);
+    close(fd);
+}
+
+static void job_push(struct daemon *d, int fd, const char *path,
+                     const char *brick)
+{
+    struct job *j;
+
+    j = malloc(sizeof(struct job));
+    assert(j != NULL);
+    j->fd = fd;
+    j->path = strdup(path);
+    j->brick = brick != NULL ? strdup(brick) : NULL;
+    assert(j->path != NULL);
+    j->next = NULL;
+    *d->tail = j;
+    d->tail = &j->next;
+}
+
+static void job_free(struct job *j)
+{
+    free(j->path);
+    free(j->brick);
+    free(j);
+}
+
+/* Fails the queued jobs bound to the named brick, or all of them */
+static void jobs_fail(struct daemon *d, const char *brick, const char *why)
+{
+    struct job **jp, *j;
+
+    jp = &d->jobs;
+    while ((j = *jp) != NULL) {
+        if (brick != NULL && (j->brick == NULL ||
+                              strcmp(j->brick, brick) != 0)) {
+            jp = &j->next;
+            continue;
+        }
+        *jp = j->next;
+        reply(j->fd, "error %s: %s\n", j->path, why);
+        job_free(j);
+    }
+    d->tail = jp;
+}
+
+static bool same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void cache_drop(struct cached *c)
+{
+    prepared_release(&c->p);
+    free(c->path);
+    c->path = NULL;
+}
+
+/* Returns the prepared image of the file, preparing it if it's not
+ * cached or it changed since. The least recently used image makes room
+ * for the new one. */
+static const struct prepared *cache_get(struct daemon *d, const char *path)
+{
+    struct cached *c, *slot;
+    struct stat st;
+    size_t i;
+
+    if (stat(path, &st) == -1)
+        return NULL;
+
+    slot = NULL;
+    for (i = 0; i < DAEMON_CACHE; i++) {
+        c = &d->cache[i];
+        if (c->path != NULL && strcmp(c->path, path) == 0) {
+            if (same_file(&c->st, &st)) {
+                c->used = ++d->clock;
+                return &c->p;
+            }
+            cache_drop(c);
+        }
+        if (c->path == NULL) {
+            if (slot == NULL || slot->path != NULL)
+                slot = c;
+        } else if (slot == NULL ||
+                   (slot->path != NULL && c->used < slot->used)) {
+            slot = c;
+        }
+    }
+
+    if (slot->path != NULL)
+        cache_drop(slot);
+    if (!prepared_load(&slot->p, path))
+        return NULL;
+    if (d->set->compress)
+        prepared_pack(&slot->p);
+    slot->path = strdup(path);
+    assert(slot->path != NULL);
+    slot->st = st;
+    slot->used = ++d->clock;
+    return &slot->p;
+}
+
+static void brick_free(struct daemon *d, struct brick *b)
+{
+    struct brick **bp;
+
+    for (bp = &d->bricks; *bp != b; bp = &(*bp)->next)
+        ;
+    *bp = b->next;
+    nxtusb_free(b->nxt);
+    free(b);
+}
+
+static void on_hotplug(void *udata, nxtusb_t nxt, bool arrived)
+{
+    struct daemon *d = udata;
+    struct brick *b, **bp;
+
+    if (arrived) {
+        b = calloc(1, sizeof(struct brick));
+        assert(b != NULL);
+        b->nxt = nxt;
+        for (bp = &d->bricks; *bp != NULL; bp = &(*bp)->next)
+            ;
+        *bp = b;
+        printf("%s: plugged in\n", nxtusb_name(nxt));
+        if (d->autoflash != NULL)
+            job_push(d, -1, d->autoflash, nxtusb_name(nxt));
+        return;
+    }
+
+    for (b = d->bricks; b != NULL && b->nxt != nxt; b = b->next)
+        ;
+    if (b == NULL)
+        return;
+    printf("%s: unplugged\n", nxtusb_name(nxt));
+    jobs_fail(d, nxtusb_name(nxt), "brick unplugged");
+    if (b->busy)
+        b->gone = true;     /* Freed once the job is over */
+    else
+        brick_free(d, b);
+}
+
+static void job_run(struct daemon *d, struct job *j, struct brick *b)
+{
+    const struct prepared *p;
+    const char *name;
+    nxterr_t err;
+    int luerr;
+
+    name = nxtusb_name(b->nxt);
+    if ((p = cache_get(d, j->path)) == NULL) {
+        printf("%s: cannot prepare %s\n", name, j->path);
+        reply(j->fd, "error %s: cannot prepare the image\n", j->path);
+        return;
+    }
+
+    b->busy = true;
+    nxtusb_stats_reset(b->nxt);
+    err = flash_one(b->nxt, p, d->set, &luerr);
+    b->busy = false;
+
+    printf("%s: %s, %s\n", name, j->path, nxtusb_geterr(err));
+    if (d->set->stats)
+        nxtstats_print(nxtusb_stats(b->nxt), stdout);
+    if (err == NXERR_SUCCESS)
+        reply(j->fd, "ok %s %s\n", j->path, name);
+    else
+        reply(j->fd, "error %s %s: %s\n", j->path, name,
+              nxtusb_geterr(err));
+    fflush(stdout);
+    if (b->gone)
+        brick_free(d, b);
+}
+
+/* Runs the queued jobs whose brick is connected, in order */
+static void jobs_run(struct daemon *d)
+{
+    struct job **jp, *j;
+    struct brick *b;
+
+    jp = &d->jobs;
+    while ((j = *jp) != NULL && !stop) {
+        for (b = d->bricks; b != NULL; b = b->next)
+            if (!b->gone && (j->brick == NULL ||
+                             strcmp(j->brick, nxtusb_name(b->nxt)) == 0))
+                break;
+        if (b == NULL) {
+            jp = &j->next;
+            continue;
+        }
+        *jp = j->next;
+        if (d->tail == &j->next)
+            d->tail = jp;
+        job_run(d, j, b);
+        job_free(j);
+
+        /* The queue may have changed meanwhile */
+        jp = &d->jobs;
+    }
+}
+
+static void client_request(struct daemon *d, struct client *c)
+{
+    char *cmd, *path, *brick, *save;
+    struct brick *b;
+    FILE *out;
+    int fd = c->fd;
+
+    /* The connection goes with the request */
+    c->fd = -1;
+    cmd = strtok_r(c->line, " \t\r\n", &save);
+    path = strtok_r(NULL, " \t\r\n", &save);
+    brick = strtok_r(NULL, " \t\r\n", &save);
+
+    if (cmd != NULL && strcmp(cmd, "list") == 0) {
+        /* Buffered, so that the reply goes out as a whole */
+        if ((out = fdopen(fd, "w")) == NULL) {
+            close(fd);
+            return;
+        }
+        fputs("ok", out);
+        for (b = d->bricks; b != NULL; b = b->next)
+            if (!b->gone)
+                fprintf(out, " %s", nxtusb_name(b->nxt));
+        fputs("\n", out);
+        fclose(out);
+    } else if (cmd != NULL && strcmp(cmd, "flash") == 0 && path != NULL) {
+        job_push(d, fd, path, brick);
+    } else {
+        reply(fd, "error: bad request\n");
+    }
+}
+
+static void client_read(struct daemon *d, struct client *c)
+{
+    ssize_t n;
+
+    n = read(c->fd, c->line + c->fill, sizeof(c->line) - 1 - c->fill);
+    if (n <= 0) {
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->fill += n;
+    c->line[c->fill] = '\0';
+    if (strchr(c->line, '\n') != NULL)
+        client_request(d, c);
+    else if (c->fill == sizeof(c->line) - 1) {
+        reply(c->fd, "error: request too long\n");
+        c->fd = -1;
+    }
+}
+
+static void client_accept(struct daemon *d)
+{
+    struct client *c;
+    int fd;
+    size_t i;
+
+    if ((fd = accept(d->fd, NULL, NULL)) == -1)
+        return;
+    for (i = 0; i < DAEMON_CLIENTS; i++) {
+        c = &d->clients[i];
+        if (c->fd == -1) {
+            c->fd = fd;
+            c->fill = 0;
+            return;
+        }
+    }
+    reply(fd, "error: busy\n");
+}
+
+static int listen_on(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", sockpath);
+        return -1;
+    }
+    strcpy(addr.sun_path, sockpath);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    /* Taking over the socket of a previous run */
+    unlink(sockpath);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, DAEMON_CLIENTS) == -1) {
+        perror(sockpath);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int daemon_run(const char *sockpath, const char *autoflash,
+               const struct settings *set)
+{
+    struct pollfd fds[1 + DAEMON_CLIENTS + USB_POLLFDS];
+    struct client *polled[DAEMON_CLIENTS];
+    struct sigaction sa;
+    struct daemon d;
+    size_t i, n, nclients;
+    nxterr_t err;
+    int luerr;
+
+    memset(&d, 0, sizeof(d));
+    d.set = set;
+    d.autoflash = autoflash;
+    d.tail = &d.jobs;
+    for (i = 0; i < DAEMON_CLIENTS; i++)
+        d.clients[i].fd = -1;
+    if ((d.fd = listen_on(sockpath)) == -1)
+        return 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    /* Clients may leave before their job is over */
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((err = nxtusb_watch(on_hotplug, &d, &luerr)) != NXERR_SUCCESS) {
+        fprintf(stderr, "%s\n", nxtusb_geterr(err));
+        close(d.fd);
+        unlink(sockpath);
+        return 1;
+    }
+    printf("Waiting for jobs on %s\n", sockpath);
+    fflush(stdout);
+
+    while (!stop) {
+        jobs_run(&d);
+        fflush(stdout);
+
+        fds[0].fd = d.fd;
+        fds[0].events = POLLIN;
+        n = 1;
+        nclients = 0;
+        for (i = 0; i < DAEMON_CLIENTS; i++) {
+            if (d.clients[i].fd == -1)
+                continue;
+            polled[nclients++] = &d.clients[i];
+            fds[n].fd = d.clients[i].fd;
+            fds[n++].events = POLLIN;
+        }
+        n += nxtusb_watch_pollfds(fds + n, USB_POLLFDS);
+
+        /* Bricks plugged in during the jobs are still to be reported */
+        if (poll(fds, n, nxtusb_watch_pending() ? 0 : -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        for (i = 0; i < nclients; i++)
+            if (fds[1 + i].revents != 0)
+                client_read(&d, polled[i]);
+        if (fds[0].revents & POLLIN)
+            client_accept(&d);
+        if (nxtusb_watch_events(&luerr) != NXERR_SUCCESS)
+            fprintf(stderr, "USB events: %d\n", luerr);
+    }
+
+    jobs_fail(&d, NULL, "daemon stopped");
+    nxtusb_unwatch();
+    while (d.bricks != NULL)
+        brick_free(&d, d.bricks);
+    for (i = 0; i < DAEMON_CACHE; i++)
+        if (d.cache[i].path != NULL)
+            cache_drop(&d.cache[i]);
+    for (i = 0; i < DAEMON_CLIENTS; i++)
+        if (d.clients[i].fd != -1)
+            close(d.clients[i].fd);
+    close(d.fd);
+    unlink(sockpath);
+    return 0;
+}
+
+int daemon_submit(const char *sockpath, const char *filename)
+{
+    struct sockaddr_un addr;
+    char path[PATH_MAX], line[DAEMON_LINE];
+    ssize_t n;
+    size_t len;
+    int fd;
+
+    /* The daemon runs elsewhere */
+    if (realpath(filename, path) == NULL) {
+        perror(filename);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", sockpath);
+        return 1;
+    }
+    strcpy(addr.sun_path, sockpath);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(sockpath);
+        if (fd != -1)
+            close(fd);
+        return 1;
+    }
+
+    dprintf(fd, "flash %s\n", path);
+    len = 0;
+    while (len < sizeof(line) - 1 &&
+           (n = read(fd, line + len, sizeof(line) - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    line[len] = '\0';
+    fputs(line, stdout);
+    return strncmp(line, "ok", 2) == 0 ? 0 : 1;
+}
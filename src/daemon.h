@@ -0,0 +1,33 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include "flash.h"
+
+/* Flashing daemon. Bricks are opened as soon as they are plugged in and
+ * kept open, and flash jobs come from local clients on a Unix socket,
+ * one request line per connection:
+ *
+ *   flash PATH [BRICK]   flashes the ELF file at PATH on the named brick,
+ *                        or on the first one available
+ *   list                 lists the connected bricks
+ *
+ * Each request gets a single reply line starting with "ok" or "error".
+ * Jobs are run in order as their brick becomes available. With a default
+ * image, every brick plugged in gets flashed with it.
+ *
+ * Images are kept prepared in memory, up to DAEMON_CACHE of them, and
+ * prepared again when their file changes. */
+#define DAEMON_CACHE 8
+#define DAEMON_CLIENTS 32
+#define DAEMON_LINE 512
+
+/* Serves requests on the socket at sockpath until interrupted. Returns
+ * the exit status. */
+int daemon_run(const char *sockpath, const char *autoflash,
+               const struct settings *set);
+
+/* Queues the flash of the ELF file on the daemon at sockpath and waits
+ * for the outcome. Returns the exit status. */
+int daemon_submit(const char *sockpath, const char *filename);
+
+#endif /* __DAEMON_H__ */
@@ -0,0 +1,429 @@
+#include "flash.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include "NxtAccess/nxtmulti.h"
+#include "NxtAccess/nxtlz.h"
+#include "Loader/delta.h"
+#include "Loader/verify.h"
+#include "Loader/resume.h"
+#include "Loader/wirecache.h"
+
+/* Symbols defined by the guest image linker script */
+enum {
+    SYM_ACTIVATION = 0,
+    SYM_DATA,
+    SYM_BSS,
+    SYM_STACKS,
+    SYM_VECTOR,
+    SYM_COUNT
+};
+
+static const char *act_symbols[SYM_COUNT] = {
+    [SYM_ACTIVATION] = "_start",
+    [SYM_DATA] = "__data_start__",
+    [SYM_BSS] = "__bss_start__",
+    [SYM_STACKS] = "__stack_start__",
+    [SYM_VECTOR] = "__vectors_start__"
+};
+
+/* Copies the content of the file at the symbol address */
+static
+bool symbol_content(Elf elf, Elf32_Sym *sym, void *dst, size_t len)
+{
+    Elf32_Shdr *shdr;
+    void *cont;
+    size_t size, offset;
+
+    shdr = elf_section_at(elf, sym->st_shndx);
+    if (shdr == NULL || shdr->sh_type == SHT_NOBITS)
+        return false;
+    elf_section_content(elf, shdr, &cont, &size);
+    offset = sym->st_value - shdr->sh_addr;
+    if (offset > size || size - offset < len)
+        return false;
+    memcpy(dst, (uint8_t *)cont + offset, len);
+    return true;
+}
+
+/* Builds the activation record from the image symbols, with a single
+ * scan of the symbol table */
+static
+bool build_act_rec(Elf elf, struct act_rec *rec)
+{
+    Elf32_Sym *syms[SYM_COUNT];
+    int i;
+
+    if (elf_symbols_resolve(elf, act_symbols, SYM_COUNT, syms) != SYM_COUNT) {
+        for (i = 0; i < SYM_COUNT; i++)
+            if (syms[i] == NULL)
+                fprintf(stderr, "Missing symbol %s\n", act_symbols[i]);
+        return false;
+    }
+
+    rec->addr.activation = syms[SYM_ACTIVATION]->st_value;
+    rec->addr.sec_data = syms[SYM_DATA]->st_value;
+    rec->addr.sec_bss = syms[SYM_BSS]->st_value;
+    rec->addr.sec_stacks = syms[SYM_STACKS]->st_value;
+    if (!symbol_content(elf, syms[SYM_VECTOR], rec->vector, VECTOR_LEN)) {
+        fprintf(stderr, "Cannot read the interrupt vector\n");
+        return false;
+    }
+    return true;
+}
+
+/* Compressed image in memory */
+struct lz_buffer {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+static
+int lz_to_buffer(void *udata, const uint8_t *data, size_t len)
+{
+    struct lz_buffer *b = udata;
+
+    if (b->len + len > b->size) {
+        b->size = (b->len + len) * 2;
+        b->data = realloc(b->data, b->size);
+        assert(b->data != NULL);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/* Compressed image streamed to a device */
+struct lz_device {
+    nxtusb_t nxt;
+    int luerr;
+};
+
+static
+int lz_to_device(void *udata, const uint8_t *data, size_t len)
+{
+    struct lz_device *d = udata;
+
+    return nxtusb_frame_write(d->nxt, data, len, &d->luerr);
+}
+
+/* Sends the scatter list as a single frame. Segments go out straight
+ * from the file mapping, or through the compressor as it produces
+ * blocks. */
+static
+nxterr_t send_image(nxtusb_t nxt, const struct nxtspan *spans, size_t n,
+                    const struct settings *set, int *luerr)
+{
+    struct lz_device d;
+    nxterr_t err;
+
+    if (!set->compress)
+        return nxtusb_send_spans(nxt, spans, n, set->framing, luerr);
+
+    d.nxt = nxt;
+    d.luerr = 0;
+    nxtusb_frame_begin(nxt, set->framing);
+    if ((err = nxtlz_compress(spans, n, 0, lz_to_device,
+                              &d)) != NXERR_SUCCESS) {
+        *luerr = d.luerr;
+        return err;
+    }
+    return nxtusb_frame_end(nxt, luerr);
+}
+
+/* Manifest file of the device, in the delta directory. Named after the
+ * device identity, since another brick may take its bus address later:
+ * NULL if the device has none. */
+static
+char *manifest_path(const char *dir, nxtusb_t nxt)
+{
+    const char *id = nxtusb_id(nxt);
+    char *path, *c;
+
+    if (id == NULL || asprintf(&path, "%s/%s.manifest", dir, id) == -1)
+        return NULL;
+    for (c = path + strlen(dir) + 1; *c != '\0'; c++)
+        if (!isalnum((unsigned char)*c) && *c != '.' && *c != '-')
+            *c = '_';
+    return path;
+}
+
+/* Sends the image block-wise: only the blocks changed since the last
+ * upload in delta mode, verifying each of them in verify and resume
+ * modes. The new manifest is recorded once the upload succeeded. */
+static
+nxterr_t send_blocks(nxtusb_t nxt, const struct image *img,
+                     const struct settings *set, int *luerr)
+{
+    struct manifest cur, old;
+    struct verify_report r;
+    struct resume_report rr;
+    struct delta d;
+    uint32_t *blocks;
+    size_t n, failed;
+    bool have_old, done;
+    char *path;
+    nxterr_t err;
+
+    path = set->delta != NULL ? manifest_path(set->delta, nxt) : NULL;
+    if (set->delta != NULL && nxtusb_id(nxt) == NULL)
+        printf("%s: no serial number, sending every block\n",
+               nxtusb_name(nxt));
+    manifest_build(&cur, img);
+    have_old = path != NULL && manifest_load(&old, path);
+
+    if (set->verify || set->resume) {
+        blocks = malloc((cur.nblocks + 1) * sizeof(uint32_t));
+        assert(blocks != NULL);
+        n = delta_changed(&cur, have_old ? &old : NULL, blocks);
+        printf("%s: %zu of %u blocks to send\n", nxtusb_name(nxt), n,
+               cur.nblocks);
+        if (set->resume) {
+            err = resume_send(nxt, img, blocks, n, set->framing, &rr, luerr);
+            printf("%s: %zu blocks acknowledged, %zu found on resume, "
+                   "%zu resent, %zu failed, %u reconnections\n",
+                   nxtusb_name(nxt), rr.blocks, rr.held, rr.resent,
+                   rr.failed, rr.reconnects);
+            failed = rr.failed;
+        } else {
+            err = verify_send(nxt, img, blocks, n, set->framing, &r, luerr);
+            printf("%s: %zu blocks verified, %zu resent, %zu failed\n",
+                   nxtusb_name(nxt), r.blocks, r.resent, r.failed);
+            failed = r.failed;
+        }
+        done = err == NXERR_SUCCESS && failed == 0;
+        free(blocks);
+    } else {
+        delta_build(&d, img, &cur, have_old ? &old : NULL);
+        printf("%s: %zu of %u blocks changed, %zu bytes\n",
+               nxtusb_name(nxt), d.changed, cur.nblocks, d.bytes);
+        err = send_image(nxt, d.spans, d.nspans, set, luerr);
+        done = err == NXERR_SUCCESS;
+        delta_release(&d);
+    }
+
+    if (done && set->delta != NULL && nxtusb_id(nxt) != NULL &&
+        (path == NULL || !manifest_store(&cur, path)))
+        fprintf(stderr, "%s: cannot store the manifest\n", nxtusb_name(nxt));
+
+    if (have_old)
+        manifest_release(&old);
+    manifest_release(&cur);
+    free(path);
+    return err;
+}
+
+bool prepared_load(struct prepared *p, const char *filename)
+{
+    memset(p, 0, sizeof(struct prepared));
+    p->elf = elf_map_file(filename);
+    if (p->elf == NULL || !elf_check_format(p->elf)) {
+        fprintf(stderr, "%s: invalid ELF file\n", filename);
+        goto fail;
+    }
+    if (!build_act_rec(p->elf, &p->rec))
+        goto fail;
+    if (!image_from_elf(&p->img, p->elf)) {
+        fprintf(stderr, "%s: no loadable segments\n", filename);
+        goto fail;
+    }
+    p->hash = elf_content_hash(p->elf);
+    return true;
+
+  fail:
+    elf_release_file(p->elf);
+    p->elf = NULL;
+    return false;
+}
+
+void prepared_pack(struct prepared *p)
+{
+    struct lz_buffer lz;
+
+    memset(&lz, 0, sizeof(lz));
+    nxtlz_compress(p->img.spans, p->img.nspans, 0, lz_to_buffer, &lz);
+    p->packed.data = lz.data;
+    p->packed.len = lz.len;
+}
+
+void prepared_release(struct prepared *p)
+{
+    free((void *)p->packed.data);
+    image_release(&p->img);
+    elf_release_file(p->elf);
+}
+
+/* Upload stream of the image, activation record included, mapped from
+ * the cache. On a miss the stream is encoded and stored first. The
+ * record is the head of the stream, to be sent as its own transfer as
+ * on uncached uploads. */
+static
+bool stream_get(struct wire *w, const struct prepared *p,
+                const struct settings *set)
+{
+    struct wire_key key;
+    struct nxtspan stream[2], packed;
+    struct lz_buffer lz;
+    uint8_t *wire;
+    size_t wire_len;
+    bool ok;
+
+    key.hash = p->hash;
+    key.framing = set->framing;
+    key.compressed = set->compress;
+    if (wirecache_open(w, set->cache, &key))
+        return true;
+
+    memset(&lz, 0, sizeof(lz));
+    packed = p->packed;
+    if (set->compress && packed.data == NULL) {
+        nxtlz_compress(p->img.spans, p->img.nspans, 0, lz_to_buffer, &lz);
+        packed.data = lz.data;
+        packed.len = lz.len;
+    }
+    if (set->compress)
+        wire = nxtmulti_prepare_spans(&packed, 1, set->framing, &wire_len);
+    else
+        wire = nxtmulti_prepare_spans(p->img.spans, p->img.nspans,
+                                      set->framing, &wire_len);
+    free(lz.data);
+
+    stream[0].data = &p->rec;
+    stream[0].len = sizeof(struct act_rec);
+    stream[1].data = wire;
+    stream[1].len = wire_len;
+    ok = wirecache_store(set->cache, &key, stream, 2, stream[0].len,
+                         WIRECACHE_LIMIT) &&
+         wirecache_open(w, set->cache, &key);
+    free(wire);
+    return ok;
+}
+
+nxterr_t flash_one(nxtusb_t nxt, const struct prepared *p,
+                   const struct settings *set, int *luerr)
+{
+    struct nxtspan span;
+    struct wire w;
+    nxterr_t err;
+
+    if (set->xfer_len != 0)
+        nxtusb_set_xfer_len(nxt, set->xfer_len);
+    nxtusb_set_pipelined(nxt, set->pipeline);
+    if (set->cache != NULL && set->delta == NULL && !set->verify &&
+        !set->resume && stream_get(&w, p, set)) {
+        err = nxtusb_send(nxt, (void *)w.data, w.head, luerr);
+        if (err == NXERR_SUCCESS)
+            err = nxtusb_send(nxt, (void *)(w.data + w.head),
+                              w.len - w.head, luerr);
+        wirecache_release(&w);
+        return err;
+    }
+    if (set->verify || set->resume) {
+        /* Framed on its own, so that records start with a frame */
+        span.data = &p->rec;
+        span.len = sizeof(struct act_rec);
+        err = nxtusb_send_spans(nxt, &span, 1, set->framing, luerr);
+    } else {
+        err = nxtusb_send(nxt, (void *) &p->rec, sizeof(struct act_rec),
+                          luerr);
+    }
+    if (err != NXERR_SUCCESS)
+        return err;
+
+    if (set->delta != NULL || set->verify || set->resume)
+        return send_blocks(nxt, &p->img, set, luerr);
+    if (set->compress && p->packed.data != NULL)
+        return nxtusb_send_spans(nxt, &p->packed, 1, set->framing, luerr);
+    return send_image(nxt, p->img.spans, p->img.nspans, set, luerr);
+}
+
+/* Sends the image to the bricks which got the activation record, adding
+ * up the outcome to their reports. Returns how many completed both. */
+static size_t send_rest(nxtusb_t *nxts, size_t n, const uint8_t *wire,
+                        size_t wire_len, struct nxtmulti_report *reports)
+{
+    struct nxtmulti_report *r;
+    nxtusb_t *ok;
+    size_t *pos;
+    size_t i, m, done;
+
+    ok = malloc(n * sizeof(nxtusb_t));
+    pos = malloc(n * sizeof(size_t));
+    r = calloc(n, sizeof(struct nxtmulti_report));
+    assert(ok != NULL && pos != NULL && r != NULL);
+    for (i = 0, m = 0; i < n; i++) {
+        if (reports[i].err == NXERR_SUCCESS) {
+            ok[m] = nxts[i];
+            pos[m++] = i;
+        }
+    }
+    done = m > 0 ? nxtmulti_send(ok, m, wire, wire_len, 0, r, NULL, NULL)
+                 : 0;
+    for (i = 0; i < m; i++) {
+        reports[pos[i]].err = r[i].err;
+        reports[pos[i]].libusb_err = r[i].libusb_err;
+        reports[pos[i]].sent += r[i].sent;
+        reports[pos[i]].seconds += r[i].seconds;
+    }
+    free(ok);
+    free(pos);
+    free(r);
+    return done;
+}
+
+/* The image is encoded once and shared by all the uploads */
+int flash_all(struct prepared *p, const struct settings *set)
+{
+    nxtusb_t *nxts;
+    struct nxtmulti_report *reports;
+    struct wire w;
+    uint8_t *wire;
+    size_t n, i, done, wire_len;
+    nxterr_t err;
+    int luerr;
+
+    if ((err = nxtusb_new_all(&nxts, &n, &luerr)) != NXERR_SUCCESS) {
+        printf("%s\n", nxtusb_geterr(err));
+        return 1;
+    }
+    if (set->xfer_len != 0)
+        for (i = 0; i < n; i++)
+            nxtusb_set_xfer_len(nxts[i], set->xfer_len);
+    reports = calloc(n, sizeof(struct nxtmulti_report));
+    assert(reports != NULL);
+    if (set->cache != NULL && stream_get(&w, p, set)) {
+        nxtmulti_send(nxts, n, w.data, w.head, 0, reports, NULL, NULL);
+        done = send_rest(nxts, n, w.data + w.head, w.len - w.head, reports);
+        wirecache_release(&w);
+        goto report;
+    }
+    nxtmulti_send(nxts, n, (uint8_t *)&p->rec, sizeof(struct act_rec), 0,
+                  reports, NULL, NULL);
+    if (set->compress) {
+        if (p->packed.data == NULL)
+            prepared_pack(p);
+        wire = nxtmulti_prepare_spans(&p->packed, 1, set->framing,
+                                      &wire_len);
+    } else {
+        wire = nxtmulti_prepare_spans(p->img.spans, p->img.nspans,
+                                      set->framing, &wire_len);
+    }
+    done = send_rest(nxts, n, wire, wire_len, reports);
+    free(wire);
+
+  report:
+    for (i = 0; i < n; i++) {
+        printf("%s: %s, %zu bytes in %.3f s\n", nxtusb_name(nxts[i]),
+               nxtusb_geterr(reports[i].err), reports[i].sent,
+               reports[i].seconds);
+        if (set->stats)
+            nxtstats_print(nxtusb_stats(nxts[i]), stdout);
+    }
+    printf("%zu of %zu bricks flashed\n", done, n);
+    free(reports);
+    nxtusb_free_all(nxts, n);
+    return done == n ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#ifndef __FLASH_H__
+#define __FLASH_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "NxtAccess/nxtusb.h"
+#include "ElfSword/elf.h"
+#include "Loader/image.h"
+
+#define VECTOR_LEN 32
+struct act_rec {
+    uint8_t vector[VECTOR_LEN];  /* Guest interrupt vector, to load at RAM init */
+    struct {
+        uint32_t activation;     /* Guest activation address */
+        uint32_t sec_data;       /* Section .data */
+        uint32_t sec_bss;        /* Section .bss */
+        uint32_t sec_stacks;     /* Modes stacks */
+    } addr;
+};
+
+/* Transfer settings from the command line */
+struct settings {
+    size_t xfer_len;             /* Bulk transfer size, 0 for default */
+    nxtframe_t framing;          /* Image framing */
+    bool compress;               /* Compress the image */
+    bool pipeline;               /* Encode while sending */
+    char *delta;                 /* Manifest directory, for delta mode */
+    bool verify;                 /* Read back block checksums */
+    bool resume;                 /* Resumable, acknowledged upload */
+    bool stats;                  /* Print transfer statistics */
+    char *cache;                 /* Stream cache directory, if any */
+};
+
+/* Guest image ready to be flashed */
+struct prepared {
+    Elf elf;                     /* ELF mapping */
+    struct act_rec rec;          /* Activation record */
+    struct image img;            /* Memory image */
+    struct nxtspan packed;       /* Compressed image (data NULL if none) */
+    uint64_t hash;               /* ELF content hash */
+};
+
+/* Maps and checks the ELF file, building its activation record and its
+ * image. Problems are reported on stderr. */
+bool prepared_load(struct prepared *p, const char *filename);
+
+/* Compresses the image once, for repeated uploads */
+void prepared_pack(struct prepared *p);
+
+void prepared_release(struct prepared *p);
+
+/* Sends the activation record and the image to a device, as the
+ * settings say. With a cache directory, plain uploads are sent from the
+ * stream cache, and encoded in it on a miss. */
+nxterr_t flash_one(nxtusb_t nxt, const struct prepared *p,
+                   const struct settings *set, int *luerr);
+
+/* Sends the activation record and the image to every connected brick at
+ * once. Returns the exit status. */
+int flash_all(struct prepared *p, const struct settings *set);
+
+#endif /* __FLASH_H__ */
@@ -1,36 +1,257 @@
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "NxtAccess/nxtusb.h"
+#include "flash.h"
+#include "daemon.h"
+#include "batch.h"
 
-#define VECTOR_LEN 32
-struct act_rec {
-    uint8_t vector[VECTOR_LEN];  /* Guest interrupt vector, to load at RAM init */
-    struct {
-        uint32_t activation;     /* Guest activation address */
-        uint32_t sec_data;       /* Section .data */
-        uint32_t sec_bss;        /* Section .bss */
-        uint32_t sec_stacks;     /* Modes stacks */
-    } addr;
+/* Default directory for manifests and cached streams, created if
+ * missing */
+static
+char *cache_dir(void)
+{
+    const char *home = getenv("HOME");
+    char *dir;
+
+    if (home == NULL || asprintf(&dir, "%s/.cache", home) == -1)
+        return NULL;
+    mkdir(dir, 0755);
+    free(dir);
+    if (asprintf(&dir, "%s/.cache/boatlooder", home) == -1)
+        return NULL;
+    mkdir(dir, 0755);
+    return dir;
+}
+
+static const struct option options[] = {
+    {"all", no_argument, NULL, 'a'},
+    {"sim", no_argument, NULL, 's'},
+    {"sink", required_argument, NULL, 'o'},
+    {"stats", no_argument, NULL, 'S'},
+    {"xfer-size", required_argument, NULL, 'x'},
+    {"framing", required_argument, NULL, 'f'},
+    {"compress", no_argument, NULL, 'z'},
+    {"pipeline", no_argument, NULL, 'P'},
+    {"delta", optional_argument, NULL, 'd'},
+    {"verify", no_argument, NULL, 'V'},
+    {"resume", no_argument, NULL, 'r'},
+    {"daemon", required_argument, NULL, 'D'},
+    {"queue", required_argument, NULL, 'q'},
+    {"cache", optional_argument, NULL, 'c'},
+    {"batch", required_argument, NULL, 'b'},
+    {"jobs", required_argument, NULL, 'j'},
+    {NULL, 0, NULL, 0}
 };
 
+static
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] <image.elf>\n"
+                    "       %s [options] -D SOCKET [default.elf]\n"
+                    "       %s -b LIST [-j N] [name...]\n"
+                    "  -a, --all          flash every connected NXT\n"
+                    "  -s, --sim          use a simulated NXT\n"
+                    "  -o, --sink=FILE    write the stream to FILE\n"
+                    "  -S, --stats        print transfer statistics\n"
+                    "  -x, --xfer-size=N  submit bulk transfers of N bytes\n"
+                    "  -f, --framing=F    image framing: esc (default), cobs\n"
+                    "  -z, --compress     compress the image\n"
+                    "  -P, --pipeline     encode the image while sending it\n"
+                    "  -d, --delta[=DIR]  send only the blocks changed since\n"
+                    "                     the last upload (manifests in DIR)\n"
+                    "  -V, --verify       read back and check every block\n"
+                    "  -r, --resume       acknowledged upload, resumed after\n"
+                    "                     link failures\n"
+                    "  -c, --cache[=DIR]  send encoded streams from a cache\n"
+                    "                     in DIR\n"
+                    "  -D, --daemon=SOCK  serve flash jobs on SOCK\n"
+                    "  -q, --queue=SOCK   flash through the daemon on SOCK\n"
+                    "  -b, --batch=LIST   check the ELF files in LIST (a\n"
+                    "                     directory or a list of paths) and\n"
+                    "                     look up the given symbols and\n"
+                    "                     .sections\n"
+                    "  -j, --jobs=N       batch worker threads (default: one\n"
+                    "                     per core)\n",
+            prog, prog, prog);
+}
+
 int main(int argc, char **argv)
 {
     nxtusb_t nxt;
     nxterr_t err;
     int luerr;
-    struct act_rec rec;
-    
-    err = nxtusb_new(&nxt, &luerr);
+    struct prepared p;
+    struct nxtsim_params simp;
+    struct settings set;
+    bool sim = false, all = false;
+    const char *sink = NULL, *daemon = NULL, *queue = NULL, *batch = NULL;
+    unsigned jobs = 0;
+    int opt, fd = -1;
+
+    memset(&set, 0, sizeof(set));
+    set.framing = NXTFRAME_ESC;
+
+    while ((opt = getopt_long(argc, argv, "aso:Sx:f:zPd::VrD:q:c::b:j:", options,
+                              NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                all = true;
+                break;
+            case 's':
+                sim = true;
+                break;
+            case 'o':
+                sink = optarg;
+                break;
+            case 'S':
+                set.stats = true;
+                break;
+            case 'x':
+                set.xfer_len = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                set.compress = true;
+                break;
+            case 'P':
+                set.pipeline = true;
+                break;
+            case 'V':
+                set.verify = true;
+                break;
+            case 'r':
+                set.resume = true;
+                break;
+            case 'D':
+                daemon = optarg;
+                break;
+            case 'q':
+                queue = optarg;
+                break;
+            case 'b':
+                batch = optarg;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                free(set.delta);
+                set.delta = optarg != NULL ? strdup(optarg) : cache_dir();
+                if (set.delta == NULL) {
+                    fprintf(stderr, "No manifest directory\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                free(set.cache);
+                set.cache = optarg != NULL ? strdup(optarg) : cache_dir();
+                if (set.cache == NULL) {
+                    fprintf(stderr, "No cache directory\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "esc") == 0) {
+                    set.framing = NXTFRAME_ESC;
+                } else if (strcmp(optarg, "cobs") == 0) {
+                    set.framing = NXTFRAME_COBS;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if ((set.verify || set.resume) && set.compress) {
+        fprintf(stderr, "Verified uploads can't be compressed\n");
+        free(set.delta);
+        free(set.cache);
+        return 1;
+    }
+    if (daemon != NULL) {
+        opt = daemon_run(daemon, optind < argc ? argv[optind] : NULL, &set);
+        free(set.delta);
+        free(set.cache);
+        return opt;
+    }
+    if (batch != NULL) {
+        free(set.delta);
+        free(set.cache);
+        return batch_run(batch, argv + optind, argc - optind, jobs);
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (queue != NULL)
+        return daemon_submit(queue, argv[optind]);
+    if (!prepared_load(&p, argv[optind]))
+        return 1;
+
+    if (all) {
+        if (set.delta != NULL || set.verify || set.resume) {
+            /* Each brick would need its own stream */
+            fprintf(stderr, "Delta, verify and resume modes work on a "
+                            "single device\n");
+            opt = 1;
+        } else {
+            opt = flash_all(&p, &set);
+        }
+        free(set.delta);
+        free(set.cache);
+        prepared_release(&p);
+        return opt;
+    }
+
+    if (sim) {
+        memset(&simp, 0, sizeof(simp));
+        simp.framing = set.framing;
+        simp.compressed = set.compress;
+        simp.verify = set.verify;
+        simp.resume = set.resume;
+        /* Sent framed on its own in these modes (see flash_one) */
+        if (!set.verify && !set.resume)
+            simp.record_len = sizeof(struct act_rec);
+        err = nxtusb_new_sim(&nxt, &simp);
+    } else if (sink != NULL) {
+        fd = strcmp(sink, "-") == 0
+             ? STDOUT_FILENO
+             : open(sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(sink);
+            prepared_release(&p);
+            return 1;
+        }
+        err = nxtusb_new_sink(&nxt, fd, false);
+    } else {
+        err = nxtusb_new(&nxt, &luerr);
+    }
     if (err != NXERR_SUCCESS) {
         printf("%s\n", nxtusb_geterr(err));
     } else {
-        rec.addr.activation = 1;
-        rec.addr.sec_data = 2;
-        rec.addr.sec_bss = 3;
-        rec.addr.sec_stacks = 4;
-        nxtusb_send(nxt, (void *) &rec, sizeof(struct act_rec), &luerr);
+        err = flash_one(nxt, &p, &set, &luerr);
+        if (err != NXERR_SUCCESS)
+            printf("%s\n", nxtusb_geterr(err));
+        if (set.stats) {
+            /* The stream may go to stdout */
+            fprintf(stderr, "%s, transfers of %zu bytes:\n", nxtusb_name(nxt),
+                    nxtusb_get_xfer_len(nxt));
+            nxtstats_print(nxtusb_stats(nxt), stderr);
+        }
     }
     nxtusb_free(nxt);
+    if (fd > STDOUT_FILENO)
+        close(fd);
+    prepared_release(&p);
+    free(set.delta);
+    free(set.cache);
     return 0;
 }
@@ -0,0 +1,150 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "../batch.h"
+#include "../NxtAccess/nxtstats.h"
+
+/* Batch runs over a directory must print the same lines in input
+ * order whatever the number of workers. ELF files sort first, so that
+ * the workers owning the cheap files have to steal from the others. */
+
+#define NELF 120
+#define NOTHER 180
+
+/* Shared object in the native layout, built from data/hashes.c */
+#define FIXTURE "tests/data/hashes.elf"
+
+static char *slurp(FILE *f, size_t *len)
+{
+    char *buf;
+
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    buf = malloc(*len + 1);
+    CHECK(buf != NULL);
+    CHECK(fread(buf, 1, *len, f) == *len);
+    buf[*len] = '\0';
+    return buf;
+}
+
+static void put_file(const char *dir, const char *name, const void *data,
+                     size_t len)
+{
+    char path[256];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    CHECK(f != NULL);
+    CHECK(fwrite(data, 1, len, f) == len);
+    fclose(f);
+}
+
+/* Standard output of a batch run */
+static char *run(const char *dir, unsigned nthreads, int *status,
+                 uint64_t *ns)
+{
+    static char *names[] = { "fn_100", ".text", "no_such_symbol" };
+    uint64_t start;
+    size_t len;
+    char *out;
+    FILE *f;
+    int fd;
+
+    f = tmpfile();
+    CHECK(f != NULL);
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    CHECK(fd != -1 && dup2(fileno(f), STDOUT_FILENO) != -1);
+    start = nxtstats_now();
+    *status = batch_run(dir, names, 3, nthreads);
+    *ns = nxtstats_now() - start;
+    fflush(stdout);
+    CHECK(dup2(fd, STDOUT_FILENO) != -1);
+    close(fd);
+    out = slurp(f, &len);
+    fclose(f);
+    return out;
+}
+
+static void check_lines(const char *dir, const char *out)
+{
+    static const char missing[] = " no_such_symbol=-";
+    const char *line, *end;
+    char prefix[256];
+    unsigned i;
+
+    for (i = 0, line = out; i < NELF + NOTHER; i ++, line = end + 1) {
+        end = strchr(line, '\n');
+        CHECK(end != NULL);
+        if (i < NELF) {
+            snprintf(prefix, sizeof(prefix), "%s/a%03u: ok fn_100=0x", dir,
+                     i);
+            CHECK((size_t)(end - line) > strlen(missing));
+            CHECK(memcmp(end - strlen(missing), missing,
+                         strlen(missing)) == 0);
+        } else {
+            snprintf(prefix, sizeof(prefix), "%s/b%03u: error ", dir,
+                     i - NELF);
+        }
+        CHECK(strncmp(line, prefix, strlen(prefix)) == 0);
+    }
+    CHECK(*line == '\0');
+}
+
+int main(void)
+{
+    static const unsigned nthreads[] = { 2, 3, 8, 0 };
+    char dir[] = "/tmp/batchXXXXXX", name[16], path[256];
+    char *elf, *ref, *out;
+    unsigned i;
+    uint64_t ns;
+    size_t len;
+    int status;
+    FILE *f;
+
+    CHECK(mkdtemp(dir) != NULL);
+    f = fopen(FIXTURE, "r");
+    CHECK(f != NULL);
+    elf = slurp(f, &len);
+    fclose(f);
+    for (i = 0; i < NELF; i ++) {
+        snprintf(name, sizeof(name), "a%03u", i);
+        put_file(dir, name, elf, len);
+    }
+    for (i = 0; i < NOTHER; i ++) {
+        snprintf(name, sizeof(name), "b%03u", i);
+        put_file(dir, name, "not an ELF file\n", 16);
+    }
+
+    ref = run(dir, 1, &status, &ns);
+    CHECK(status != 0);
+    check_lines(dir, ref);
+    printf("batch: %.0f files/s with one worker", (NELF + NOTHER) * 1e9 / ns);
+    for (i = 0; i < sizeof(nthreads) / sizeof(nthreads[0]); i ++) {
+        out = run(dir, nthreads[i], &status, &ns);
+        CHECK(status != 0);
+        CHECK(strcmp(out, ref) == 0);
+        free(out);
+    }
+    printf(", %.0f with one per core\n", (NELF + NOTHER) * 1e9 / ns);
+
+    for (i = 0; i < NELF; i ++) {
+        snprintf(path, sizeof(path), "%s/a%03u", dir, i);
+        unlink(path);
+    }
+    for (i = 0; i < NOTHER; i ++) {
+        snprintf(path, sizeof(path), "%s/b%03u", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    free(ref);
+    free(elf);
+    return EXIT_SUCCESS;
+}
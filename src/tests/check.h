@@ -0,0 +1,18 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Minimal test support: each test is a program run by "make check",
+ * failing with the first unmet condition */
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            exit(EXIT_FAILURE);                                         \
+        }                                                               \
+    } while (0)
+
+#endif /* __CHECK_H__ */
@@ -0,0 +1,24 @@
+/* Symbol lookup fixture for the hindex test: a 32-bit shared object in
+ * the native layout, with exported functions and objects, and local
+ * symbols only listed in .symtab. Built with:
+ *
+ *   gcc -m32 -O -fPIC -c hashes.c
+ *   ld -m elf_i386 -shared --hash-style=both -o hashes.elf hashes.o
+ *   ld -m elf_i386 -shared --hash-style=sysv -o hashes-sysv.elf hashes.o
+ */
+
+#define FN(n) int fn_##n(int x) { return x + n; }
+#define OBJ(n) int obj_##n = n; static int local_##n = n; \
+               int *ref_##n(void) { return &local_##n; }
+
+#define FN8(n) FN(n##0) FN(n##1) FN(n##2) FN(n##3) \
+               FN(n##4) FN(n##5) FN(n##6) FN(n##7)
+#define FN64(n) FN8(n##0) FN8(n##1) FN8(n##2) FN8(n##3) \
+                FN8(n##4) FN8(n##5) FN8(n##6) FN8(n##7)
+#define OBJ8(n) OBJ(n##0) OBJ(n##1) OBJ(n##2) OBJ(n##3) \
+                OBJ(n##4) OBJ(n##5) OBJ(n##6) OBJ(n##7)
+
+FN64(1) FN64(2) FN64(3) FN64(4)
+OBJ8(1) OBJ8(2) OBJ8(3) OBJ8(4)
+
+__attribute__((visibility("hidden"))) int hidden_fn(void) { return 0; }
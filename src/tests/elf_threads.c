@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "check.h"
+#include "../ElfSword/elf.h"
+
+/* Threads sharing an Elf object race on the first use of its lazily
+ * built indexes. Built with the thread sanitizer, which makes the test
+ * fail on any data race; the results must also match those of an
+ * object used by a single thread. */
+
+#define NTHREADS 8
+#define NROUNDS 10
+
+/* Shared object in the native layout, built from data/hashes.c */
+#define FIXTURE "tests/data/hashes.elf"
+
+struct syms {
+    const char **names;
+    Elf32_Addr *addrs;
+    Elf32_Sym **by_name;        /* Expected results */
+    Elf32_Sym **by_addr;
+    size_t n;
+};
+
+struct worker {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    const struct syms *syms;
+    Elf ref, elf;
+    unsigned id;
+};
+
+static bool collect(void *udata, Elf elf, Elf32_Shdr *shdr,
+                    Elf32_Sym *yhdr)
+{
+    struct syms *s = udata;
+    const char *name = elf_symbol_name(elf, shdr, yhdr);
+
+    if (name != NULL && name[0] != '\0') {
+        s->names[s->n] = name;
+        s->addrs[s->n] = yhdr->st_value;
+        s->n ++;
+    }
+    return true;
+}
+
+/* Symbols found in elf, as offsets in the mapping of ref */
+static Elf32_Sym *rebase(Elf elf, Elf ref, Elf32_Sym *sym)
+{
+    if (sym == NULL)
+        return NULL;
+    return (Elf32_Sym *)(elf_get_content(ref) +
+                         ((const uint8_t *)sym - elf_get_content(elf)));
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    const struct syms *s = w->syms;
+    size_t i, k;
+
+    pthread_barrier_wait(w->start);
+    /* Each thread starts from a different symbol, half of them with the
+     * address lookups */
+    for (k = 0; k < s->n; k ++) {
+        i = (k + w->id * s->n / NTHREADS) % s->n;
+        if (w->id % 2 == 0) {
+            CHECK(rebase(w->elf, w->ref,
+                         elf_symbol_get(w->elf, s->names[i])) ==
+                  s->by_name[i]);
+            CHECK(rebase(w->elf, w->ref,
+                         elf_symbol_at(w->elf, s->addrs[i])) ==
+                  s->by_addr[i]);
+        } else {
+            CHECK(rebase(w->elf, w->ref,
+                         elf_symbol_at(w->elf, s->addrs[i])) ==
+                  s->by_addr[i]);
+            CHECK(rebase(w->elf, w->ref,
+                         elf_symbol_get(w->elf, s->names[i])) ==
+                  s->by_name[i]);
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    struct worker workers[NTHREADS];
+    pthread_barrier_t start;
+    Elf32_Shdr *symtab;
+    struct syms s;
+    unsigned r, t;
+    size_t i, size;
+    void *cont;
+    Elf ref, elf;
+
+    ref = elf_map_file(FIXTURE);
+    CHECK(ref != NULL);
+    symtab = elf_section_get(ref, ".symtab");
+    CHECK(symtab != NULL);
+    elf_section_content(ref, symtab, &cont, &size);
+    size /= sizeof(Elf32_Sym);
+    s.names = malloc(size * sizeof(char *));
+    s.addrs = malloc(size * sizeof(Elf32_Addr));
+    s.by_name = malloc(size * sizeof(Elf32_Sym *));
+    s.by_addr = malloc(size * sizeof(Elf32_Sym *));
+    CHECK(s.names != NULL && s.addrs != NULL && s.by_name != NULL &&
+          s.by_addr != NULL);
+    s.n = 0;
+    CHECK(elf_symbols_scan(ref, symtab, collect, &s));
+    CHECK(s.n > 0);
+    for (i = 0; i < s.n; i ++) {
+        s.by_name[i] = elf_symbol_get(ref, s.names[i]);
+        s.by_addr[i] = elf_symbol_at(ref, s.addrs[i]);
+        CHECK(s.by_name[i] != NULL);
+    }
+
+    pthread_barrier_init(&start, NULL, NTHREADS);
+    for (r = 0; r < NROUNDS; r ++) {
+        /* All threads on the same fresh object */
+        elf = elf_map_file(FIXTURE);
+        CHECK(elf != NULL);
+        for (t = 0; t < NTHREADS; t ++) {
+            workers[t].start = &start;
+            workers[t].syms = &s;
+            workers[t].ref = ref;
+            workers[t].elf = elf;
+            workers[t].id = t;
+            CHECK(pthread_create(&workers[t].thread, NULL, worker,
+                                 &workers[t]) == 0);
+        }
+        for (t = 0; t < NTHREADS; t ++)
+            pthread_join(workers[t].thread, NULL);
+        elf_release_file(elf);
+    }
+    pthread_barrier_destroy(&start);
+    printf("elf_threads: %u threads, %zu symbols, %u rounds\n", NTHREADS,
+           s.n, NROUNDS);
+
+    free(s.names);
+    free(s.addrs);
+    free(s.by_name);
+    free(s.by_addr);
+    elf_release_file(ref);
+    return EXIT_SUCCESS;
+}
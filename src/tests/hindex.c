@@ -0,0 +1,156 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "check.h"
+#include "../ElfSword/elf.h"
+#include "../ElfSword/hindex.h"
+
+/* Hash index on synthetic entries, then symbol lookups on 32-bit shared
+ * objects through both engines */
+
+#define NENTRIES 1000
+#define NROUNDS 200
+
+static bool match_ndx(void *udata, uint32_t ndx)
+{
+    return ndx == *(uint32_t *)udata;
+}
+
+static void check_index(void)
+{
+    HIndex idx;
+    uint32_t i, want;
+
+    idx = hindex_new(NENTRIES);
+    /* Few distinct hashes, so that probes cross long collision runs */
+    for (i = 0; i < NENTRIES; i ++)
+        CHECK(hindex_insert(idx, i % 7, i));
+    CHECK(idx->count == NENTRIES);
+    for (i = 0; i < NENTRIES; i ++) {
+        want = i;
+        CHECK(hindex_find(idx, i % 7, match_ndx, &want) == i);
+    }
+    want = NENTRIES;
+    CHECK(hindex_find(idx, 3, match_ndx, &want) == HINDEX_NONE);
+    CHECK(hindex_find(idx, 8, match_ndx, &want) == HINDEX_NONE);
+
+    /* An index with no empty slot, as a corrupted cache may hold, must
+     * not make the lookup loop forever */
+    for (i = 0; i <= idx->mask; i ++) {
+        idx->slots[i].hash = 1;
+        idx->slots[i].ndx = i + 1;
+    }
+    want = HINDEX_NONE;
+    CHECK(hindex_find(idx, 2, match_ndx, &want) == HINDEX_NONE);
+    CHECK(hindex_find(idx, 1, match_ndx, &want) == HINDEX_NONE);
+    free(idx);
+}
+
+/* Symbol lookup fixtures, built from data/hashes.c */
+static const char *const fixtures[] = {
+    "tests/data/hashes.elf",        /* .hash and .gnu.hash */
+    "tests/data/hashes-sysv.elf"    /* .hash only */
+};
+
+struct lookup {
+    ElfLookup engine;
+    const char **names;         /* Names looked up, if collected */
+    size_t found;
+};
+
+/* Every named symbol defined in the table must be found by the engine,
+ * with its name */
+static bool check_symbol(void *udata, Elf elf, Elf32_Shdr *shdr,
+                         Elf32_Sym *yhdr)
+{
+    struct lookup *l = udata;
+    const char *name = elf_symbol_name(elf, shdr, yhdr);
+    Elf32_Sym *found;
+
+    if (name == NULL || name[0] == '\0' || yhdr->st_shndx == SHN_UNDEF)
+        return true;
+    found = elf_symbol_lookup(elf, name, l->engine);
+    CHECK(found != NULL);
+    CHECK(strcmp(elf_symbol_name(elf, shdr, found), name) == 0);
+    if (l->names != NULL)
+        l->names[l->found] = name;
+    l->found ++;
+    return true;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double time_engine(Elf elf, ElfLookup engine, const char **names,
+                          size_t n)
+{
+    uint64_t start;
+    unsigned r;
+    size_t i;
+
+    start = now();
+    for (r = 0; r < NROUNDS; r ++)
+        for (i = 0; i < n; i ++)
+            CHECK(elf_symbol_lookup(elf, names[i], engine) != NULL);
+    return (double)(now() - start) / NROUNDS / n;
+}
+
+static void check_symbols(const char *path)
+{
+    struct lookup l;
+    Elf32_Shdr *symtab, *dynsym;
+    double index_ns, embedded_ns;
+    size_t size;
+    void *cont;
+    Elf elf;
+
+    elf = elf_map_file(path);
+    CHECK(elf != NULL);
+    CHECK(elf_index_build(elf));
+    symtab = elf_section_get(elf, ".symtab");
+    dynsym = elf_section_get(elf, ".dynsym");
+    CHECK(symtab != NULL && dynsym != NULL);
+
+    l.engine = ELF_LOOKUP_INDEX;
+    l.names = NULL;
+    l.found = 0;
+    CHECK(elf_symbols_scan(elf, symtab, check_symbol, &l));
+    CHECK(l.found > 0);
+
+    /* The embedded hash section holds every exported symbol */
+    elf_section_content(elf, dynsym, &cont, &size);
+    l.engine = ELF_LOOKUP_EMBEDDED;
+    l.names = malloc(size / sizeof(Elf32_Sym) * sizeof(char *));
+    CHECK(l.names != NULL);
+    l.found = 0;
+    CHECK(elf_symbols_scan(elf, dynsym, check_symbol, &l));
+    CHECK(l.found > 0);
+
+    CHECK(elf_symbol_lookup(elf, "local_10", ELF_LOOKUP_EMBEDDED) == NULL);
+    CHECK(elf_symbol_lookup(elf, "local_10", ELF_LOOKUP_INDEX) != NULL);
+    CHECK(elf_symbol_get(elf, "no such symbol") == NULL);
+
+    index_ns = time_engine(elf, ELF_LOOKUP_INDEX, l.names, l.found);
+    embedded_ns = time_engine(elf, ELF_LOOKUP_EMBEDDED, l.names, l.found);
+    printf("hindex: %s, %zu symbols, %.1f ns per lookup, %.1f embedded\n",
+           path, l.found, index_ns, embedded_ns);
+    free(l.names);
+    elf_release_file(elf);
+}
+
+int main(void)
+{
+    size_t i;
+
+    check_index();
+    for (i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i ++)
+        check_symbols(fixtures[i]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "../NxtAccess/nxtcobs.h"
+#include "../NxtAccess/nxtstats.h"
+
+/* COBS frames of awkward payloads, encoded in chunks of any size and
+ * decoded back by the reference decoder */
+
+#define MAXLEN (200 * 1024)
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* Payload kinds: zeros, no zeros, runs around the group size, random
+ * bytes, text-like data with repetitions */
+static void fill(uint8_t *buf, size_t len, unsigned kind)
+{
+    size_t i;
+
+    for (i = 0; i < len; i ++) {
+        switch (kind) {
+            case 0: buf[i] = 0; break;
+            case 1: buf[i] = 1 + i % 255; break;
+            case 2: buf[i] = i % 254 == 253 ? 0 : 0xaa; break;
+            case 3: buf[i] = rnd(); break;
+            default: buf[i] = "abcd efgh\0"[rnd() % 4 + i % 7]; break;
+        }
+    }
+}
+
+static size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    struct nxtcobs_enc e;
+    size_t fill, n;
+
+    fill = nxtcobs_begin(&e, out, 0);
+    while (len > 0) {
+        n = rnd() % 600;
+        if (n > len)
+            n = len;
+        fill = nxtcobs_encode(&e, in, n, out, fill);
+        in += n;
+        len -= n;
+    }
+    return nxtcobs_end(&e, out, fill);
+}
+
+static size_t cobs_decode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    struct nxtcobs_dec d;
+    size_t used, got, n, o = 0;
+    int status = NXTCOBS_MORE;
+
+    nxtcobs_dec_init(&d);
+    while (len > 0) {
+        n = 1 + rnd() % 700;
+        if (n > len)
+            n = len;
+        used = nxtcobs_decode(&d, in, n, out + o, &got, &status);
+        CHECK(status != NXTCOBS_BROKEN);
+        o += got;
+        in += used;
+        len -= used;
+        if (status == NXTCOBS_FRAME)
+            break;
+    }
+    CHECK(status == NXTCOBS_FRAME && len == 0);
+    return o;
+}
+
+static void check_cobs(const uint8_t *in, size_t len, uint8_t *wire,
+                       uint8_t *out)
+{
+    size_t n;
+
+    n = cobs_encode(in, len, wire);
+    CHECK(n <= NXTCOBS_MAXLEN(len) + 1);
+    CHECK(memchr(wire, NXTCOBS_DELIM, n - 1) == NULL);
+    CHECK(cobs_decode(wire, n, out) == len);
+    CHECK(memcmp(in, out, len) == 0);
+}
+
+int main(void)
+{
+    static const size_t lens[] = {
+        0, 1, 253, 254, 255, 256, 508, 509, 4095, 4096, 4097
+    };
+    uint8_t *in, *wire, *out;
+    uint64_t start, ns;
+    size_t i, len;
+    unsigned kind;
+
+    in = malloc(MAXLEN);
+    wire = malloc(NXTCOBS_MAXLEN(MAXLEN) + 1);
+    out = malloc(MAXLEN);
+    CHECK(in != NULL && wire != NULL && out != NULL);
+
+    for (kind = 0; kind < 5; kind ++) {
+        for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i ++) {
+            fill(in, lens[i], kind);
+            check_cobs(in, lens[i], wire, out);
+        }
+        for (i = 0; i < 20; i ++) {
+            len = rnd() % MAXLEN;
+            fill(in, len, kind);
+            check_cobs(in, len, wire, out);
+        }
+    }
+
+    fill(in, MAXLEN, 4);
+    start = nxtstats_now();
+    for (i = 0; i < 10; i ++)
+        check_cobs(in, MAXLEN, wire, out);
+    ns = nxtstats_now() - start;
+    printf("nxtcobs: %.1f MB/s encoded and decoded\n",
+           10.0 * MAXLEN * 1000 / ns);
+
+    free(in);
+    free(wire);
+    free(out);
+    return EXIT_SUCCESS;
+}
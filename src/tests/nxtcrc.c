@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "../Loader/delta.h"
+#include "../Loader/verify.h"
+#include "../NxtAccess/nxtcrc.h"
+#include "../NxtAccess/nxtstats.h"
+
+/* CRC-32 against the reference check value and a bitwise
+ * implementation, then a verified upload to a simulated device
+ * corrupting some of the blocks */
+
+#define LEN (64 * 1024)
+#define NBLOCKS 40
+
+/* One bit at a time, as in the specification */
+static uint32_t crc32_bitwise(const uint8_t *p, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    unsigned k;
+
+    while (len-- > 0) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k ++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+static void check_crc(uint8_t *buf)
+{
+    uint64_t start, ns;
+    uint32_t crc;
+    size_t i, len;
+
+    CHECK(nxtcrc32(0, "123456789", 9) == 0xcbf43926);
+    CHECK(nxtcrc32(0, buf, 0) == 0);
+
+    /* Every alignment and length around the word size, and chaining at
+     * any point */
+    for (i = 0; i < LEN; i ++)
+        buf[i] = i * 2654435761u >> 13;
+    for (i = 0; i < 16; i ++)
+        for (len = 0; len < 80; len ++)
+            CHECK(nxtcrc32(0, buf + i, len) == crc32_bitwise(buf + i, len));
+    crc = crc32_bitwise(buf, 4099);
+    for (i = 0; i <= 4099; i += 37)
+        CHECK(nxtcrc32(nxtcrc32(0, buf, i), buf + i, 4099 - i) == crc);
+    CHECK(nxtcrc32(0, buf, LEN) == crc32_bitwise(buf, LEN));
+
+    start = nxtstats_now();
+    for (i = 0, crc = 0; i < 1000; i ++)
+        crc = nxtcrc32(crc, buf, LEN);
+    ns = nxtstats_now() - start;
+    printf("nxtcrc: %.1f MB/s\n", 1000.0 * LEN * 1000 / ns);
+}
+
+static void check_verify(uint8_t *buf)
+{
+    struct nxtsim_params params;
+    struct verify_report r;
+    struct nxtspan spans[2];
+    uint32_t blocks[NBLOCKS];
+    struct image img;
+    int libusb_err;
+    nxtusb_t nxt;
+    size_t i;
+
+    /* Content followed by a zero filled tail, as .bss */
+    spans[0].data = buf;
+    spans[0].len = (NBLOCKS - 4) * DELTA_BLOCK + 100;
+    spans[1].data = NULL;
+    spans[1].len = NBLOCKS * DELTA_BLOCK - spans[0].len;
+    img.spans = spans;
+    img.nspans = 2;
+    img.base = 0x100000;
+    img.len = NBLOCKS * DELTA_BLOCK;
+    for (i = 0; i < NBLOCKS; i ++)
+        blocks[i] = i;
+
+    memset(&params, 0, sizeof(params));
+    params.framing = NXTFRAME_COBS;
+    params.verify = true;
+    params.fault_every = 7;
+    CHECK(nxtusb_new_sim(&nxt, &params) == NXERR_SUCCESS);
+    CHECK(verify_send(nxt, &img, blocks, NBLOCKS, NXTFRAME_COBS, &r,
+                      &libusb_err) == NXERR_SUCCESS);
+    CHECK(r.blocks == NBLOCKS);
+    CHECK(r.resent > 0);
+    CHECK(r.failed == 0);
+    nxtusb_free(nxt);
+}
+
+int main(void)
+{
+    uint8_t *buf;
+
+    buf = malloc(LEN);
+    CHECK(buf != NULL);
+    check_crc(buf);
+    check_verify(buf);
+    free(buf);
+    return EXIT_SUCCESS;
+}
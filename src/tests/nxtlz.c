@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "../NxtAccess/nxtlz.h"
+#include "../NxtAccess/nxtstats.h"
+#include "../flash.h"
+
+/* LZ streams of awkward payloads decoded back by the reference decoder,
+ * then compressed images flashed to the simulator, which decompresses
+ * them as the brick would */
+
+#define MAXLEN (3 * NXTLZ_BLOCK + 1000)
+#define MAXZEROS 97
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* Payload kinds: zeros, no zeros, runs around the group size, random
+ * bytes, text-like data with repetitions */
+static void fill(uint8_t *buf, size_t len, unsigned kind)
+{
+    size_t i;
+
+    for (i = 0; i < len; i ++) {
+        switch (kind) {
+            case 0: buf[i] = 0; break;
+            case 1: buf[i] = 1 + i % 255; break;
+            case 2: buf[i] = i % 254 == 253 ? 0 : 0xaa; break;
+            case 3: buf[i] = rnd(); break;
+            default: buf[i] = "abcd efgh\0"[rnd() % 4 + i % 7]; break;
+        }
+    }
+}
+
+/* Zero spans and block boundaries in the middle of the payload */
+static void split(struct nxtspan *spans, const uint8_t *in, size_t len)
+{
+    size_t cut = len / 3;
+
+    spans[0].data = in;
+    spans[0].len = cut;
+    spans[1].data = NULL;
+    spans[1].len = len % MAXZEROS;
+    spans[2].data = in + cut;
+    spans[2].len = len - cut;
+}
+
+/* Whether data holds the spans, one after the other */
+static void check_spans(const uint8_t *data, size_t len,
+                        const struct nxtspan *spans, size_t n)
+{
+    size_t i, j, off;
+
+    for (i = 0, off = 0; i < n; off += spans[i ++].len) {
+        CHECK(off + spans[i].len <= len);
+        if (spans[i].data != NULL)
+            CHECK(memcmp(data + off, spans[i].data, spans[i].len) == 0);
+        else
+            for (j = 0; j < spans[i].len; j ++)
+                CHECK(data[off + j] == 0);
+    }
+    CHECK(off == len);
+}
+
+struct lz_buf {
+    uint8_t *data;
+    size_t len;
+};
+
+static int lz_out(void *udata, const uint8_t *data, size_t len)
+{
+    struct lz_buf *b = udata;
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void lz_emit(void *udata, const uint8_t *data, size_t len)
+{
+    struct lz_buf *b = udata;
+
+    CHECK(b->len + len <= MAXLEN + MAXZEROS);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static size_t check_lz(const uint8_t *in, size_t len, uint8_t *wire,
+                       uint8_t *out)
+{
+    static struct nxtlz_dec d;
+    struct nxtspan spans[3];
+    struct lz_buf c = { wire, 0 }, p = { out, 0 };
+
+    split(spans, in, len);
+    CHECK(nxtlz_compress(spans, 3, 0, lz_out, &c) == 0);
+
+    nxtlz_dec_init(&d);
+    CHECK(nxtlz_decode(&d, wire, c.len, lz_emit, &p));
+    CHECK(nxtlz_dec_complete(&d));
+    check_spans(out, p.len, spans, 3);
+    return c.len;
+}
+
+/* Flashes the payload compressed, streamed through the compressor or
+ * packed beforehand. The record goes out raw, and is stored as is. */
+static void check_sim(const uint8_t *in, size_t len, nxtframe_t framing,
+                      bool packed)
+{
+    struct nxtsim_params params;
+    struct settings set;
+    struct prepared p;
+    struct nxtspan spans[3];
+    const uint8_t *image;
+    size_t ilen, i;
+    int luerr;
+    nxtusb_t nxt;
+
+    memset(&p, 0, sizeof(p));
+    /* Frame delimiters and escapes in the record too */
+    for (i = 0; i < sizeof(p.rec); i ++)
+        ((uint8_t *)&p.rec)[i] = i * 37;
+    split(spans, in, len);
+    p.img.spans = spans;
+    p.img.nspans = 3;
+    p.img.len = len + spans[1].len;
+    if (packed)
+        prepared_pack(&p);
+
+    memset(&set, 0, sizeof(set));
+    set.framing = framing;
+    set.compress = true;
+    memset(&params, 0, sizeof(params));
+    params.framing = framing;
+    params.compressed = true;
+    params.record_len = sizeof(p.rec);
+    CHECK(nxtusb_new_sim(&nxt, &params) == NXERR_SUCCESS);
+
+    CHECK(flash_one(nxt, &p, &set, &luerr) == NXERR_SUCCESS);
+    CHECK(nxtsim_frames(nxt) == 1);
+    image = nxtsim_image(nxt, &ilen);
+    CHECK(ilen >= sizeof(p.rec));
+    CHECK(memcmp(image, &p.rec, sizeof(p.rec)) == 0);
+    check_spans(image + sizeof(p.rec), ilen - sizeof(p.rec), spans, 3);
+
+    nxtusb_free(nxt);
+    free((void *)p.packed.data);
+}
+
+int main(void)
+{
+    static const size_t lens[] = {
+        0, 1, 255, 4095, 4096, 4097,
+        NXTLZ_BLOCK - 1, NXTLZ_BLOCK, 2 * NXTLZ_BLOCK + 1
+    };
+    uint8_t *in, *wire, *out;
+    uint64_t start, ns;
+    size_t i, len, total;
+    unsigned kind, f;
+    nxtframe_t framing;
+
+    in = malloc(MAXLEN);
+    wire = malloc(NXTLZ_MAXLEN(MAXLEN));
+    out = malloc(MAXLEN + MAXZEROS);
+    CHECK(in != NULL && wire != NULL && out != NULL);
+
+    for (kind = 0; kind < 5; kind ++) {
+        for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i ++) {
+            fill(in, lens[i], kind);
+            check_lz(in, lens[i], wire, out);
+            for (f = 0; f < 2; f ++) {
+                framing = f == 0 ? NXTFRAME_ESC : NXTFRAME_COBS;
+                check_sim(in, lens[i], framing, false);
+                check_sim(in, lens[i], framing, true);
+            }
+        }
+        for (i = 0; i < 20; i ++) {
+            len = rnd() % MAXLEN;
+            fill(in, len, kind);
+            check_lz(in, len, wire, out);
+        }
+    }
+
+    fill(in, MAXLEN, 4);
+    start = nxtstats_now();
+    for (i = 0, total = 0; i < 10; i ++)
+        total += check_lz(in, MAXLEN, wire, out);
+    ns = nxtstats_now() - start;
+    printf("nxtlz: %.1f MB/s compressed and decoded, ratio %.2f\n",
+           10.0 * MAXLEN * 1000 / ns, (double)total / (10.0 * MAXLEN));
+    for (f = 0; f < 2; f ++) {
+        framing = f == 0 ? NXTFRAME_ESC : NXTFRAME_COBS;
+        start = nxtstats_now();
+        for (i = 0; i < 10; i ++)
+            check_sim(in, MAXLEN, framing, false);
+        ns = nxtstats_now() - start;
+        printf("nxtlz: %s, %.1f MB/s compressed, sent and decompressed\n",
+               f == 0 ? "ESC" : "COBS", 10.0 * MAXLEN * 1000 / ns);
+    }
+
+    free(in);
+    free(wire);
+    free(out);
+    return EXIT_SUCCESS;
+}
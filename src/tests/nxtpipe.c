@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "../NxtAccess/nxtusb.h"
+
+/* Pipelined frames must put the same bytes on the wire as frames
+ * encoded by the sending thread, whatever the framing, the transfer
+ * size and the layout of the payload */
+
+#define LEN (4 * 1024 * 1024)
+
+struct run {
+    uint8_t *wire;
+    size_t wlen;
+    uint8_t *image;
+    size_t ilen;
+    uint64_t ns;
+};
+
+static void send_run(const struct nxtspan *spans, size_t n,
+                     nxtframe_t framing, size_t xfer_len, bool pipelined,
+                     struct run *r)
+{
+    struct nxtsim_params params;
+    const uint8_t *data;
+    int libusb_err;
+    nxtusb_t nxt;
+    uint64_t start;
+
+    memset(&params, 0, sizeof(params));
+    params.framing = framing;
+    CHECK(nxtusb_new_sim(&nxt, &params) == NXERR_SUCCESS);
+    nxtusb_set_xfer_len(nxt, xfer_len);
+    nxtusb_set_pipelined(nxt, pipelined);
+
+    start = nxtstats_now();
+    CHECK(nxtusb_send_spans(nxt, spans, n, framing, &libusb_err) ==
+          NXERR_SUCCESS);
+    r->ns = nxtstats_now() - start;
+    CHECK(nxtsim_frames(nxt) == 1);
+
+    data = nxtsim_wire(nxt, &r->wlen);
+    r->wire = malloc(r->wlen);
+    CHECK(r->wire != NULL);
+    memcpy(r->wire, data, r->wlen);
+    data = nxtsim_image(nxt, &r->ilen);
+    r->image = malloc(r->ilen);
+    CHECK(r->image != NULL);
+    memcpy(r->image, data, r->ilen);
+    nxtusb_free(nxt);
+}
+
+static void check_same(const struct nxtspan *spans, size_t n,
+                       nxtframe_t framing, size_t xfer_len, bool report)
+{
+    struct run plain, piped;
+    size_t i, off;
+
+    send_run(spans, n, framing, xfer_len, false, &plain);
+    send_run(spans, n, framing, xfer_len, true, &piped);
+    CHECK(plain.wlen == piped.wlen);
+    CHECK(memcmp(plain.wire, piped.wire, plain.wlen) == 0);
+
+    /* And the device got the payload */
+    CHECK(piped.ilen == plain.ilen);
+    for (i = 0, off = 0; i < n; off += spans[i ++].len) {
+        CHECK(off + spans[i].len <= piped.ilen);
+        if (spans[i].data != NULL)
+            CHECK(memcmp(piped.image + off, spans[i].data,
+                         spans[i].len) == 0);
+    }
+    CHECK(off == piped.ilen);
+
+    if (report)
+        printf("nxtpipe: %s, %.1f MB/s encoded and sent, %.1f MB/s "
+               "pipelined\n", framing == NXTFRAME_ESC ? "ESC" : "COBS",
+               (double)off * 1000 / plain.ns, (double)off * 1000 / piped.ns);
+    free(plain.wire);
+    free(plain.image);
+    free(piped.wire);
+    free(piped.image);
+}
+
+int main(void)
+{
+    static const size_t xfer_lens[] = { 64, 4096, 64 * 1024 };
+    struct nxtspan spans[4];
+    nxtframe_t framing;
+    uint8_t *buf;
+    unsigned f, x;
+    size_t i;
+
+    /* Bytes to be escaped and zeros to be stuffed all over */
+    buf = malloc(LEN);
+    CHECK(buf != NULL);
+    for (i = 0; i < LEN; i ++)
+        buf[i] = i * 2654435761u >> 24;
+
+    spans[0].data = buf;
+    spans[0].len = LEN / 2 + 13;
+    spans[1].data = NULL;
+    spans[1].len = 100000;
+    spans[2].data = buf + spans[0].len;
+    spans[2].len = 1;
+    spans[3].data = buf + spans[0].len + 1;
+    spans[3].len = LEN - spans[0].len - 1;
+
+    for (f = 0; f < 2; f ++) {
+        framing = f == 0 ? NXTFRAME_ESC : NXTFRAME_COBS;
+        for (x = 0; x < sizeof(xfer_lens) / sizeof(xfer_lens[0]); x ++)
+            check_same(spans, 4, framing, xfer_lens[x], false);
+        /* Below the pipelining threshold */
+        spans[0].len = 1000;
+        check_same(spans, 1, framing, 4096, false);
+        spans[0].len = LEN / 2 + 13;
+        check_same(spans, 4, framing, 64 * 1024, true);
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}